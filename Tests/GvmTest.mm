@@ -354,6 +354,2428 @@ using namespace Gvm;
 #undef ClusterKey
 }
 
+// Insert duplicate 2D points through a dedup stage, each unique point
+// should be added to the clusters once with the accumulated mass.
+
+- (void)testGvmDedup2D {
+  
+# define FP double
+# define ClusterVector GvmStdVector<FP,2>
+# define ClusterVectorSpace GvmVectorSpace<ClusterVector,FP,2>
+# define ClusterKey vector<int>
+  
+  ClusterVectorSpace vspace;
+  
+  GvmClusters<ClusterVectorSpace, ClusterVector, ClusterKey, FP> clusters(vspace, 256);
+  
+  GvmListKeyer<ClusterVectorSpace, ClusterVector, ClusterKey, FP> intListKeyer;
+  clusters.setKeyer(&intListKeyer);
+  
+  GvmDedup<ClusterVectorSpace, ClusterVector, ClusterKey, FP> dedup(clusters, 1024 * 1024, &intListKeyer);
+  
+  ClusterVector pt;
+  
+  for (int i = 0; i < 30; i++) {
+    pt[0] = i % 3;
+    pt[1] = 1.0;
+    ClusterKey key;
+    key.push_back(i);
+    dedup.add(1, pt, &key);
+  }
+  
+  XCTAssert(dedup.getSize() == 3);
+  XCTAssert(clusters.results().size() == 0);
+  
+  dedup.flush();
+  
+  XCTAssert(dedup.getSize() == 0);
+  
+  vector<GvmResult<ClusterVectorSpace, ClusterVector, ClusterKey, FP>> results = clusters.results();
+  
+  XCTAssert(results.size() == 3);
+  
+  for ( auto & result : results ) {
+    XCTAssert(result.getCount() == 1);
+    XCTAssert(result.getMass() == 10.0);
+    XCTAssert(result.getKey()->size() == 10);
+  }
+  
+#undef FP
+#undef ClusterVector
+#undef ClusterVectorSpace
+#undef ClusterKey
+}
+
+// Keys combined for a repeated point grow on the heap, the dedup stage
+// should flush once the keys push it past its memory cap.
+
+- (void)testGvmDedupKeyCap {
+  
+# define FP double
+# define ClusterVector GvmStdVector<FP,2>
+# define ClusterVectorSpace GvmVectorSpace<ClusterVector,FP,2>
+# define ClusterKey vector<int>
+  
+  ClusterVectorSpace vspace;
+  
+  GvmClusters<ClusterVectorSpace, ClusterVector, ClusterKey, FP> clusters(vspace, 16);
+  
+  GvmListKeyer<ClusterVectorSpace, ClusterVector, ClusterKey, FP> intListKeyer;
+  clusters.setKeyer(&intListKeyer);
+  
+  typedef GvmDedup<ClusterVectorSpace, ClusterVector, ClusterKey, FP> Dedup;
+  
+  const size_t maxBytes = 8 * Dedup::bytesPerEntry();
+  
+  Dedup dedup(clusters, maxBytes, &intListKeyer);
+  
+  ClusterVector pt;
+  pt[0] = 1.0;
+  pt[1] = 2.0;
+  
+  for (int i = 0; i < 1000; i++) {
+    ClusterKey key;
+    key.push_back(i);
+    dedup.add(1, pt, &key);
+    XCTAssert(dedup.getBytes() <= maxBytes);
+  }
+  
+  // A single unique point never fills the entries, only the keys can
+  
+  XCTAssert(dedup.getSize() == 1);
+  XCTAssert(dedup.flushes > 0);
+  
+  dedup.flush();
+  
+  FP mass = 0.0;
+  size_t keys = 0;
+  for ( auto & result : clusters.results() ) {
+    mass += result.getMass();
+    keys += result.getKey()->size();
+  }
+  
+  XCTAssert(mass == 1000.0);
+  XCTAssert(keys == 1000);
+  
+#undef FP
+#undef ClusterVector
+#undef ClusterVectorSpace
+#undef ClusterKey
+}
+
+// Runs of identical pixels in a row should be folded into one add() per run.
+
+- (void)testGvmRunLength {
+  
+# define FP double
+# define ClusterVector GvmStdVector<FP,3>
+# define ClusterVectorSpace GvmVectorSpace<ClusterVector,FP,3>
+# define ClusterKey vector<uint32_t>
+  
+  uint32_t row[] = {
+    0x1, 0x1, 0x1, 0x1, 0x1, 0x1, 0x1, 0x1, 0x1,
+    0x2,
+    0x3, 0x3, 0x3, 0x3, 0x3,
+    0x1
+  };
+  
+  const int width = sizeof(row)/sizeof(uint32_t);
+  
+  typedef GvmRunLength<ClusterVectorSpace, ClusterVector, ClusterKey, FP> RunLength;
+  
+  XCTAssert(RunLength::runLength(row, 0, width) == 9);
+  XCTAssert(RunLength::runLength(row, 3, width) == 6);
+  XCTAssert(RunLength::runLength(row, 9, width) == 1);
+  XCTAssert(RunLength::runLength(row, 10, width) == 5);
+  XCTAssert(RunLength::runLength(row, 15, width) == 1);
+  
+  ClusterVectorSpace vspace;
+  
+  GvmClusters<ClusterVectorSpace, ClusterVector, ClusterKey, FP> clusters(vspace, 256);
+  
+  GvmListKeyer<ClusterVectorSpace, ClusterVector, ClusterKey, FP> listKeyer;
+  clusters.setKeyer(&listKeyer);
+  
+  int numAdds = RunLength::addRow(clusters, row, width,
+    [](uint32_t pixel, ClusterVector &pt) {
+      pt[0] = pixel & 0xFF;
+      pt[1] = (pixel >> 8) & 0xFF;
+      pt[2] = (pixel >> 16) & 0xFF;
+    },
+    [](const uint32_t *runPtr, int runLength, ClusterKey &key) {
+      key.insert(key.end(), runPtr, runPtr + runLength);
+    });
+  
+  XCTAssert(numAdds == 4);
+  
+  vector<GvmResult<ClusterVectorSpace, ClusterVector, ClusterKey, FP>> results = clusters.results();
+  
+  XCTAssert(results.size() == 4);
+  XCTAssert(results[0].getMass() == 9.0);
+  XCTAssert(results[0].getKey()->size() == 9);
+  XCTAssert(results[2].getMass() == 5.0);
+  XCTAssert(results[2].getKey()->size() == 5);
+  
+#undef FP
+#undef ClusterVector
+#undef ClusterVectorSpace
+#undef ClusterKey
+}
+
+// Reduce a grid of 2D points to a weighted coreset, the variance of the
+// representatives plus the lost variance must equal the input variance.
+
+- (void)testGvmCoreset2D {
+  
+# define FP double
+# define ClusterVector GvmStdVector<FP,2>
+# define ClusterVectorSpace GvmVectorSpace<ClusterVector,FP,2>
+# define ClusterKey vector<int>
+  
+  ClusterVectorSpace vspace;
+  
+  vector<ClusterVector> listOfPoints;
+  
+  for (int y = 0; y < 100; y++) {
+    for (int x = 0; x < 100; x++) {
+      ClusterVector pt;
+      pt[0] = x;
+      pt[1] = y;
+      listOfPoints.push_back(pt);
+    }
+  }
+  
+  GvmCoreset<ClusterVectorSpace, ClusterVector, ClusterKey, FP> coreset(vspace, 64);
+  
+  coreset.build(listOfPoints);
+  
+  XCTAssert(coreset.getSize() > 0);
+  XCTAssert(coreset.getSize() <= 64);
+  XCTAssert(coreset.assignment.size() == listOfPoints.size());
+  
+  FP m0 = 0.0;
+  ClusterVector m1 = vspace.newOrigin();
+  ClusterVector m2 = vspace.newOrigin();
+  
+  for (int i = 0; i < coreset.getSize(); i++) {
+    m0 += coreset.masses[i];
+    vspace.addScaled(m1, coreset.masses[i], coreset.points[i]);
+    vspace.addScaledSqr(m2, coreset.masses[i], coreset.points[i]);
+  }
+  
+  XCTAssert(m0 == 100.0 * 100.0);
+  
+  FP repVar = vspace.variance(m0, m1, m2);
+  
+  XCTAssert(fabs((repVar + coreset.lostVar) - coreset.totalVar) < (coreset.totalVar * 1e-9));
+  XCTAssert(coreset.getDeviation() > 0.0 && coreset.getDeviation() < 0.1);
+  
+  // Cells are numbered in the order their first point appears, whatever
+  // the number of threads.
+  
+  int nextCell = 0;
+  for (size_t i = 0; i < coreset.assignment.size(); i++) {
+    XCTAssert(coreset.assignment[i] <= nextCell);
+    if (coreset.assignment[i] == nextCell) {
+      nextCell++;
+    }
+  }
+  XCTAssert(nextCell == coreset.getSize());
+  
+  GvmCoreset<ClusterVectorSpace, ClusterVector, ClusterKey, FP> serialCoreset(vspace, 64, 1);
+  GvmCoreset<ClusterVectorSpace, ClusterVector, ClusterKey, FP> threadedCoreset(vspace, 64, 5);
+  serialCoreset.build(listOfPoints);
+  threadedCoreset.build(listOfPoints);
+  
+  XCTAssert(serialCoreset.resolution == threadedCoreset.resolution);
+  XCTAssert(serialCoreset.assignment == threadedCoreset.assignment);
+  XCTAssert(serialCoreset.masses == threadedCoreset.masses);
+  XCTAssert(serialCoreset.getSize() == coreset.getSize());
+  
+  // Feed representatives into clusters
+  
+  GvmClusters<ClusterVectorSpace, ClusterVector, ClusterKey, FP> clusters(vspace, 16);
+  
+  coreset.addTo(clusters);
+  
+  vector<GvmResult<ClusterVectorSpace, ClusterVector, ClusterKey, FP>> results = clusters.results();
+  
+  XCTAssert(results.size() == 16);
+  
+#undef FP
+#undef ClusterVector
+#undef ClusterVectorSpace
+#undef ClusterKey
+}
+
+// With more than 32 dimensions the cell coordinates no longer fit in the
+// packed code and are hashed, the grid must still split the points.
+
+- (void)testGvmCoresetHighDim {
+  
+# define FP double
+# define ClusterVector GvmStdVector<FP,80>
+# define ClusterVectorSpace GvmVectorSpace<ClusterVector,FP,80>
+# define ClusterKey vector<int>
+  
+  ClusterVectorSpace vspace;
+  
+  vector<ClusterVector> listOfPoints;
+  
+  for (int i = 0; i < 400; i++) {
+    ClusterVector pt;
+    for (int d = 0; d < 80; d++) {
+      pt[d] = ((i + d) % 4) * 10.0 + (i % 3);
+    }
+    listOfPoints.push_back(pt);
+  }
+  
+  GvmCoreset<ClusterVectorSpace, ClusterVector, ClusterKey, FP> coreset(vspace, 32);
+  
+  coreset.build(listOfPoints);
+  
+  XCTAssert(coreset.resolution > 1);
+  XCTAssert(coreset.getSize() > 1);
+  XCTAssert(coreset.getSize() <= 32);
+  
+  FP m0 = 0.0;
+  ClusterVector m1 = vspace.newOrigin();
+  ClusterVector m2 = vspace.newOrigin();
+  
+  for (int i = 0; i < coreset.getSize(); i++) {
+    m0 += coreset.masses[i];
+    vspace.addScaled(m1, coreset.masses[i], coreset.points[i]);
+    vspace.addScaledSqr(m2, coreset.masses[i], coreset.points[i]);
+  }
+  
+  XCTAssert(m0 == 400.0);
+  
+  FP repVar = vspace.variance(m0, m1, m2);
+  
+  XCTAssert(fabs((repVar + coreset.lostVar) - coreset.totalVar) < (coreset.totalVar * 1e-9));
+  
+#undef FP
+#undef ClusterVector
+#undef ClusterVectorSpace
+#undef ClusterKey
+}
+
+// Integer vector space keeps exact moments, a cluster of identical
+// points must have a variance of exactly zero.
+
+- (void)testIntVectorSpace3D {
+  
+# define FP double
+# define ClusterVector GvmIntVector<3>
+# define ClusterVectorSpace GvmIntVectorSpace<ClusterVector,FP,3>
+# define ClusterKey vector<int>
+  
+  ClusterVectorSpace vspace;
+  XCTAssert(vspace.getDimensions() == 3, @"Pass");
+  
+  // Masses that toInt() rejects
+  
+  XCTAssert(ClusterVectorSpace::isWholeMass(3.0), @"Pass");
+  XCTAssert(ClusterVectorSpace::isWholeMass(-2.0), @"Pass");
+  XCTAssert(!ClusterVectorSpace::isWholeMass(1.5), @"Pass");
+  XCTAssert(!ClusterVectorSpace::isWholeMass(NAN), @"Pass");
+  XCTAssert(!ClusterVectorSpace::isWholeMass(INFINITY), @"Pass");
+  XCTAssert(!ClusterVectorSpace::isWholeMass(9223372036854775808.0), @"Pass");
+  XCTAssert(!ClusterVectorSpace::isWholeMass(-1.0e19), @"Pass");
+  XCTAssert(ClusterVectorSpace::toInt(7.0) == 7, @"Pass");
+  
+  ClusterVector vec1;
+  vec1[0] = 1;
+  vec1[1] = 2;
+  vec1[2] = 3;
+  
+  ClusterVector sq1 = vspace.newOrigin();
+  vspace.setToScaledSqr(sq1, 2.0, vec1);
+  XCTAssert(sq1[0] == 2, @"Pass");
+  XCTAssert(sq1[1] == 8, @"Pass");
+  XCTAssert(sq1[2] == 18, @"Pass");
+  
+  ClusterVector m1 = vspace.newOrigin();
+  vspace.setToScaled(m1, 2.0, vec1);
+  
+  // Two identical points have zero variance
+  
+  XCTAssert(vspace.variance(2.0, m1, sq1) == 0.0, @"Pass");
+  
+  // Points (1,2,3) and (3,2,1) each with mass 1
+  
+  ClusterVector vec2;
+  vec2[0] = 3;
+  vec2[1] = 2;
+  vec2[2] = 1;
+  
+  vspace.setToScaled(m1, 1.0, vec1);
+  vspace.setToScaledSqr(sq1, 1.0, vec1);
+  
+  XCTAssert(vspace.variance(1.0, m1, sq1, 1.0, vec2) == 4.0, @"Pass");
+  
+  GvmClusters<ClusterVectorSpace, ClusterVector, ClusterKey, FP> clusters(vspace, 4);
+  
+  ClusterVector pt;
+  pt[0] = 255;
+  pt[1] = 3;
+  pt[2] = 7;
+  
+  for (int i = 0; i < 100000; i++) {
+    clusters.add(1, pt, nullptr);
+  }
+  
+  vector<GvmResult<ClusterVectorSpace, ClusterVector, ClusterKey, FP>> results = clusters.results();
+  
+  XCTAssert(results.size() == 4);
+  
+  FP totalMass = 0.0;
+  
+  for ( auto & result : results ) {
+    XCTAssert(result.getVariance() == 0.0);
+    XCTAssert(result.point[0] == 255);
+    totalMass += result.getMass();
+  }
+  
+  XCTAssert(totalMass == 100000.0);
+  
+#undef FP
+#undef ClusterVector
+#undef ClusterVectorSpace
+#undef ClusterKey
+}
+
+// Clustering compact 4 byte pixel inputs must give the same result as
+// clustering the same pixels widened to vectors of double.
+
+- (void)testGvmPixelVector {
+  
+# define FP double
+# define ClusterVector GvmStdVector<FP,3>
+# define ClusterVectorSpace GvmVectorSpace<ClusterVector,FP,3>
+# define ClusterKey vector<uint32_t>
+  
+  GvmPixelVector pv(0xFF030201);
+  XCTAssert(sizeof(GvmPixelVector) == sizeof(uint32_t));
+  XCTAssert(pv[0] == 1 && pv[1] == 2 && pv[2] == 3);
+  
+  ClusterVectorSpace vspace;
+  
+  GvmClusters<ClusterVectorSpace, ClusterVector, ClusterKey, FP> clusters1(vspace, 8);
+  GvmClusters<ClusterVectorSpace, ClusterVector, ClusterKey, FP> clusters2(vspace, 8);
+  
+  for (uint32_t i = 0; i < 100; i++) {
+    uint32_t pixel = (i * 2654435761U) & 0x00FFFFFF;
+    
+    ClusterVector pt;
+    pt[0] = pixel & 0xFF;
+    pt[1] = (pixel >> 8) & 0xFF;
+    pt[2] = (pixel >> 16) & 0xFF;
+    clusters1.add(1, pt, nullptr);
+    
+    GvmPixelVector pixelPt(pixel);
+    clusters2.add(1, pixelPt, nullptr);
+  }
+  
+  vector<GvmResult<ClusterVectorSpace, ClusterVector, ClusterKey, FP>> results1 = clusters1.results();
+  vector<GvmResult<ClusterVectorSpace, ClusterVector, ClusterKey, FP>> results2 = clusters2.results();
+  
+  XCTAssert(results1.size() == results2.size());
+  
+  for (int i = 0; i < results1.size(); i++) {
+    XCTAssert(results1[i].getMass() == results2[i].getMass());
+    XCTAssert(results1[i].getVariance() == results2[i].getVariance());
+    XCTAssert(results1[i].point[0] == results2[i].point[0]);
+  }
+  
+#undef FP
+#undef ClusterVector
+#undef ClusterVectorSpace
+#undef ClusterKey
+}
+
+// A runtime dimension vector space must cluster points the same way
+// as the compile time fixed size space with the same dimensions.
+
+- (void)testDynVectorSpace {
+  
+# define FP double
+# define ClusterVector GvmStdVector<FP,5>
+# define ClusterVectorSpace GvmVectorSpace<ClusterVector,FP,5>
+# define DynClusterVector GvmDynVector<FP>
+# define DynClusterVectorSpace GvmDynVectorSpace<DynClusterVector,FP>
+# define ClusterKey vector<int>
+  
+  ClusterVectorSpace vspace;
+  DynClusterVectorSpace dynspace(5);
+  
+  XCTAssert(dynspace.getDimensions() == 5);
+  
+  DynClusterVector vec1 = dynspace.newOrigin();
+  XCTAssert(vec1.getDimensions() == 5);
+  XCTAssert(((uintptr_t)vec1.values % 64) == 0);
+  
+  vec1[0] = 1;
+  vec1[4] = 2;
+  XCTAssert(dynspace.magnitudeSqr(vec1) == 5.0);
+  
+  GvmClusters<ClusterVectorSpace, ClusterVector, ClusterKey, FP> clusters(vspace, 8);
+  GvmClusters<DynClusterVectorSpace, DynClusterVector, ClusterKey, FP> dynClusters(dynspace, 8);
+  
+  ClusterVector pt;
+  DynClusterVector dynPt = dynspace.newOrigin();
+  
+  for (int i = 0; i < 200; i++) {
+    for (int d = 0; d < 5; d++) {
+      FP v = ((i * 7 + d * 13) % 17) + ((i % 3) * 20);
+      pt[d] = v;
+      dynPt[d] = v;
+    }
+    clusters.add(1, pt, nullptr);
+    dynClusters.add(1, dynPt, nullptr);
+  }
+  
+  vector<GvmResult<ClusterVectorSpace, ClusterVector, ClusterKey, FP>> results = clusters.results();
+  vector<GvmResult<DynClusterVectorSpace, DynClusterVector, ClusterKey, FP>> dynResults = dynClusters.results();
+  
+  XCTAssert(results.size() == dynResults.size());
+  
+  for (int i = 0; i < results.size(); i++) {
+    XCTAssert(results[i].getMass() == dynResults[i].getMass());
+    XCTAssert(fabs(results[i].getVariance() - dynResults[i].getVariance()) < 1e-6);
+    for (int d = 0; d < 5; d++) {
+      XCTAssert(fabs(results[i].point[d] - dynResults[i].point[d]) < 1e-9);
+    }
+  }
+  
+#undef FP
+#undef ClusterVector
+#undef ClusterVectorSpace
+#undef DynClusterVector
+#undef DynClusterVectorSpace
+#undef ClusterKey
+}
+
+- (void)testSparseVectorSpace {
+  
+# define FP double
+# define DynClusterVector GvmDynVector<FP>
+# define DynClusterVectorSpace GvmDynVectorSpace<DynClusterVector,FP>
+# define SparseClusterVectorSpace GvmSparseVectorSpace<DynClusterVector,FP>
+# define ClusterKey vector<int>
+  
+  const int D = 1000;
+  
+  DynClusterVectorSpace dynspace(D);
+  SparseClusterVectorSpace sparsespace(D);
+  
+  GvmSparseVector<FP> sparsePt = sparsespace.newSparse();
+  sparsePt.push(3, 2.0);
+  sparsePt.push(10, 0.0);
+  sparsePt.push(900, 1.0);
+  XCTAssert(sparsePt.getNonZeroCount() == 2);
+  XCTAssert(sparsePt.magnitudeSqr() == 5.0);
+  XCTAssert(sparsePt[3] == 2.0);
+  XCTAssert(sparsePt[4] == 0.0);
+  
+  GvmClusters<DynClusterVectorSpace, DynClusterVector, ClusterKey, FP> dynClusters(dynspace, 8);
+  GvmClusters<SparseClusterVectorSpace, DynClusterVector, ClusterKey, FP> sparseClusters(sparsespace, 8);
+  
+  DynClusterVector dynPt = dynspace.newOrigin();
+  
+  for (int i = 0; i < 200; i++) {
+    dynspace.setToOrigin(dynPt);
+    sparsePt.clear();
+    
+    // 5 non-zero values per point, each group of points shares a block of dimensions
+    
+    int base = (i % 4) * 100;
+    for (int j = 0; j < 5; j++) {
+      int d = base + ((i * 7 + j * 13) % 20) + (j * 20);
+      FP v = 1 + ((i + j) % 3);
+      dynPt[d] = v;
+      sparsePt.push(d, v);
+    }
+    
+    dynClusters.add(1, dynPt, nullptr);
+    sparseClusters.add(1, sparsePt, nullptr);
+  }
+  
+  vector<GvmResult<DynClusterVectorSpace, DynClusterVector, ClusterKey, FP>> dynResults = dynClusters.results();
+  vector<GvmResult<SparseClusterVectorSpace, DynClusterVector, ClusterKey, FP>> sparseResults = sparseClusters.results();
+  
+  XCTAssert(dynResults.size() == sparseResults.size());
+  
+  for (int i = 0; i < dynResults.size(); i++) {
+    XCTAssert(dynResults[i].getMass() == sparseResults[i].getMass());
+    XCTAssert(fabs(dynResults[i].getVariance() - sparseResults[i].getVariance()) < 1e-6);
+    for (int d = 0; d < D; d++) {
+      XCTAssert(fabs(dynResults[i].point[d] - sparseResults[i].point[d]) < 1e-9);
+    }
+  }
+  
+#undef FP
+#undef DynClusterVector
+#undef DynClusterVectorSpace
+#undef SparseClusterVectorSpace
+#undef ClusterKey
+}
+
+- (void)testLshCandidates {
+  
+# define FP double
+# define ClusterVector GvmStdVector<FP,16>
+# define ClusterVectorSpace GvmVectorSpace<ClusterVector,FP,16>
+# define ClusterKey vector<int>
+  
+  ClusterVectorSpace vspace;
+  
+  GvmClusters<ClusterVectorSpace, ClusterVector, ClusterKey, FP> exactClusters(vspace, 32);
+  GvmClusters<ClusterVectorSpace, ClusterVector, ClusterKey, FP> lshClusters(vspace, 32);
+  
+  lshClusters.setLsh(4, 6, 1, true);
+  
+  XCTAssert(exactClusters.getLsh() == nullptr);
+  XCTAssert(lshClusters.getLsh() != nullptr);
+  
+  // 40 well separated groups of points
+  
+  ClusterVector pt;
+  
+  for (int i = 0; i < 2000; i++) {
+    int group = (i * 17) % 40;
+    for (int d = 0; d < 16; d++) {
+      FP center = ((group * 31 + d * 7) % 23) * 10;
+      FP jitter = ((i * 13 + d * 5) % 7) * 0.1;
+      pt[d] = center + jitter;
+    }
+    exactClusters.add(1, pt, nullptr);
+    lshClusters.add(1, pt, nullptr);
+  }
+  
+  GvmLshIndex<ClusterVectorSpace, ClusterVector, ClusterKey, FP> &lsh = *lshClusters.getLsh();
+  
+  XCTAssert(lsh.built);
+  XCTAssert(lsh.queries == 2000 - 32);
+  
+  // Fewer clusters are tested than with the exact scan and the
+  // exact best cluster is only rarely missed.
+  
+  XCTAssert(lsh.scored < lsh.queries * 32);
+  XCTAssert(lsh.getMissRate() < 0.2);
+  
+  // Every slot is in the bucket of its current code in each table
+  
+  for (int t = 0; t < lsh.tables; t++) {
+    size_t bucketed = 0;
+    for (auto &entry : lsh.buckets[t]) {
+      for (int slot : entry.second) {
+        XCTAssert(lsh.codes[(size_t)slot * lsh.tables + t] == entry.first);
+      }
+      bucketed += entry.second.size();
+    }
+    XCTAssert(bucketed == 32);
+  }
+  
+  exactClusters.reduce(-1, 30);
+  lshClusters.reduce(-1, 30);
+  
+  XCTAssert(lsh.built == false);
+  
+  vector<GvmResult<ClusterVectorSpace, ClusterVector, ClusterKey, FP>> exactResults = exactClusters.results();
+  vector<GvmResult<ClusterVectorSpace, ClusterVector, ClusterKey, FP>> lshResults = lshClusters.results();
+  
+  XCTAssert(exactResults.size() == 30);
+  XCTAssert(lshResults.size() == 30);
+  
+  FP exactVar = 0;
+  FP lshVar = 0;
+  FP lshMass = 0;
+  for (int i = 0; i < 30; i++) {
+    exactVar += exactResults[i].getVariance() * exactResults[i].getMass();
+    lshVar += lshResults[i].getVariance() * lshResults[i].getMass();
+    lshMass += lshResults[i].getMass();
+  }
+  
+  XCTAssert(lshMass == 2000);
+  XCTAssert(lshVar < exactVar * 1.5);
+  
+  lshClusters.resetLsh();
+  XCTAssert(lshClusters.getLsh() == nullptr);
+  
+  // Probing every code within all the bits makes every cluster a
+  // candidate, so the choices match the exact scan.
+  
+  GvmClusters<ClusterVectorSpace, ClusterVector, ClusterKey, FP> fullClusters(vspace, 32);
+  fullClusters.setLsh(2, 4, 4, true);
+  exactClusters.clear();
+  
+  for (int i = 0; i < 500; i++) {
+    for (int d = 0; d < 16; d++) {
+      pt[d] = ((i * 37 + d * 11) % 101) * 0.5;
+    }
+    exactClusters.add(1, pt, nullptr);
+    fullClusters.add(1, pt, nullptr);
+  }
+  
+  GvmLshIndex<ClusterVectorSpace, ClusterVector, ClusterKey, FP> &fullLsh = *fullClusters.getLsh();
+  
+  XCTAssert(fullLsh.misses == 0);
+  XCTAssert(fullLsh.fallbacks == 0);
+  XCTAssert(fullLsh.scored == fullLsh.queries * 32);
+  
+  exactResults = exactClusters.results();
+  vector<GvmResult<ClusterVectorSpace, ClusterVector, ClusterKey, FP>> fullResults = fullClusters.results();
+  XCTAssert(exactResults.size() == fullResults.size());
+  for (size_t i = 0; i < fullResults.size(); i++) {
+    XCTAssert(fullResults[i].getMass() == exactResults[i].getMass());
+    XCTAssert(fullResults[i].getVariance() == exactResults[i].getVariance());
+  }
+  
+#undef FP
+#undef ClusterVector
+#undef ClusterVectorSpace
+#undef ClusterKey
+}
+
+- (void)testGvmProjection {
+  
+# define FP double
+# define ClusterVector GvmStdVector<FP,8>
+# define ClusterVectorSpace GvmVectorSpace<ClusterVector,FP,8>
+  
+  const int D = 64;
+  const int N = 400;
+  
+  ClusterVectorSpace vspace;
+  GvmClusters<ClusterVectorSpace, ClusterVector, vector<FP>, FP> clusters(vspace, 4);
+  GvmProjection<ClusterVectorSpace, ClusterVector, FP> projection(clusters, D);
+  
+  XCTAssert(projection.inputDimensions == D);
+  XCTAssert(projection.outputDimensions == 8);
+  
+  // 4 well separated groups of points in the original space
+  
+  vector<FP> in(N * D);
+  vector<FP> groupSums(4 * D, 0.0);
+  
+  for (int p = 0; p < N; p++) {
+    int group = p % 4;
+    for (int i = 0; i < D; i++) {
+      FP v = ((i % 4) == group ? 100.0 : 0.0) + ((p * 7 + i * 3) % 5);
+      in[p * D + i] = v;
+      groupSums[group * D + i] += v;
+    }
+  }
+  
+  // Batch projection gives the same result as projecting one point at a time
+  
+  vector<FP> batchOut(N * 8);
+  projection.projectBatch(in.data(), N, batchOut.data());
+  
+  FP sumRatio = 0.0;
+  
+  for (int p = 0; p < N; p++) {
+    FP out[8];
+    projection.project(&in[p * D], out);
+    FP inMag = 0.0;
+    FP outMag = 0.0;
+    for (int j = 0; j < 8; j++) {
+      XCTAssert(out[j] == batchOut[p * 8 + j]);
+      outMag += out[j] * out[j];
+    }
+    for (int i = 0; i < D; i++) {
+      inMag += in[p * D + i] * in[p * D + i];
+    }
+    sumRatio += outMag / inMag;
+  }
+  
+  // Squared magnitudes are preserved on average
+  
+  FP meanRatio = sumRatio / N;
+  XCTAssert(meanRatio > 0.5 && meanRatio < 1.5);
+  
+  projection.add(in.data(), N);
+  
+  vector<GvmResult<ClusterVectorSpace, ClusterVector, vector<FP>, FP>> results = clusters.results();
+  
+  XCTAssert(results.size() == 4);
+  
+  // The original space centroid of each cluster is the exact mean of a group
+  
+  for (int i = 0; i < results.size(); i++) {
+    GvmResult<ClusterVectorSpace, ClusterVector, vector<FP>, FP> &result = results[i];
+    XCTAssert(result.getMass() == N / 4);
+    
+    vector<FP> centroid = projection.originalPoint(result);
+    XCTAssert(centroid.size() == D);
+    
+    int group = 0;
+    for (int g = 1; g < 4; g++) {
+      if (centroid[g] > centroid[group]) {
+        group = g;
+      }
+    }
+    
+    for (int d = 0; d < D; d++) {
+      FP expected = groupSums[group * D + d] / (N / 4);
+      XCTAssert(fabs(centroid[d] - expected) < 1e-9);
+    }
+  }
+  
+  // Subsampled points scale their original space sums with their mass,
+  // so the centroids stay inside the groups.
+  
+  GvmClusters<ClusterVectorSpace, ClusterVector, vector<FP>, FP> sampledClusters(vspace, 4);
+  GvmProjection<ClusterVectorSpace, ClusterVector, FP> sampledProjection(sampledClusters, D);
+  
+  sampledClusters.setTimeBudget(600.0, 1000000000000LL, 16);
+  for (int r = 0; r < 10; r++) {
+    sampledProjection.add(in.data(), N);
+  }
+  
+  XCTAssert(sampledClusters.getSampleStride() >= 4);
+  
+  results = sampledClusters.results();
+  for (int i = 0; i < results.size(); i++) {
+    vector<FP> centroid = sampledProjection.originalPoint(results[i]);
+    FP maxValue = 0.0;
+    for (int d = 0; d < D; d++) {
+      XCTAssert(centroid[d] >= 0.0 && centroid[d] <= 104.0);
+      maxValue = std::max(maxValue, centroid[d]);
+    }
+    XCTAssert(maxValue > 90.0);
+  }
+  
+#undef FP
+#undef ClusterVector
+#undef ClusterVectorSpace
+}
+
+- (void)testAddBatch {
+  
+# define FP double
+# define ClusterVector GvmStdVector<FP,3>
+# define ClusterVectorSpace GvmVectorSpace<ClusterVector,FP,3>
+# define ClusterKey vector<int>
+  
+  const int N = 1000;
+  
+  ClusterVectorSpace vspace;
+  
+  GvmClusters<ClusterVectorSpace, ClusterVector, ClusterKey, FP> clusters(vspace, 16);
+  GvmClusters<ClusterVectorSpace, ClusterVector, ClusterKey, FP> batchClusters(vspace, 16);
+  
+  GvmListKeyer<ClusterVectorSpace, ClusterVector, ClusterKey, FP> keyer;
+  GvmListKeyer<ClusterVectorSpace, ClusterVector, ClusterKey, FP> batchKeyer;
+  clusters.setKeyer(&keyer);
+  batchClusters.setKeyer(&batchKeyer);
+  
+  vector<ClusterVector> points(N);
+  vector<FP> masses(N);
+  vector<ClusterKey> keys(N);
+  
+  for (int i = 0; i < N; i++) {
+    int group = (i * 13) % 24;
+    for (int d = 0; d < 3; d++) {
+      points[i][d] = ((group * 7 + d * 11) % 19) * 10 + ((i * 3 + d) % 5);
+    }
+    // Include some zero mass points
+    masses[i] = (i % 11) == 0 ? 0 : 1 + (i % 3);
+    keys[i].push_back(i);
+  }
+  
+  for (int i = 0; i < N; i++) {
+    clusters.add(masses[i], points[i], &keys[i]);
+  }
+  
+  batchClusters.batchSize = 8;
+  batchClusters.addBatch(masses.data(), points.data(), keys.data(), N);
+  
+  XCTAssert(clusters.additions == batchClusters.additions);
+  
+  vector<GvmResult<ClusterVectorSpace, ClusterVector, ClusterKey, FP>> results = clusters.results();
+  vector<GvmResult<ClusterVectorSpace, ClusterVector, ClusterKey, FP>> batchResults = batchClusters.results();
+  
+  // Batch evaluation makes exactly the same decisions as add()
+  
+  XCTAssert(results.size() == batchResults.size());
+  
+  for (int i = 0; i < results.size(); i++) {
+    XCTAssert(results[i].getMass() == batchResults[i].getMass());
+    XCTAssert(results[i].getVariance() == batchResults[i].getVariance());
+    XCTAssert(*results[i].getKey() == *batchResults[i].getKey());
+    for (int d = 0; d < 3; d++) {
+      XCTAssert(results[i].point[d] == batchResults[i].point[d]);
+    }
+  }
+  
+#undef FP
+#undef ClusterVector
+#undef ClusterVectorSpace
+#undef ClusterKey
+}
+
+- (void)testDeferredPairs {
+  
+# define FP double
+# define ClusterVector GvmStdVector<FP,3>
+# define ClusterVectorSpace GvmVectorSpace<ClusterVector,FP,3>
+# define ClusterKey vector<int>
+  
+  const int capacity = 64;
+  
+  ClusterVectorSpace vspace;
+  
+  GvmClusters<ClusterVectorSpace, ClusterVector, ClusterKey, FP> clusters(vspace, capacity);
+  GvmClusters<ClusterVectorSpace, ClusterVector, ClusterKey, FP> incrementalClusters(vspace, capacity);
+  
+  XCTAssert(clusters.pairsDeferred == true);
+  
+  // Build the heap one pair at a time
+  
+  incrementalClusters.pairsDeferred = false;
+  
+  ClusterVector pt;
+  
+  for (int i = 0; i < 500; i++) {
+    // Coordinates without ties in pair values
+    for (int d = 0; d < 3; d++) {
+      pt[d] = sin(i * 1.7 + d * 0.3) * 100 + i * 0.01;
+    }
+    clusters.add(1, pt, nullptr);
+    incrementalClusters.add(1, pt, nullptr);
+    
+    if (i == capacity - 2) {
+      // Pairs are not in the heap until capacity is reached
+      XCTAssert(clusters.pairs.getSize() == 0);
+      XCTAssert(incrementalClusters.pairs.getSize() == (capacity - 1) * (capacity - 2) / 2);
+    } else if (i == capacity - 1) {
+      XCTAssert(clusters.pairsDeferred == false);
+      XCTAssert(clusters.pairs.getSize() == capacity * (capacity - 1) / 2);
+      
+      // Heap order holds after the bottom up build
+      
+      GvmClusterPairs<ClusterVectorSpace, ClusterVector, ClusterKey, FP> &pairs = clusters.pairs;
+      for (int j = 1; j < pairs.getSize(); j++) {
+        XCTAssert(pairs.pairs[(j - 1) / 2]->value <= pairs.pairs[j]->value);
+        XCTAssert(pairs.pairs[j]->index == j);
+      }
+      XCTAssert(clusters.pairs.peek()->value == incrementalClusters.pairs.peek()->value);
+    }
+  }
+  
+  vector<GvmResult<ClusterVectorSpace, ClusterVector, ClusterKey, FP>> results = clusters.results();
+  vector<GvmResult<ClusterVectorSpace, ClusterVector, ClusterKey, FP>> incrementalResults = incrementalClusters.results();
+  
+  XCTAssert(results.size() == incrementalResults.size());
+  
+  for (int i = 0; i < results.size(); i++) {
+    XCTAssert(results[i].getMass() == incrementalResults[i].getMass());
+    XCTAssert(results[i].getVariance() == incrementalResults[i].getVariance());
+  }
+  
+  // A refill after clear() defers the pairs again
+  
+  clusters.clear();
+  
+  XCTAssert(clusters.pairsDeferred == true);
+  
+  for (int i = 0; i < 500; i++) {
+    for (int d = 0; d < 3; d++) {
+      pt[d] = sin(i * 1.7 + d * 0.3) * 100 + i * 0.01;
+    }
+    clusters.add(1, pt, nullptr);
+    
+    if (i == capacity - 2) {
+      XCTAssert(clusters.pairs.getSize() == 0);
+    } else if (i == capacity - 1) {
+      XCTAssert(clusters.pairsDeferred == false);
+    }
+  }
+  
+  vector<GvmResult<ClusterVectorSpace, ClusterVector, ClusterKey, FP>> refillResults = clusters.results();
+  
+  XCTAssert(refillResults.size() == results.size());
+  
+  for (int i = 0; i < results.size(); i++) {
+    XCTAssert(refillResults[i].getMass() == results[i].getMass());
+    XCTAssert(refillResults[i].getVariance() == results[i].getVariance());
+  }
+  
+#undef FP
+#undef ClusterVector
+#undef ClusterVectorSpace
+#undef ClusterKey
+}
+
+- (void)testFrozenClusters {
+  
+# define FP double
+# define ClusterVector GvmStdVector<FP,3>
+# define ClusterVectorSpace GvmVectorSpace<ClusterVector,FP,3>
+# define ClusterKey vector<int>
+  
+  ClusterVectorSpace vspace;
+  
+  GvmClusters<ClusterVectorSpace, ClusterVector, ClusterKey, FP> clusters(vspace, 16);
+  
+  clusters.freezeAfter = 200;
+  
+  // Freezing has no effect before the clusters are full
+  
+  clusters.freeze();
+  XCTAssert(clusters.isFrozen() == false);
+  
+  ClusterVector pt;
+  
+  for (int i = 0; i < 1000; i++) {
+    int group = (i * 7) % 20;
+    for (int d = 0; d < 3; d++) {
+      pt[d] = ((group * 5 + d * 3) % 11) * 10 + ((i + d) % 3);
+    }
+    clusters.add(1, pt, nullptr);
+    XCTAssert(clusters.isFrozen() == (i >= 199));
+  }
+  
+  // Frozen clusters only grow, no cluster was reset by a merge
+  
+  vector<GvmResult<ClusterVectorSpace, ClusterVector, ClusterKey, FP>> frozenResults = clusters.results();
+  
+  int frozenCount = 0;
+  for (int i = 0; i < frozenResults.size(); i++) {
+    frozenCount += frozenResults[i].count;
+  }
+  XCTAssert(frozenResults.size() == 16);
+  XCTAssert(frozenCount == 1000);
+  
+  // reduce() thaws and revalues every pair
+  
+  clusters.reduce(-1, 8);
+  XCTAssert(clusters.isFrozen() == false);
+  
+  vector<GvmResult<ClusterVectorSpace, ClusterVector, ClusterKey, FP>> results = clusters.results();
+  XCTAssert(results.size() == 8);
+  
+  FP mass = 0;
+  for (int i = 0; i < results.size(); i++) {
+    mass += results[i].getMass();
+  }
+  XCTAssert(mass == 1000);
+  
+  // Freeze on a low merge rate
+  
+  GvmClusters<ClusterVectorSpace, ClusterVector, ClusterKey, FP> rateClusters(vspace, 16);
+  rateClusters.freezeWindow = 100;
+  rateClusters.freezeMergeRate = 0.05;
+  
+  for (int i = 0; i < 1000; i++) {
+    int group = (i * 7) % 12;
+    for (int d = 0; d < 3; d++) {
+      pt[d] = ((group * 5 + d * 3) % 11) * 10 + ((i + d) % 3);
+    }
+    rateClusters.add(1, pt, nullptr);
+  }
+  
+  XCTAssert(rateClusters.isFrozen() == true);
+  
+  rateClusters.thaw();
+  XCTAssert(rateClusters.isFrozen() == false);
+  
+  GvmClusterPairs<ClusterVectorSpace, ClusterVector, ClusterKey, FP> &pairs = rateClusters.pairs;
+  for (int j = 1; j < pairs.getSize(); j++) {
+    XCTAssert(pairs.pairs[(j - 1) / 2]->value <= pairs.pairs[j]->value);
+  }
+  
+  // clear() unfreezes and restarts the freeze window, a refill
+  // freezes at the same point as the first fill
+  
+  int refillFrozenAt = -1;
+  
+  for (int pass = 0; pass < 2; pass++) {
+    GvmClusters<ClusterVectorSpace, ClusterVector, ClusterKey, FP> &c = (pass == 0) ? clusters : rateClusters;
+    
+    c.freeze();
+    c.clear();
+    XCTAssert(c.isFrozen() == false);
+    XCTAssert(c.windowAdditions == 0 && c.windowMerges == 0);
+    
+    int frozenAt = -1;
+    for (int i = 0; i < 1000; i++) {
+      int group = (i * 7) % 12;
+      for (int d = 0; d < 3; d++) {
+        pt[d] = ((group * 5 + d * 3) % 11) * 10 + ((i + d) % 3);
+      }
+      c.add(1, pt, nullptr);
+      if (frozenAt < 0 && c.isFrozen()) {
+        frozenAt = i;
+      }
+    }
+    
+    if (pass == 0) {
+      XCTAssert(frozenAt == 199);
+    } else {
+      XCTAssert(frozenAt > 0);
+      refillFrozenAt = frozenAt;
+    }
+  }
+  
+  GvmClusters<ClusterVectorSpace, ClusterVector, ClusterKey, FP> freshClusters(vspace, 16);
+  freshClusters.freezeWindow = 100;
+  freshClusters.freezeMergeRate = 0.05;
+  
+  int freshFrozenAt = -1;
+  for (int i = 0; i < 1000; i++) {
+    int group = (i * 7) % 12;
+    for (int d = 0; d < 3; d++) {
+      pt[d] = ((group * 5 + d * 3) % 11) * 10 + ((i + d) % 3);
+    }
+    freshClusters.add(1, pt, nullptr);
+    if (freshFrozenAt < 0 && freshClusters.isFrozen()) {
+      freshFrozenAt = i;
+    }
+  }
+  
+  XCTAssert(refillFrozenAt == freshFrozenAt);
+  
+#undef FP
+#undef ClusterVector
+#undef ClusterVectorSpace
+#undef ClusterKey
+}
+
+- (void)testApproximateAdd {
+  
+# define FP double
+# define ClusterVector GvmStdVector<FP,3>
+# define ClusterVectorSpace GvmVectorSpace<ClusterVector,FP,3>
+# define ClusterKey vector<int>
+  
+  const int N = 2000;
+  
+  ClusterVectorSpace vspace;
+  
+  GvmClusters<ClusterVectorSpace, ClusterVector, ClusterKey, FP> exactClusters(vspace, 32);
+  GvmClusters<ClusterVectorSpace, ClusterVector, ClusterKey, FP> zeroClusters(vspace, 32);
+  GvmClusters<ClusterVectorSpace, ClusterVector, ClusterKey, FP> approxClusters(vspace, 32);
+  
+  // An epsilon of zero only stops on a zero cost, which is always optimal
+  
+  zeroClusters.setApproximate(0.0);
+  approxClusters.setApproximate(0.5, 4);
+  
+  ClusterVector pt;
+  
+  for (int i = 0; i < N; i++) {
+    // Runs of similar points like the pixels of an image row
+    int run = i / 20;
+    for (int d = 0; d < 3; d++) {
+      pt[d] = ((run * 37 + d * 11) % 97) * 2 + sin(i * 0.7 + d);
+    }
+    exactClusters.add(1, pt, nullptr);
+    zeroClusters.add(1, pt, nullptr);
+    approxClusters.add(1, pt, nullptr);
+  }
+  
+  vector<GvmResult<ClusterVectorSpace, ClusterVector, ClusterKey, FP>> exactResults = exactClusters.results();
+  vector<GvmResult<ClusterVectorSpace, ClusterVector, ClusterKey, FP>> zeroResults = zeroClusters.results();
+  vector<GvmResult<ClusterVectorSpace, ClusterVector, ClusterKey, FP>> approxResults = approxClusters.results();
+  
+  XCTAssert(exactResults.size() == zeroResults.size());
+  
+  for (int i = 0; i < exactResults.size(); i++) {
+    XCTAssert(exactResults[i].getMass() == zeroResults[i].getMass());
+    XCTAssert(exactResults[i].getVariance() == zeroResults[i].getVariance());
+  }
+  
+  XCTAssert(zeroClusters.approxExits == 0);
+  XCTAssert(zeroClusters.approxScans == N - 32);
+  
+  // A larger epsilon stops early on most points and tests fewer clusters
+  
+  XCTAssert(approxClusters.approxScans == N - 32);
+  XCTAssert(approxClusters.getEarlyExitRate() > 0.5);
+  XCTAssert(approxClusters.approxTested < approxClusters.approxScans * 32);
+  
+  FP mass = 0;
+  for (int i = 0; i < approxResults.size(); i++) {
+    mass += approxResults[i].getMass();
+  }
+  XCTAssert(mass == N);
+  
+  approxClusters.resetApproximate();
+  XCTAssert(approxClusters.approxEpsilon < 0);
+  
+#undef FP
+#undef ClusterVector
+#undef ClusterVectorSpace
+#undef ClusterKey
+}
+
+- (void)testLastWinnerShortcut {
+  
+# define FP double
+# define ClusterVector GvmStdVector<FP,3>
+# define ClusterVectorSpace GvmVectorSpace<ClusterVector,FP,3>
+# define ClusterKey vector<int>
+  
+  const int N = 3000;
+  
+  ClusterVectorSpace vspace;
+  
+  GvmClusters<ClusterVectorSpace, ClusterVector, ClusterKey, FP> clusters(vspace, 32);
+  GvmClusters<ClusterVectorSpace, ClusterVector, ClusterKey, FP> localClusters(vspace, 32);
+  
+  localClusters.setUseLastWinner(true);
+  
+  ClusterVector pt;
+  
+  for (int i = 0; i < N; i++) {
+    // Runs of similar points like the pixels of an image row
+    int run = i / 30;
+    for (int d = 0; d < 3; d++) {
+      pt[d] = ((run * 37 + d * 11) % 97) * 2 + sin(i * 0.3 + d);
+    }
+    clusters.add(1, pt, nullptr);
+    localClusters.add(1, pt, nullptr);
+  }
+  
+  // The shortcut skips most clusters on a coherent stream
+  
+  XCTAssert(localClusters.localityScans == N - 32);
+  XCTAssert(localClusters.localityTested < localClusters.localityScans * 8);
+  
+  // and gives exactly the same result as the full scan
+  
+  vector<GvmResult<ClusterVectorSpace, ClusterVector, ClusterKey, FP>> results = clusters.results();
+  vector<GvmResult<ClusterVectorSpace, ClusterVector, ClusterKey, FP>> localResults = localClusters.results();
+  
+  XCTAssert(results.size() == localResults.size());
+  
+  for (int i = 0; i < results.size(); i++) {
+    XCTAssert(results[i].getMass() == localResults[i].getMass());
+    XCTAssert(results[i].getVariance() == localResults[i].getVariance());
+    for (int d = 0; d < 3; d++) {
+      XCTAssert(results[i].point[d] == localResults[i].point[d]);
+    }
+  }
+  
+#undef FP
+#undef ClusterVector
+#undef ClusterVectorSpace
+#undef ClusterKey
+}
+
+- (void)testCurveOrder {
+  
+# define FP double
+  
+  // Every colour of the 16x16x16 corner of the colour cube, the Hilbert
+  // curve visits this corner first and each step moves to a neighbour.
+  
+  vector<uint32_t> pixels;
+  
+  for (uint32_t r = 0; r < 16; r++) {
+    for (uint32_t g = 0; g < 16; g++) {
+      for (uint32_t b = 0; b < 16; b++) {
+        pixels.push_back((r << 16) | (g << 8) | b);
+      }
+    }
+  }
+  
+  GvmCurveOrder<FP> hilbert(GvmCurveOrder<FP>::Hilbert);
+  
+  vector<uint32_t> sorted = pixels;
+  hilbert.sortPixels(sorted);
+  
+  XCTAssert(sorted.size() == pixels.size());
+  XCTAssert(sorted[0] == 0);
+  
+  for (int i = 1; i < (int)sorted.size(); i++) {
+    int dist = 0;
+    for (int shift = 0; shift < 24; shift += 8) {
+      int c1 = (sorted[i-1] >> shift) & 0xFF;
+      int c2 = (sorted[i] >> shift) & 0xFF;
+      dist += abs(c1 - c2);
+    }
+    XCTAssert(dist == 1);
+  }
+  
+  vector<uint32_t> check = sorted;
+  sort(begin(check), end(check));
+  XCTAssert(check == pixels);
+  
+  // Morton order of the 2x2 corner
+  
+  FP points[] = { 1, 1,  0, 1,  1, 0,  0, 0 };
+  vector<uint32_t> order;
+  
+  GvmCurveOrder<FP> morton(GvmCurveOrder<FP>::Morton);
+  morton.order(points, 4, 2, order);
+  
+  XCTAssert(order.size() == 4);
+  XCTAssert(order[0] == 3);
+  XCTAssert(order[1] == 1);
+  XCTAssert(order[2] == 2);
+  XCTAssert(order[3] == 0);
+  
+  // With 32 bits for each of 2 dimensions the key uses all 64 bits
+  
+  GvmCurveOrder<FP> morton32(GvmCurveOrder<FP>::Morton, 32);
+  morton32.order(points, 4, 2, order);
+  
+  XCTAssert(order.size() == 4);
+  XCTAssert(order[0] == 3);
+  XCTAssert(order[1] == 1);
+  XCTAssert(order[2] == 2);
+  XCTAssert(order[3] == 0);
+  
+  float floatPoints[] = { 1, 1,  0, 1,  1, 0,  0, 0 };
+  GvmCurveOrder<float> floatMorton32(GvmCurveOrder<float>::Morton, 32);
+  floatMorton32.order(floatPoints, 4, 2, order);
+  
+  XCTAssert(order[0] == 3);
+  XCTAssert(order[3] == 0);
+  
+  // Threaded radix sort is stable and matches a stable comparison sort
+  
+  const int N = 100000;
+  vector<uint64_t> keys(N);
+  vector<uint32_t> values(N);
+  
+  for (int i = 0; i < N; i++) {
+    keys[i] = ((uint64_t)i * 2654435761u) % 5003;
+    values[i] = i;
+  }
+  
+  vector<uint32_t> expected = values;
+  stable_sort(begin(expected), end(expected), [&keys](uint32_t a, uint32_t b) {
+    return keys[a] < keys[b];
+  });
+  
+  morton.numThreads = 4;
+  morton.sort(keys, values, 16);
+  
+  XCTAssert(values == expected);
+  
+  for (int i = 1; i < N; i++) {
+    XCTAssert(keys[i-1] <= keys[i]);
+  }
+  
+#undef FP
+}
+
+- (void)testHierarchy {
+  
+# define FP double
+# define ClusterVector GvmStdVector<FP,2>
+# define ClusterVectorSpace GvmVectorSpace<ClusterVector,FP,2>
+# define ClusterKey vector<int>
+  
+  const int N = 20000;
+  
+  ClusterVectorSpace vspace;
+  
+  // 1024 fine clusters in 32 cells of 32 clusters
+  
+  GvmHierarchy<ClusterVectorSpace, ClusterVector, ClusterKey, FP> hierarchy(vspace, 1024);
+  
+  XCTAssert(hierarchy.coarseCapacity == 32);
+  XCTAssert(hierarchy.fineCapacity == 32);
+  XCTAssert(hierarchy.getCapacity() == 1024);
+  
+  GvmListKeyer<ClusterVectorSpace, ClusterVector, ClusterKey, FP> intListKeyer;
+  hierarchy.setKeyer(&intListKeyer);
+  
+  ClusterVector pt;
+  
+  for (int i = 0; i < N; i++) {
+    pt[0] = ((i * 7919) % 1000) * 0.1;
+    pt[1] = ((i * 104729) % 997) * 0.1;
+    ClusterKey key;
+    key.push_back(i);
+    hierarchy.add(1, pt, &key);
+  }
+  
+  XCTAssert(hierarchy.getCount() == 1024);
+  XCTAssert(hierarchy.getCellCount() == 32);
+  XCTAssert(hierarchy.cellMerges > 0);
+  
+  // Merged cells keep every point and every key
+  
+  vector<GvmResult<ClusterVectorSpace, ClusterVector, ClusterKey, FP>> results = hierarchy.results();
+  
+  XCTAssert(results.size() == 1024);
+  
+  FP mass = 0.0;
+  int count = 0;
+  vector<int> seen(N, 0);
+  
+  for ( auto &result : results ) {
+    mass += result.getMass();
+    count += result.getCount();
+    for ( int i : *result.key ) {
+      seen[i]++;
+    }
+  }
+  
+  XCTAssert(mass == N);
+  XCTAssert(count == N);
+  
+  for (int i = 0; i < N; i++) {
+    XCTAssert(seen[i] == 1);
+  }
+  
+  // Cells are reused after clear()
+  
+  hierarchy.clear();
+  
+  XCTAssert(hierarchy.getCount() == 0);
+  XCTAssert(hierarchy.getCellCount() == 0);
+  
+  for (int i = 0; i < N; i++) {
+    pt[0] = (i % 100) * 0.5;
+    pt[1] = (i / 100) * 0.5;
+    ClusterKey key;
+    key.push_back(i);
+    hierarchy.add(1, pt, &key);
+  }
+  
+  XCTAssert(hierarchy.getCount() > 0 && hierarchy.getCount() <= 1024);
+  XCTAssert(hierarchy.cells.size() == 32);
+  
+#undef FP
+#undef ClusterVector
+#undef ClusterVectorSpace
+#undef ClusterKey
+}
+
+- (void)testRefine {
+  
+# define FP double
+# define ClusterVector GvmStdVector<FP,2>
+# define ClusterVectorSpace GvmVectorSpace<ClusterVector,FP,2>
+# define ClusterKey vector<int>
+  
+  // Four tight groups of points and only two clusters, so each
+  // cluster covers two groups and has a large variance.
+  
+  const int N = 400;
+  
+  vector<ClusterVector> points(N);
+  
+  for (int i = 0; i < N; i++) {
+    int group = i % 4;
+    points[i][0] = (group & 0x1) * 100 + (i % 7) * 0.1;
+    points[i][1] = (group >> 1) * 100 + (i % 5) * 0.1;
+  }
+  
+  ClusterVectorSpace vspace;
+  
+  GvmClusters<ClusterVectorSpace, ClusterVector, ClusterKey, FP> clusters(vspace, 2);
+  
+  GvmListKeyer<ClusterVectorSpace, ClusterVector, ClusterKey, FP> intListKeyer;
+  clusters.setKeyer(&intListKeyer);
+  
+  for (int i = 0; i < N; i++) {
+    ClusterKey key;
+    key.push_back(i);
+    clusters.add(1, points[i], &key);
+  }
+  
+  vector<GvmResult<ClusterVectorSpace, ClusterVector, ClusterKey, FP>> results = clusters.results();
+  
+  XCTAssert(results.size() == 2);
+  
+  GvmRefine<ClusterVectorSpace, ClusterVector, ClusterKey, FP> refine(vspace, 2);
+  XCTAssert(refine.numThreads == 0);
+  refine.numThreads = 2;
+  
+  vector<GvmResult<ClusterVectorSpace, ClusterVector, ClusterKey, FP>> refined = refine.refine(results, 1.0, [&points](int i, ClusterVector &pt) {
+    pt = points[i];
+    return FP(1.0);
+  });
+  
+  XCTAssert(refine.refined == 2);
+  XCTAssert(refined.size() == 4);
+  
+  // Each child is one group and every point is in exactly one child
+  
+  vector<int> seen(N, 0);
+  
+  for ( auto &result : refined ) {
+    XCTAssert(result.getMass() == N / 4);
+    XCTAssert(result.getVariance() < 1.0);
+    int group = (*result.key)[0] % 4;
+    for ( int i : *result.key ) {
+      XCTAssert((i % 4) == group);
+      seen[i]++;
+    }
+  }
+  
+  for (int i = 0; i < N; i++) {
+    XCTAssert(seen[i] == 1);
+  }
+  
+  // Nothing is refined below the threshold
+  
+  refined = refine.refine(refined, 1.0, [&points](int i, ClusterVector &pt) {
+    pt = points[i];
+    return FP(1.0);
+  });
+  
+  XCTAssert(refine.refined == 0);
+  XCTAssert(refined.size() == 4);
+  
+#undef FP
+#undef ClusterVector
+#undef ClusterVectorSpace
+#undef ClusterKey
+}
+
+// Refine on several threads with a GvmDynVectorSpace, the threads allocate
+// rows from the one slab that the copies of the space share.
+
+- (void)testRefineDynThreads {
+  
+# define FP double
+# define ClusterVector GvmDynVector<FP>
+# define ClusterVectorSpace GvmDynVectorSpace<ClusterVector,FP>
+# define ClusterKey vector<int>
+  
+  // Sixteen tight groups of points and four clusters, each cluster
+  // covers four groups and is split into four children.
+  
+  const int N = 1600;
+  const int D = 24;
+  
+  ClusterVectorSpace vspace(D, 64);
+  
+  vector<ClusterVector> points;
+  
+  for (int i = 0; i < N; i++) {
+    int group = i % 16;
+    ClusterVector pt = vspace.newOrigin();
+    for (int d = 0; d < D; d++) {
+      pt[d] = ((group >> (d % 4)) & 0x1) * 100 + (i % 7) * 0.1;
+    }
+    points.push_back(pt);
+  }
+  
+  GvmClusters<ClusterVectorSpace, ClusterVector, ClusterKey, FP> clusters(vspace, 4);
+  
+  GvmListKeyer<ClusterVectorSpace, ClusterVector, ClusterKey, FP> intListKeyer;
+  clusters.setKeyer(&intListKeyer);
+  
+  for (int i = 0; i < N; i++) {
+    ClusterKey key;
+    key.push_back(i);
+    clusters.add(1, points[i], &key);
+  }
+  
+  vector<GvmResult<ClusterVectorSpace, ClusterVector, ClusterKey, FP>> results = clusters.results();
+  
+  XCTAssert(results.size() == 4);
+  
+  GvmRefine<ClusterVectorSpace, ClusterVector, ClusterKey, FP> refine(vspace, 4);
+  refine.numThreads = 4;
+  
+  vector<GvmResult<ClusterVectorSpace, ClusterVector, ClusterKey, FP>> refined = refine.refine(results, 1.0, [&points](int i, ClusterVector &pt) {
+    pt = points[i];
+    return FP(1.0);
+  });
+  
+  XCTAssert(refine.refined == 4);
+  XCTAssert(refined.size() == 16);
+  
+  vector<int> seen(N, 0);
+  
+  for ( auto &result : refined ) {
+    XCTAssert(result.getMass() == N / 16);
+    int group = (*result.key)[0] % 16;
+    for ( int i : *result.key ) {
+      XCTAssert((i % 16) == group);
+      seen[i]++;
+    }
+  }
+  
+  for (int i = 0; i < N; i++) {
+    XCTAssert(seen[i] == 1);
+  }
+  
+#undef FP
+#undef ClusterVector
+#undef ClusterVectorSpace
+#undef ClusterKey
+}
+
+- (void)testLloyd {
+  
+# define FP double
+# define ClusterVector GvmStdVector<FP,2>
+# define ClusterVectorSpace GvmVectorSpace<ClusterVector,FP,2>
+# define ClusterKey vector<int>
+  
+  // Two groups of 10 points on a line
+  
+  vector<ClusterVector> points(20);
+  
+  for (int i = 0; i < 20; i++) {
+    points[i][0] = (i < 10) ? i : (90 + i);
+    points[i][1] = 0;
+  }
+  
+  ClusterVectorSpace vspace;
+  
+  GvmClusters<ClusterVectorSpace, ClusterVector, ClusterKey, FP> clusters(vspace, 2);
+  
+  for (int i = 0; i < 20; i++) {
+    clusters.add(1, points[i], nullptr);
+  }
+  
+  vector<GvmResult<ClusterVectorSpace, ClusterVector, ClusterKey, FP>> results = clusters.results();
+  
+  XCTAssert(results.size() == 2);
+  
+  // Move the seeds so that one of them starts inside the wrong group
+  
+  results[0].point[0] = 30;
+  results[1].point[0] = 108;
+  
+  GvmLloyd<ClusterVectorSpace, ClusterVector, ClusterKey, FP> lloyd(vspace, 20, 0.0, 2);
+  lloyd.refine(results, points);
+  
+  XCTAssert(lloyd.iterations < 20);
+  XCTAssert(lloyd.skipped > 0);
+  
+  XCTAssert(results[0].getMass() == 10);
+  XCTAssert(results[0].getCount() == 10);
+  XCTAssert(results[0].point[0] == 4.5);
+  XCTAssert(results[0].getVariance() == 8.25);
+  
+  XCTAssert(results[1].getMass() == 10);
+  XCTAssert(results[1].point[0] == 104.5);
+  XCTAssert(results[1].getVariance() == 8.25);
+  
+  for (int i = 0; i < 20; i++) {
+    XCTAssert(lloyd.assignment[i] == ((i < 10) ? 0 : 1));
+  }
+  
+  // Weighted points pull the centroid
+  
+  vector<FP> masses(20, 1.0);
+  masses[0] = 11.0;
+  
+  lloyd.refine(results, points, &masses);
+  
+  XCTAssert(results[0].getMass() == 20);
+  XCTAssert(results[0].point[0] == 2.25);
+  
+#undef FP
+#undef ClusterVector
+#undef ClusterVectorSpace
+#undef ClusterKey
+}
+
+- (void)testReduceBetweenAdds {
+  
+# define FP double
+# define ClusterVector GvmStdVector<FP,2>
+# define ClusterVectorSpace GvmVectorSpace<ClusterVector,FP,2>
+# define ClusterKey vector<int>
+  
+  ClusterVectorSpace vspace;
+  
+  GvmClusters<ClusterVectorSpace, ClusterVector, ClusterKey, FP> clusters(vspace, 64);
+  
+  GvmListKeyer<ClusterVectorSpace, ClusterVector, ClusterKey, FP> intListKeyer;
+  clusters.setKeyer(&intListKeyer);
+  
+  ClusterVector pt;
+  
+  int added = 0;
+  
+  for (int round = 0; round < 10; round++) {
+    for (int i = 0; i < 200; i++) {
+      pt[0] = (added * 37) % 101;
+      pt[1] = (added * 53) % 89;
+      ClusterKey key;
+      key.push_back(added);
+      clusters.add(1, pt, &key);
+      added++;
+    }
+    
+    // Reducing below half of the clusters compacts during the merges
+    
+    clusters.reduce(-1.0, 4 + round);
+    
+    XCTAssert(clusters.count == 4 + round);
+    XCTAssert(clusters.bound == clusters.count);
+    XCTAssert(clusters.pairs.getSize() == (clusters.count * (clusters.count - 1) / 2));
+    XCTAssert(clusters.pairs.pairsUsed == clusters.pairs.getSize());
+  }
+  
+  // No point or key was lost
+  
+  vector<GvmResult<ClusterVectorSpace, ClusterVector, ClusterKey, FP>> results = clusters.results();
+  
+  FP mass = 0.0;
+  vector<int> seen(added, 0);
+  
+  for ( auto &result : results ) {
+    mass += result.getMass();
+    for ( int i : *result.key ) {
+      seen[i]++;
+    }
+  }
+  
+  XCTAssert(mass == added);
+  
+  for (int i = 0; i < added; i++) {
+    XCTAssert(seen[i] == 1);
+  }
+  
+  // Every surviving pair is still in the heap with a current value
+  
+  for (int j = 1; j < clusters.count; j++) {
+    for (int i = 0; i < j; i++) {
+      GvmClusterPair<ClusterVectorSpace, ClusterVector, ClusterKey, FP> *pair = clusters.clusters[j]->pairs[i];
+      XCTAssert(pair->c1 == clusters.clusters[i].get() || pair->c2 == clusters.clusters[i].get());
+      XCTAssert(pair == clusters.clusters[i]->pairs[j - 1]);
+      XCTAssert(pair->index >= 0);
+      FP value = pair->value;
+      pair->update();
+      XCTAssert(value == pair->value);
+    }
+  }
+  
+#undef FP
+#undef ClusterVector
+#undef ClusterVectorSpace
+#undef ClusterKey
+}
+
+- (void)testLevels {
+  
+# define FP double
+# define ClusterVector GvmStdVector<FP,2>
+# define ClusterVectorSpace GvmVectorSpace<ClusterVector,FP,2>
+# define ClusterKey vector<int>
+  
+  // Three groups on a line, one cluster for each point
+  
+  FP xs[] = { 0, 1, 2, 10, 11, 30, 31, 32 };
+  
+  ClusterVectorSpace vspace;
+  
+  GvmClusters<ClusterVectorSpace, ClusterVector, ClusterKey, FP> clusters(vspace, 8);
+  
+  GvmListKeyer<ClusterVectorSpace, ClusterVector, ClusterKey, FP> intListKeyer;
+  clusters.setKeyer(&intListKeyer);
+  
+  for (int i = 0; i < 8; i++) {
+    ClusterVector pt;
+    pt[0] = xs[i];
+    pt[1] = 0;
+    ClusterKey key;
+    key.push_back(i);
+    clusters.add(1, pt, &key);
+  }
+  
+  XCTAssert(clusters.count == 8);
+  
+  GvmLevels<ClusterVectorSpace, ClusterVector, ClusterKey, FP> levels(vspace);
+  
+  vector<int> ks = { 1, 3, 100, 2 };
+  
+  auto list = levels.levels(clusters, ks);
+  
+  XCTAssert(list.size() == 4);
+  XCTAssert(list[0].k == 8);
+  XCTAssert(list[1].k == 3);
+  XCTAssert(list[2].k == 2);
+  XCTAssert(list[3].k == 1);
+  XCTAssert(levels.merges == 7);
+  
+  // The first level is the clusters as they are
+  
+  XCTAssert(list[0].results.size() == 8);
+  for (int i = 0; i < 8; i++) {
+    XCTAssert(list[0].membership[i] == i);
+    XCTAssert(list[0].results[i].key != nullptr);
+    XCTAssert((*list[0].results[i].key)[0] == i);
+  }
+  
+  // Three groups
+  
+  auto &three = list[1];
+  XCTAssert(three.results.size() == 3);
+  for (int i = 0; i < 8; i++) {
+    int group = (i < 3) ? 0 : (i < 5) ? 1 : 2;
+    XCTAssert(three.membership[i] == three.membership[(group == 0) ? 0 : (group == 1) ? 3 : 5]);
+  }
+  XCTAssert(three.membership[0] != three.membership[3]);
+  XCTAssert(three.membership[3] != three.membership[5]);
+  XCTAssert(three.results[three.membership[0]].getMass() == 3);
+  XCTAssert(three.results[three.membership[0]].point[0] == 1);
+  XCTAssert(three.results[three.membership[3]].point[0] == 10.5);
+  XCTAssert(three.results[three.membership[5]].getVariance() == (FP(2) / 3));
+  XCTAssert(three.results[three.membership[0]].key == nullptr);
+  XCTAssert(three.totalVariance == 4.5);
+  
+  // The two closest groups merge next
+  
+  auto &two = list[2];
+  XCTAssert(two.membership[0] == two.membership[4]);
+  XCTAssert(two.membership[0] != two.membership[5]);
+  
+  // Levels are nested
+  
+  for (int l = 0; l < 3; l++) {
+    for (int i = 0; i < 8; i++) {
+      XCTAssert(list[l].parent[list[l].membership[i]] == list[l+1].membership[i]);
+    }
+    XCTAssert(list[l].totalVariance <= list[l+1].totalVariance);
+  }
+  
+  // One cluster holds all the mass
+  
+  auto &one = list[3];
+  XCTAssert(one.results.size() == 1);
+  XCTAssert(one.results[0].getMass() == 8);
+  XCTAssert(one.results[0].getCount() == 8);
+  XCTAssert(one.results[0].point[0] == (FP(117) / 8));
+  XCTAssert(one.parent[0] == -1);
+  
+  // The clusters are not modified
+  
+  XCTAssert(clusters.count == 8);
+  XCTAssert(clusters.results()[7].point[0] == 32);
+  
+#undef FP
+#undef ClusterVector
+#undef ClusterVectorSpace
+#undef ClusterKey
+}
+
+- (void)testEventLog {
+  
+# define FP double
+# define ClusterVector GvmStdVector<FP,2>
+# define ClusterVectorSpace GvmVectorSpace<ClusterVector,FP,2>
+# define ClusterKey vector<int>
+  
+  ClusterVectorSpace vspace;
+  
+  // The same points are clustered with a list of point keys and with an
+  // event log, the replayed memberships must match the keys
+  
+  GvmClusters<ClusterVectorSpace, ClusterVector, ClusterKey, FP> clusters(vspace, 8);
+  
+  GvmListKeyer<ClusterVectorSpace, ClusterVector, ClusterKey, FP> intListKeyer;
+  clusters.setKeyer(&intListKeyer);
+  
+  GvmEventLog eventLog;
+  clusters.setEventLog(&eventLog);
+  
+  const int N = 300;
+  
+  srand(7);
+  
+  for (int i = 0; i < N; i++) {
+    ClusterVector pt;
+    pt[0] = (rand() % 1000) + 1000 * (i % 5);
+    pt[1] = rand() % 1000;
+    ClusterKey key;
+    key.push_back(i);
+    clusters.add((i % 17) == 0 ? 0 : 1, pt, &key);
+  }
+  
+  XCTAssert(eventLog.getPointCount() == N);
+  
+  auto check = [&](std::vector<uint8_t> &bytes) {
+    GvmEventReplay replay;
+    XCTAssert(replay.replay(bytes));
+    XCTAssert(replay.isComplete());
+    XCTAssert(replay.getClusterCount() == clusters.count);
+    
+    vector<int> membership = replay.membership();
+    XCTAssert(membership.size() == N);
+    
+    auto results = clusters.results();
+    int clustered = 0;
+    for (int c = 0; c < (int) results.size(); c++) {
+      for ( int i : *(results[c].getKey()) ) {
+        XCTAssert(membership[i] == c);
+        clustered++;
+      }
+    }
+    for (int i = 0; i < N; i++) {
+      if ((i % 17) == 0) {
+        XCTAssert(membership[i] == -1);
+      }
+    }
+    XCTAssert(clustered == (N - (N + 16) / 17));
+  };
+  
+  eventLog.flush();
+  check(eventLog.bytes);
+  
+  XCTAssert(eventLog.getSize() == (int64_t) eventLog.bytes.size());
+  XCTAssert(eventLog.getSize() < 4 * eventLog.getEventCount());
+  
+  // Merges done by reduce() and the compaction that follows
+  
+  clusters.reduce(-1, 3);
+  
+  eventLog.flush();
+  check(eventLog.bytes);
+  
+  // A log split into single bytes replays the same way
+  
+  {
+    GvmEventReplay replay;
+    for ( uint8_t b : eventLog.bytes ) {
+      XCTAssert(replay.replay(&b, 1));
+    }
+    XCTAssert(replay.isComplete());
+    XCTAssert(replay.getClusterCount() == 3);
+    
+    // A cut with more clusters undoes the latest merges, the clusters
+    // are nested in the clusters at the end of the log
+    
+    vector<int> coarse = replay.membership();
+    vector<int> fine = replay.membership(6);
+    
+    int maxFine = -1;
+    vector<int> parentOf(6, -1);
+    for (int i = 0; i < N; i++) {
+      XCTAssert((coarse[i] < 0) == (fine[i] < 0));
+      if (fine[i] < 0) continue;
+      maxFine = std::max(maxFine, fine[i]);
+      if (fine[i] < 3) {
+        XCTAssert(fine[i] == coarse[i]);
+      }
+      if (parentOf[fine[i]] == -1) {
+        parentOf[fine[i]] = coarse[i];
+      }
+      XCTAssert(parentOf[fine[i]] == coarse[i]);
+    }
+    XCTAssert(maxFine == 5);
+    XCTAssert(replay.merges.size() > 0);
+  }
+  
+  // clear() discards every cluster
+  
+  clusters.clear();
+  eventLog.flush();
+  
+  {
+    GvmEventReplay replay;
+    XCTAssert(replay.replay(eventLog.bytes));
+    XCTAssert(replay.getClusterCount() == 0);
+    vector<int> membership = replay.membership();
+    for ( int c : membership ) {
+      XCTAssert(c == -1);
+    }
+  }
+  
+  // A whole cluster added with addCluster() takes an id for each of its
+  // points, the ids of a group replay into the cluster that holds the group
+  
+  {
+    GvmClusters<ClusterVectorSpace, ClusterVector, ClusterKey, FP> source(vspace, 2);
+    GvmClusters<ClusterVectorSpace, ClusterVector, ClusterKey, FP> target(vspace, 6);
+    GvmListKeyer<ClusterVectorSpace, ClusterVector, ClusterKey, FP> groupKeyer;
+    target.setKeyer(&groupKeyer);
+    GvmEventLog groupLog;
+    target.setEventLog(&groupLog);
+    
+    vector<int64_t> firstIds;
+    vector<int> groupSizes;
+    
+    for (int g = 0; g < 40; g++) {
+      GvmCluster<ClusterVectorSpace, ClusterVector, ClusterKey, FP> group(source);
+      const int n = 1 + (g % 5);
+      for (int i = 0; i < n; i++) {
+        ClusterVector pt;
+        pt[0] = (g % 8) * 1000 + i;
+        pt[1] = (g * 37) % 100;
+        group.add(1, pt);
+      }
+      ClusterKey key;
+      key.push_back(g);
+      group.setKey(&key);
+      firstIds.push_back(groupLog.getPointCount());
+      groupSizes.push_back(n);
+      target.addCluster(group);
+    }
+    
+    XCTAssert(groupLog.getPointCount() == 120);
+    groupLog.flush();
+    
+    GvmEventReplay replay;
+    XCTAssert(replay.replay(groupLog.bytes));
+    XCTAssert(replay.getClusterCount() == 6);
+    vector<int> membership = replay.membership();
+    XCTAssert(membership.size() == 120);
+    
+    auto results = target.results();
+    int groups = 0;
+    for (int c = 0; c < (int) results.size(); c++) {
+      for ( int g : *(results[c].getKey()) ) {
+        for (int i = 0; i < groupSizes[g]; i++) {
+          XCTAssert(membership[firstIds[g] + i] == c);
+        }
+        groups++;
+      }
+    }
+    XCTAssert(groups == 40);
+    
+    GvmEventReplay byteReplay;
+    for ( uint8_t b : groupLog.bytes ) {
+      XCTAssert(byteReplay.replay(&b, 1));
+    }
+    XCTAssert(byteReplay.isComplete());
+    XCTAssert(byteReplay.membership() == membership);
+  }
+  
+  // Events written to a file
+  
+  FILE *fp = tmpfile();
+  
+  {
+    GvmClusters<ClusterVectorSpace, ClusterVector, ClusterKey, FP> fileClusters(vspace, 4);
+    GvmEventLog fileLog(fp);
+    fileClusters.setEventLog(&fileLog);
+    for (int i = 0; i < 50; i++) {
+      ClusterVector pt;
+      pt[0] = i * i;
+      pt[1] = 0;
+      fileClusters.add(1, pt, nullptr);
+    }
+    XCTAssert(fileLog.bytes.size() == 0);
+  }
+  
+  rewind(fp);
+  
+  {
+    GvmEventReplay replay;
+    XCTAssert(replay.replay(fp));
+    XCTAssert(replay.getClusterCount() == 4);
+    XCTAssert(replay.pointGroup.size() == 50);
+  }
+  
+  fclose(fp);
+  
+#undef FP
+#undef ClusterVector
+#undef ClusterVectorSpace
+#undef ClusterKey
+}
+
+- (void)testTimeBudget {
+  
+# define FP double
+# define ClusterVector GvmStdVector<FP,2>
+# define ClusterVectorSpace GvmVectorSpace<ClusterVector,FP,2>
+# define ClusterKey vector<int>
+  
+  ClusterVectorSpace vspace;
+  
+  vector<ClusterVector> points(4096);
+  
+  srand(11);
+  
+  for ( auto &pt : points ) {
+    pt[0] = rand() % 1000;
+    pt[1] = rand() % 1000;
+  }
+  
+  // The progress callback cancels after the third check
+  
+  {
+    GvmClusters<ClusterVectorSpace, ClusterVector, ClusterKey, FP> clusters(vspace, 16);
+    
+    int calls = 0;
+    int64_t lastSeen = 0;
+    
+    clusters.setProgressCallback([&](int64_t seen, double) {
+      calls++;
+      lastSeen = seen;
+      return calls < 3;
+    }, 100);
+    
+    for ( auto &pt : points ) {
+      clusters.add(1, pt, nullptr);
+    }
+    
+    XCTAssert(calls == 3);
+    XCTAssert(lastSeen == 300);
+    XCTAssert(clusters.isExpired());
+    XCTAssert(clusters.additions == 299);
+    XCTAssert(clusters.getBudgetSkipped() == 4096 - 299);
+    XCTAssert(clusters.results().size() == 16);
+  }
+  
+  // A deadline that has already passed ignores points after the first check
+  
+  {
+    GvmClusters<ClusterVectorSpace, ClusterVector, ClusterKey, FP> clusters(vspace, 16);
+    
+    clusters.setDeadline(std::chrono::steady_clock::now(), 0, 64);
+    clusters.addBatch(nullptr, points.data(), nullptr, (int) points.size());
+    
+    XCTAssert(clusters.isExpired());
+    XCTAssert(clusters.additions == 63);
+    
+    // Full processing again
+    
+    clusters.resetDeadline();
+    clusters.add(1, points[0], nullptr);
+    
+    XCTAssert(!clusters.isExpired());
+    XCTAssert(clusters.additions == 64);
+  }
+  
+  // With far more points expected than the budget allows the clusters are
+  // frozen and then subsampled, the sampled points carry a greater mass
+  
+  {
+    GvmClusters<ClusterVectorSpace, ClusterVector, ClusterKey, FP> clusters(vspace, 16);
+    
+    clusters.setTimeBudget(600.0, 1000000000000LL, 64);
+    
+    for ( auto &pt : points ) {
+      clusters.add(1, pt, nullptr);
+    }
+    
+    XCTAssert(!clusters.isExpired());
+    XCTAssert(clusters.isFrozen());
+    XCTAssert(clusters.getBudgetLevel() >= 3);
+    XCTAssert(clusters.getSampleStride() >= 4);
+    XCTAssert(clusters.getBudgetSkipped() > 0);
+    XCTAssert(clusters.additions + clusters.getBudgetSkipped() == 4096);
+    
+    FP mass = 0;
+    for ( auto &result : clusters.results() ) {
+      mass += result.getMass();
+    }
+    XCTAssert(mass > clusters.additions);
+    
+    // clear() drops the budget, every point of a refill is clustered
+    
+    clusters.clear();
+    
+    XCTAssert(!clusters.isFrozen());
+    XCTAssert(clusters.getBudgetLevel() == 0);
+    XCTAssert(clusters.getSampleStride() == 1);
+    XCTAssert(clusters.getBudgetSkipped() == 0);
+    
+    for ( auto &pt : points ) {
+      clusters.add(1, pt, nullptr);
+    }
+    
+    XCTAssert(!clusters.isFrozen());
+    XCTAssert(clusters.getBudgetSkipped() == 0);
+    XCTAssert(clusters.additions == 4096);
+    
+    mass = 0;
+    for ( auto &result : clusters.results() ) {
+      mass += result.getMass();
+    }
+    XCTAssert(mass == 4096);
+  }
+  
+  // A progress callback set before the deadline is kept
+  
+  {
+    GvmClusters<ClusterVectorSpace, ClusterVector, ClusterKey, FP> clusters(vspace, 16);
+    
+    int calls = 0;
+    
+    clusters.setProgressCallback([&](int64_t, double) {
+      calls++;
+      return true;
+    }, 32);
+    clusters.setTimeBudget(600.0, 0, 32);
+    
+    for (int i = 0; i < 320; i++) {
+      clusters.add(1, points[i], nullptr);
+    }
+    
+    XCTAssert(calls == 10);
+    XCTAssert(!clusters.isExpired());
+    
+    // A cancel issued before the deadline is set is not lost
+    
+    clusters.cancel();
+    clusters.setTimeBudget(600.0, 0, 32);
+    
+    for (int i = 0; i < 320; i++) {
+      clusters.add(1, points[i], nullptr);
+    }
+    
+    XCTAssert(clusters.isExpired());
+    XCTAssert(calls == 10);
+  }
+  
+  // Cancel from outside the add() loop
+  
+  {
+    GvmClusters<ClusterVectorSpace, ClusterVector, ClusterKey, FP> clusters(vspace, 16);
+    
+    clusters.setTimeBudget(600.0, 0, 32);
+    
+    for (int i = 0; i < 1000; i++) {
+      if (i == 100) {
+        clusters.cancel();
+      }
+      clusters.add(1, points[i], nullptr);
+    }
+    
+    XCTAssert(clusters.isExpired());
+    XCTAssert(clusters.additions == 127);
+    XCTAssert(!clusters.isFrozen());
+    
+    // The cancel does not carry over a clear()
+    
+    clusters.clear();
+    
+    XCTAssert(!clusters.isExpired());
+    
+    for (int i = 0; i < 1000; i++) {
+      clusters.add(1, points[i], nullptr);
+    }
+    
+    XCTAssert(!clusters.isExpired());
+    XCTAssert(clusters.additions == 1000);
+  }
+  
+#undef FP
+#undef ClusterVector
+#undef ClusterVectorSpace
+#undef ClusterKey
+}
+
+- (void)testMemoryReport {
+  
+# define FP double
+# define ClusterVector GvmStdVector<FP,2>
+# define ClusterVectorSpace GvmVectorSpace<ClusterVector,FP,2>
+# define ClusterKey vector<int>
+  
+  typedef GvmClusters<ClusterVectorSpace, ClusterVector, ClusterKey, FP> Clusters;
+  
+  ClusterVectorSpace vspace;
+  
+  GvmMemoryReport estimate = Clusters::estimateMemory(64);
+  
+  Clusters clusters(vspace, 64);
+  
+  // Pair storage is reserved up front, no pages are in use yet
+  
+  GvmMemoryReport empty = clusters.memoryReport();
+  
+  XCTAssert(empty.pairsArray == 0);
+  XCTAssert(empty.pairs == 0);
+  XCTAssert(empty.reserved == estimate.reserved);
+  XCTAssert(empty.clusterPairs == 0);
+  XCTAssert(empty.keys == 0);
+  
+  GvmListKeyer<ClusterVectorSpace, ClusterVector, ClusterKey, FP> intListKeyer;
+  clusters.setKeyer(&intListKeyer);
+  
+  for (int i = 0; i < 200; i++) {
+    ClusterVector pt;
+    pt[0] = i;
+    pt[1] = i % 7;
+    ClusterKey key;
+    key.push_back(i);
+    clusters.add(1, pt, &key);
+  }
+  
+  GvmMemoryReport full = clusters.memoryReport();
+  
+  XCTAssert(full.pairsArray == estimate.pairsArray);
+  XCTAssert(full.pairs == estimate.pairs);
+  XCTAssert(full.reserved == estimate.reserved);
+  XCTAssert(full.clusterPairs == estimate.clusterPairs);
+  XCTAssert(full.clusters == estimate.clusters);
+  XCTAssert(full.keys >= 200 * sizeof(int));
+  XCTAssert(full.getTotal() >= estimate.getTotal());
+  
+  // Keys are included in the estimate when given
+  
+  XCTAssert(Clusters::estimateMemory(64, 100).getTotal() == estimate.getTotal() + 6400);
+  
+  // Pair storage advised to use huge pages is counted in huge pages
+  
+  Clusters large(vspace, 512);
+  
+  for (int i = 0; i < 600; i++) {
+    ClusterVector pt;
+    pt[0] = i;
+    pt[1] = i % 7;
+    large.add(1, pt, nullptr);
+  }
+  
+  GvmMemoryReport largeReport = large.memoryReport();
+  const size_t hugePage = GvmClusterPairs<ClusterVectorSpace, ClusterVector, ClusterKey, FP>::hugePageSize();
+  
+  XCTAssert(largeReport.pairsArray >= large.pairs.pairsUsed * sizeof(GvmClusterPair<ClusterVectorSpace, ClusterVector, ClusterKey, FP>));
+  if (large.pairs.pairsArrayHuge) {
+    XCTAssert(largeReport.pairsArray % hugePage == 0);
+    XCTAssert(largeReport.pairsArray == Clusters::estimateMemory(512).pairsArray);
+  }
+  if (large.pairs.pairsHuge) {
+    XCTAssert(largeReport.pairs % hugePage == 0);
+  }
+  
+  // Largest capacity within a budget
+  
+  size_t budget = Clusters::estimateMemory(100).getTotal();
+  
+  XCTAssert(Clusters::capacityForBudget(budget) == 100);
+  XCTAssert(Clusters::capacityForBudget(budget - 1) == 99);
+  XCTAssert(Clusters::capacityForBudget(16) == 0);
+  
+  // A huge budget is limited to a capacity whose pair count fits in an int
+  
+  XCTAssert(Clusters::capacityForBudget(SIZE_MAX / 2) == Clusters::getMaxCapacity());
+  XCTAssert((int64_t) Clusters::getMaxCapacity() * (Clusters::getMaxCapacity() - 1) <= INT32_MAX);
+  XCTAssert((int64_t) (Clusters::getMaxCapacity() + 1) * Clusters::getMaxCapacity() > INT32_MAX);
+  
+  auto budgeted = Clusters::newWithBudget(vspace, budget);
+  
+  XCTAssert(budgeted.get() != nullptr);
+  XCTAssert(budgeted->getCapacity() == 100);
+  XCTAssert(Clusters::newWithBudget(vspace, 16).get() == nullptr);
+  
+#undef FP
+#undef ClusterVector
+#undef ClusterVectorSpace
+#undef ClusterKey
+}
+
+- (void)testShrinkToFit {
+  
+# define FP double
+# define ClusterVector GvmStdVector<FP,2>
+# define ClusterVectorSpace GvmVectorSpace<ClusterVector,FP,2>
+# define ClusterKey vector<int>
+  
+  ClusterVectorSpace vspace;
+  
+  GvmClusters<ClusterVectorSpace, ClusterVector, ClusterKey, FP> clusters(vspace, 1024);
+  
+  GvmListKeyer<ClusterVectorSpace, ClusterVector, ClusterKey, FP> intListKeyer;
+  clusters.setKeyer(&intListKeyer);
+  
+  srand(5);
+  
+  int added = 0;
+  
+  auto addPoints = [&](int n, int groups) {
+    for (int i = 0; i < n; i++) {
+      ClusterVector pt;
+      pt[0] = (i % groups) * 1000 + (rand() % 100);
+      pt[1] = rand() % 100;
+      ClusterKey key;
+      key.push_back(added++);
+      clusters.add(1, pt, &key);
+    }
+  };
+  
+  auto checkKeys = [&]() {
+    FP mass = 0;
+    size_t keys = 0;
+    for ( auto &result : clusters.results() ) {
+      mass += result.getMass();
+      keys += result.getKey()->size();
+    }
+    XCTAssert(mass == added);
+    XCTAssert(keys == added);
+  };
+  
+  addPoints(2000, 8);
+  clusters.reduce(-1, 8);
+  
+  XCTAssert(clusters.count == 8);
+  
+  GvmMemoryReport before = clusters.memoryReport();
+  auto reduced = clusters.results();
+  
+  clusters.shrinkToFit();
+  
+  GvmMemoryReport after = clusters.memoryReport();
+  
+  XCTAssert(clusters.getCapacity() == 8);
+  XCTAssert(after.reserved == 28 * (sizeof(GvmClusterPair<ClusterVectorSpace, ClusterVector, ClusterKey, FP>) + sizeof(void*)));
+  XCTAssert(after.reserved * 10 < before.reserved);
+  XCTAssert(after.getTotal() * 2 < before.getTotal());
+  
+  auto shrunk = clusters.results();
+  
+  XCTAssert(shrunk.size() == 8);
+  for (int i = 0; i < 8; i++) {
+    XCTAssert(shrunk[i].getMass() == reduced[i].getMass());
+    XCTAssert(shrunk[i].point[0] == reduced[i].point[0]);
+    XCTAssert(*(shrunk[i].getKey()) == *(reduced[i].getKey()));
+  }
+  
+  // Adds at the reduced capacity merge as usual
+  
+  addPoints(500, 8);
+  
+  XCTAssert(clusters.count == 8);
+  checkKeys();
+  
+  // Grow back for more clusters
+  
+  clusters.setCapacity(256);
+  
+  XCTAssert(clusters.getCapacity() == 256);
+  
+  addPoints(1000, 32);
+  
+  XCTAssert(clusters.count > 8);
+  checkKeys();
+  
+  clusters.reduce(-1, 4);
+  
+  XCTAssert(clusters.count == 4);
+  checkKeys();
+  
+  // Shrinking a partly filled instance leaves it full
+  
+  GvmClusters<ClusterVectorSpace, ClusterVector, ClusterKey, FP> partial(vspace, 64);
+  
+  for (int i = 0; i < 5; i++) {
+    ClusterVector pt;
+    pt[0] = i * 10;
+    pt[1] = 0;
+    partial.add(1, pt, nullptr);
+  }
+  
+  partial.shrinkToFit();
+  
+  XCTAssert(partial.getCapacity() == 5);
+  
+  ClusterVector pt;
+  pt[0] = 1;
+  pt[1] = 0;
+  partial.add(1, pt, nullptr);
+  
+  XCTAssert(partial.count == 5);
+  XCTAssert(partial.results()[0].getMass() == 2);
+  
+#undef FP
+#undef ClusterVector
+#undef ClusterVectorSpace
+#undef ClusterKey
+}
+
 /*
 
 - (void)testPerformanceExample {
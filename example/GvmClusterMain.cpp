@@ -20,28 +20,6 @@
 using namespace std;
 using namespace Gvm;
 
-// Given a pixel represented as a 32 bit integer convert to a vector
-// of floating points representation and store in outVec.
-
-template<typename V, typename P>
-static inline
-void convertPoint(int32_t pixel, V &outVec)
-{
-  uint32_t B = pixel & 0xFF;
-  uint32_t G = (pixel >> 8) & 0xFF;
-  uint32_t R = (pixel >> 16) & 0xFF;
-  
-  P x = B;
-  P y = G;
-  P z = R;
-  
-  outVec[0] = x;
-  outVec[1] = y;
-  outVec[2] = z;
-  
-  return;
-}
-
 // Scan input values to make sure there are no duplicate pixels
 
 #if defined(DEBUG)
@@ -168,13 +146,14 @@ int main(int argc, char **argv) {
   
   // Insert each point into clusters. Each point is
   // associated with a list of points called a "key".
-  
-  ClusterVector pt;
+  // The 4 byte pixel is passed directly as a compact
+  // input point, only the cluster accumulators are
+  // stored as vectors of FP.
   
   for ( uint32_t pixel : allPixels ) {
     // Key is a list of (list of points)
     
-    convertPoint<ClusterVector,FP>(pixel, pt);
+    GvmPixelVector pt(pixel);
     
     if (false) {
     assert(pt.getDimensions() == 3);
@@ -11,7 +11,7 @@
 // http://www.apache.org/licenses/LICENSE-2.0
 //
 // This example reads an input image with libpng and then filters
-// duplicate pixels and sorts pixels by integer value. The sorted
+// duplicate pixels and sorts pixels along a Hilbert curve. The sorted
 // pixels are then clustered with Gvm and reordered from darker
 // to lighter in terms of the 3D color cube. The output is an
 // image that shows how specific pixels were clustered and
@@ -771,7 +771,16 @@ void write_png_file(char* file_name, PngContext *cxt)
   fclose(fp);
 }
 
-void process_file(PngContext *cxt)
+// Order that unique pixels are clustered in
+
+typedef enum {
+  PixelOrderInput = 0,
+  PixelOrderInt,
+  PixelOrderMorton,
+  PixelOrderHilbert
+} PixelOrder;
+
+void process_file(PngContext *cxt, PixelOrder pixelOrder)
 {
   // Input contains all pixels from image, dedup pixels using
   // an unordered_map and then sort after the dedup.
@@ -797,9 +806,16 @@ void process_file(PngContext *cxt)
   // Release possibly large amount of memory used for hashtable
   uniquePixelMap = unordered_map<uint32_t, uint32_t>();
   
-  // Sort pixels into int order (this can take some time for large N)
+  // Sort pixels along a space filling curve so that consecutive pixels
+  // are near in all three channels. Int order jumps across the colour
+  // cube each time the low channels wrap around.
   
-  sort(begin(allPixels), end(allPixels));
+  if (pixelOrder == PixelOrderInt) {
+    sort(begin(allPixels), end(allPixels));
+  } else if (pixelOrder == PixelOrderMorton || pixelOrder == PixelOrderHilbert) {
+    GvmCurveOrder<double> curveOrder(pixelOrder == PixelOrderMorton ? GvmCurveOrder<double>::Morton : GvmCurveOrder<double>::Hilbert);
+    curveOrder.sortPixels(allPixels);
+  }
   
   // Using float instead of double cuts memory usage down just a bit, like 10%
   
@@ -838,6 +854,12 @@ void process_file(PngContext *cxt)
   
   clusters.setKeyer(&listKeyer);
   
+  // Curve ordered pixels usually land in the last cluster again
+  
+  if (pixelOrder != PixelOrderInput) {
+    clusters.setUseLastWinner(true);
+  }
+  
 #if defined(DEBUG)
   if ((0)) {
     clusters.pointDebugOutput = fopen("clustering_point_debug.txt", "w");
@@ -1040,17 +1062,35 @@ void process_file(PngContext *cxt)
 }
 
 int main(int argc, char **argv) {
-  if (argc != 2) {
-    fprintf(stderr, "usage pngclustersort PNG\n");
+  if (argc != 2 && argc != 3) {
+    fprintf(stderr, "usage pngclustersort PNG ?hilbert|morton|int|input?\n");
     exit(1);
   }
   
+  PixelOrder pixelOrder = PixelOrderHilbert;
+  
+  if (argc == 3) {
+    string order = argv[2];
+    if (order == "input") {
+      pixelOrder = PixelOrderInput;
+    } else if (order == "int") {
+      pixelOrder = PixelOrderInt;
+    } else if (order == "morton") {
+      pixelOrder = PixelOrderMorton;
+    } else if (order == "hilbert") {
+      pixelOrder = PixelOrderHilbert;
+    } else {
+      fprintf(stderr, "unknown order \"%s\"\n", argv[2]);
+      exit(1);
+    }
+  }
+  
   PngContext cxt;
   read_png_file(argv[1], &cxt);
   
   printf("processing %d pixels from image of dimensions %d x %d\n", cxt.width*cxt.height, cxt.width, cxt.height);
   
-  process_file(&cxt);
+  process_file(&cxt, pixelOrder);
   
   PngContext_dealloc(&cxt);
 
@@ -20,11 +20,31 @@
 
 #import "GvmStdVector.hpp"
 #import "GvmVectorSpace.hpp"
+#import "GvmIntVector.hpp"
+#import "GvmIntVectorSpace.hpp"
+#import "GvmPixelVector.hpp"
+#import "GvmDynVector.hpp"
+#import "GvmDynVectorSpace.hpp"
+#import "GvmSparseVector.hpp"
+#import "GvmSparseVectorSpace.hpp"
 
 #import "GvmCluster.hpp"
 #import "GvmClusters.hpp"
 #import "GvmClusterPair.hpp"
 #import "GvmClusterPairs.hpp"
+#import "GvmLshIndex.hpp"
 
 #import "GvmResult.hpp"
 
+#import "GvmDedup.hpp"
+#import "GvmRunLength.hpp"
+#import "GvmCoreset.hpp"
+#import "GvmProjection.hpp"
+#import "GvmCurveOrder.hpp"
+#import "GvmHierarchy.hpp"
+#import "GvmRefine.hpp"
+#import "GvmLloyd.hpp"
+
+#import "GvmLevels.hpp"
+#import "GvmEventLog.hpp"
+#import "GvmMemoryReport.hpp"
@@ -167,9 +167,10 @@ namespace Gvm {
     
     // Sets this cluster equal to a single point.
     // m : the mass of the point
-    // pt : the coordinates of the point
+    // pt : the coordinates of the point, either a V or a compact input type
     
-    void set(FP m, V &pt) {
+    template<typename P>
+    void set(FP m, P &pt) {
       if (m == FP(0.0)) {
         if (count != 0) {
           clusters.space.setToOrigin(m1);
@@ -189,7 +190,8 @@ namespace Gvm {
     // m : the mass of the point
     // pt : the coordinates of the point
     
-    void add(const FP m, V &pt) {
+    template<typename P>
+    void add(const FP m, P &pt) {
       if (count == 0) {
         set(m, pt);
       } else {
@@ -247,7 +249,8 @@ namespace Gvm {
     // pt the coordinates of the point
     // return the variance of this cluster inclusive of the point
     
-    FP test(const FP m, const V &pt) {
+    template<typename P>
+    FP test(const FP m, const P &pt) {
       return m0 == FP(0.0) && m == FP(0.0) ? FP(0.0) : clusters.space.variance(m0, m1, m2, m, pt) - var;
     }
     
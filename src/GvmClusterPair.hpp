@@ -57,9 +57,11 @@ namespace Gvm {
     {
     }
     
-    // Constructor like setter for already constructed object in memory
+    // Constructor like setter for already constructed object in memory,
+    // when computeValue is false the value is left at zero and update()
+    // must be invoked before the pair is added to the heap.
     
-    void set(GvmCluster<S,V,K,FP> *inC1, GvmCluster<S,V,K,FP> *inC2) {
+    void set(GvmCluster<S,V,K,FP> *inC1, GvmCluster<S,V,K,FP> *inC2, bool computeValue = true) {
 #if defined(DEBUG)
       assert(c1 == nullptr);
       assert(c2 == nullptr);
@@ -77,7 +79,9 @@ namespace Gvm {
       c2 = inC2;
       index = 0;
       value = FP(0.0);
-      this->update();
+      if (computeValue) {
+        this->update();
+      }
     }
     
     // Constructs a new pair and computes its value.
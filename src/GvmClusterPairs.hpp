@@ -12,11 +12,29 @@
 //
 
 // Maintains a heap of cluster pairs.
+//
+// The pair storage is taken from anonymous mmap memory, the pages are only
+// committed by the OS when a pair is first written, so construction does
+// not depend on the capacity and the resident size follows the number of
+// pairs in use. A zero filled page holds pairs in the default state, so no
+// pair is constructed up front. Large allocations ask for transparent huge
+// pages where the OS supports them.
 
 #import "GvmCommon.hpp"
 
 #import "GvmClusterPair.hpp"
 
+#import <new>
+
+#import <stdlib.h>
+#import <string.h>
+
+#if defined(__unix__) || defined(__APPLE__)
+#import <sys/mman.h>
+#import <unistd.h>
+#define GVM_USE_MMAP 1
+#endif
+
 namespace Gvm {
 
   // S
@@ -84,8 +102,14 @@ namespace Gvm {
     
     int pairsUsed;
     
+    // Set when pairsArray or pairs was advised to use huge pages
+    
+    bool pairsArrayHuge;
+    
+    bool pairsHuge;
+    
     GvmClusterPairs<S,V,K,FP>(int inCapacity)
-    : size(0), capacity(inCapacity), pairsUsed(0)
+    : size(0), capacity(inCapacity), pairsUsed(0), pairsArrayHuge(false), pairsHuge(false)
     {
       // For N clusters, allocate solid block of (N * N) cluster pairs,
       // this allocation represents a significant amount of the memory
@@ -93,7 +117,7 @@ namespace Gvm {
       
       assert(capacity > 0);
       
-      pairsArray = new GvmClusterPair<S,V,K,FP>[capacity];
+      pairsArray = (GvmClusterPair<S,V,K,FP> *) allocZeroed(pairsArrayBytes(), &pairsArrayHuge);
       assert(pairsArray);
       
       if ((0)) {
@@ -103,7 +127,7 @@ namespace Gvm {
       // pairs is an array of pointers into pairsArray
       // initialized to nullptr.
       
-      pairs = new GvmClusterPair<S,V,K,FP>*[capacity]();
+      pairs = (GvmClusterPair<S,V,K,FP> **) allocZeroed(pairsBytes(), &pairsHuge);
       assert(pairs);
       
       if ((0)) {
@@ -118,13 +142,89 @@ namespace Gvm {
         fprintf(stdout, "dealloc pairs 0x%p\n", pairs);
       }
       
-      delete [] pairs;
+      freeZeroed(pairs, pairsBytes());
       
       if ((0)) {
         fprintf(stdout, "dealloc pairsArray 0x%p\n", pairsArray);
       }
       
-      delete [] pairsArray;
+      freeZeroed(pairsArray, pairsArrayBytes());
+    }
+    
+    size_t pairsArrayBytes() {
+      return (size_t) capacity * sizeof(GvmClusterPair<S,V,K,FP>);
+    }
+    
+    size_t pairsBytes() {
+      return (size_t) capacity * sizeof(GvmClusterPair<S,V,K,FP>*);
+    }
+    
+    // Bytes of pairsArray and pairs that hold the pairs in use, rounded up
+    // to whole pages since untouched pages are not committed. Storage that
+    // was advised to use huge pages is rounded to the huge page size, the
+    // kernel can still back it with base pages and the figure is then an
+    // upper bound.
+    
+    size_t pairsArrayBytesInUse() {
+      return roundToPage((size_t) pairsUsed * sizeof(GvmClusterPair<S,V,K,FP>), pairsArrayHuge);
+    }
+    
+    size_t pairsBytesInUse() {
+      return roundToPage((size_t) pairsUsed * sizeof(GvmClusterPair<S,V,K,FP>*), pairsHuge);
+    }
+    
+    static size_t roundToPage(size_t bytes, bool huge = false) {
+#if defined(GVM_USE_MMAP)
+      const size_t pageSize = huge ? hugePageSize() : (size_t) sysconf(_SC_PAGESIZE);
+#else
+      const size_t pageSize = 4096;
+#endif // GVM_USE_MMAP
+      return (bytes + pageSize - 1) / pageSize * pageSize;
+    }
+    
+    // Storage of at least this size is advised to use huge pages
+    
+    static size_t hugePageSize() {
+      return (size_t) 2 << 20;
+    }
+    
+    // True when an allocation of bytes is advised to use huge pages
+    
+    static bool usesHugePages(size_t bytes) {
+#if defined(GVM_USE_MMAP) && defined(MADV_HUGEPAGE)
+      return bytes >= hugePageSize();
+#else
+      return false;
+#endif // GVM_USE_MMAP && MADV_HUGEPAGE
+    }
+    
+    // Zero filled memory that is committed on first write, huge is set
+    // when the memory was advised to use huge pages
+    
+    static void* allocZeroed(size_t bytes, bool *huge) {
+      *huge = false;
+#if defined(GVM_USE_MMAP)
+      void *ptr = mmap(nullptr, bytes, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANON, -1, 0);
+      if (ptr == MAP_FAILED) {
+        return nullptr;
+      }
+#if defined(MADV_HUGEPAGE)
+      if (usesHugePages(bytes)) {
+        *huge = (madvise(ptr, bytes, MADV_HUGEPAGE) == 0);
+      }
+#endif // MADV_HUGEPAGE
+      return ptr;
+#else
+      return calloc(bytes, 1);
+#endif // GVM_USE_MMAP
+    }
+    
+    static void freeZeroed(void *ptr, size_t bytes) {
+#if defined(GVM_USE_MMAP)
+      munmap(ptr, bytes);
+#else
+      free(ptr);
+#endif // GVM_USE_MMAP
     }
     
     // Copy constructor explicitly deleted
@@ -162,14 +262,91 @@ namespace Gvm {
       return;
     }
     
-    // add cluster pair and return ref to shared pair object that was just added
+    // Adds the already valued pairs pairsArray[first] to pairsArray[last-1]
+    // and restores the heap order with a single bottom up pass, this is
+    // O(N) instead of the O(N log N) cost of invoking add() for each pair.
+    
+    void addRange(int first, int last) {
+#if defined(DEBUG)
+      assert(first >= 0 && last <= pairsUsed);
+      assert((size + (last - first)) <= capacity);
+#endif // DEBUG
+      for (int i = first; i < last; i++) {
+        GvmClusterPair<S,V,K,FP> *pair = &pairsArray[i];
+        pairs[size] = pair;
+        pair->index = size;
+        size++;
+      }
+      heapify();
+    }
+    
+    // Restores the heap order after the values of the pairs in the
+    // heap were changed without invoking reprioritize().
+    
+    void heapify() {
+      for (int i = ushift_right(size) - 1; i >= 0; i--) {
+        heapifyDown(i, pairs[i]);
+      }
+    }
+    
+    // Replaces the heap with the already valued pairs pairsArray[0] to
+    // pairsArray[used-1], any pair storage after these is released.
+    
+    void rebuild(int used) {
+#if defined(DEBUG)
+      assert(used >= 0 && used <= pairsUsed);
+#endif // DEBUG
+      for (int i = 0; i < size; i++) {
+        pairs[i] = nullptr;
+      }
+      size = 0;
+      release(used);
+      addRange(0, used);
+    }
+    
+    // Moves the pairs in use to storage for newCapacity pairs and frees the
+    // old storage. Pointers to the pairs must then be updated by the caller.
+    // The pairs in use must either all be in the heap or none of them.
+    
+    void reallocate(int newCapacity) {
+#if defined(DEBUG)
+      assert(size == 0 || size == pairsUsed);
+#endif // DEBUG
+      assert(newCapacity > 0 && newCapacity >= pairsUsed);
+      const bool inHeap = (size > 0);
+      
+      bool newPairsArrayHuge, newPairsHuge;
+      GvmClusterPair<S,V,K,FP> *newPairsArray = (GvmClusterPair<S,V,K,FP> *) allocZeroed((size_t) newCapacity * sizeof(GvmClusterPair<S,V,K,FP>), &newPairsArrayHuge);
+      assert(newPairsArray);
+      GvmClusterPair<S,V,K,FP> **newPairs = (GvmClusterPair<S,V,K,FP> **) allocZeroed((size_t) newCapacity * sizeof(GvmClusterPair<S,V,K,FP>*), &newPairsHuge);
+      assert(newPairs);
+      
+      memcpy((void *) newPairsArray, (void *) pairsArray, (size_t) pairsUsed * sizeof(GvmClusterPair<S,V,K,FP>));
+      
+      freeZeroed(pairs, pairsBytes());
+      freeZeroed(pairsArray, pairsArrayBytes());
+      
+      pairsArray = newPairsArray;
+      pairs = newPairs;
+      pairsArrayHuge = newPairsArrayHuge;
+      pairsHuge = newPairsHuge;
+      capacity = newCapacity;
+      size = 0;
+      
+      if (inHeap) {
+        addRange(0, pairsUsed);
+      }
+    }
+    
+    // add cluster pair and return ref to shared pair object that was just added,
+    // when computeValue is false the pair value must be computed later.
     
     GvmClusterPair<S,V,K,FP>*
-    newSharedPair(GvmCluster<S,V,K,FP> &c1, GvmCluster<S,V,K,FP> &c2) {
+    newSharedPair(GvmCluster<S,V,K,FP> &c1, GvmCluster<S,V,K,FP> &c2, bool computeValue = true) {
       assert(pairsUsed <= (capacity-1));
-      GvmClusterPair<S,V,K,FP> *pairPtr = &pairsArray[pairsUsed];
+      GvmClusterPair<S,V,K,FP> *pairPtr = new (&pairsArray[pairsUsed]) GvmClusterPair<S,V,K,FP>();
       pairsUsed++;
-      pairPtr->set(&c1, &c2);
+      pairPtr->set(&c1, &c2, computeValue);
       return pairPtr;
     }
 
@@ -211,6 +388,31 @@ namespace Gvm {
         //pairs[i] = e;
       }
       size = 0;
+      release(0);
+    }
+    
+    // Returns the pair storage from offset used onwards to the
+    // unused state expected by newSharedPair(). On Linux the whole
+    // pages in the range are handed back to the OS, they read as
+    // zero when next touched.
+    
+    void release(int used) {
+      int first = used;
+#if defined(GVM_USE_MMAP) && defined(__linux__)
+      const uintptr_t pageSize = (uintptr_t) sysconf(_SC_PAGESIZE);
+      const uintptr_t start = ((uintptr_t) &pairsArray[used] + pageSize - 1) & ~(pageSize - 1);
+      const uintptr_t end = ((uintptr_t) &pairsArray[pairsUsed]) & ~(pageSize - 1);
+      if (end > start && madvise((void *) start, end - start, MADV_DONTNEED) == 0) {
+        for (int i = used; (uintptr_t) &pairsArray[i] < start; i++) {
+          pairsArray[i] = GvmClusterPair<S,V,K,FP>();
+        }
+        first = (int)((end - (uintptr_t) pairsArray) / sizeof(GvmClusterPair<S,V,K,FP>));
+      }
+#endif // GVM_USE_MMAP && __linux__
+      for (int i = first; i < pairsUsed; i++) {
+        pairsArray[i] = GvmClusterPair<S,V,K,FP>();
+      }
+      pairsUsed = used;
     }
     
     int indexOf(GvmClusterPair<S,V,K,FP> *pair) {
@@ -19,6 +19,17 @@
 
 #import "GvmDefaultKeyer.hpp"
 #import "GvmClusterPairs.hpp"
+#import "GvmLshIndex.hpp"
+#import "GvmEventLog.hpp"
+#import "GvmMemoryReport.hpp"
+
+#import <algorithm>
+#import <thread>
+#import <atomic>
+#import <chrono>
+#import <functional>
+
+#import <math.h>
 
 namespace Gvm {
   // S
@@ -52,6 +63,75 @@ namespace Gvm {
       return var >= FP(0.0) ? var : FP(0.0);
     }
     
+    // Estimates the memory used by an instance once every cluster is in use.
+    // The pair storage is allocated by the constructor and grows with the
+    // square of the capacity, the clusters are allocated as points are added.
+    //
+    // inCapacity : the capacity passed to the constructor
+    // keyBytes : heap bytes of the key of one cluster, 0 when the keys
+    // are not used
+    // vectorBytes : heap bytes owned by one V outside of the object
+    
+    static GvmMemoryReport estimateMemory(int inCapacity, size_t keyBytes = 0, size_t vectorBytes = 0) {
+      GvmMemoryReport report;
+      const size_t N = (size_t) inCapacity;
+      const size_t P = N * (N - 1) / 2;
+      const size_t arrayBytes = P * sizeof(GvmClusterPair<S,V,K,FP>);
+      const size_t pointerBytes = P * sizeof(GvmClusterPair<S,V,K,FP>*);
+      report.pairsArray = GvmClusterPairs<S,V,K,FP>::roundToPage(arrayBytes, GvmClusterPairs<S,V,K,FP>::usesHugePages(arrayBytes));
+      report.pairs = GvmClusterPairs<S,V,K,FP>::roundToPage(pointerBytes, GvmClusterPairs<S,V,K,FP>::usesHugePages(pointerBytes));
+      report.reserved = P * (sizeof(GvmClusterPair<S,V,K,FP>) + sizeof(GvmClusterPair<S,V,K,FP>*));
+      report.clusterPairs = N * N * sizeof(GvmClusterPair<S,V,K,FP>*);
+      report.clusters = N * (sizeof(std::shared_ptr<GvmCluster<S,V,K,FP> >) + clusterObjectBytes() + 2 * vectorBytes);
+      report.keys = N * keyBytes;
+      report.other = sizeof(GvmClusters<S,V,K,FP>);
+      return report;
+    }
+    
+    // The largest supported capacity, the number of pairs is computed as
+    // capacity * (capacity - 1) / 2 in int and must not overflow.
+    
+    static int getMaxCapacity() {
+      return 46341;
+    }
+    
+    // The largest capacity with an estimated memory use that fits within
+    // budgetBytes, see estimateMemory(), and no greater than
+    // getMaxCapacity(). Returns 0 when not even a capacity of 2 fits.
+    
+    static int capacityForBudget(size_t budgetBytes, size_t keyBytes = 0, size_t vectorBytes = 0) {
+      const int maxCapacity = getMaxCapacity();
+      int lo = 1;
+      int hi = 2;
+      while (hi < maxCapacity && estimateMemory(hi, keyBytes, vectorBytes).getTotal() <= budgetBytes) {
+        lo = hi;
+        hi = std::min(hi * 2, maxCapacity);
+      }
+      while ((hi - lo) > 1) {
+        int mid = lo + (hi - lo) / 2;
+        if (estimateMemory(mid, keyBytes, vectorBytes).getTotal() <= budgetBytes) {
+          lo = mid;
+        } else {
+          hi = mid;
+        }
+      }
+      if (estimateMemory(hi, keyBytes, vectorBytes).getTotal() <= budgetBytes) {
+        lo = hi;
+      }
+      return lo < 2 ? 0 : lo;
+    }
+    
+    // Creates an instance with the largest capacity that fits within
+    // budgetBytes, nullptr when the budget is too small.
+    
+    static std::unique_ptr<GvmClusters<S,V,K,FP> > newWithBudget(S inSpace, size_t budgetBytes, size_t keyBytes = 0, size_t vectorBytes = 0) {
+      const int capacity = capacityForBudget(budgetBytes, keyBytes, vectorBytes);
+      if (capacity == 0) {
+        return nullptr;
+      }
+      return std::unique_ptr<GvmClusters<S,V,K,FP> >(new GvmClusters<S,V,K,FP>(inSpace, capacity));
+    }
+    
     // The greatest number of clusters that will be recorded
     
     int capacity;
@@ -95,6 +175,168 @@ namespace Gvm {
     
     int bound;
     
+    // While the clusters are first filled, pairs are created without a value
+    // and are not added to the heap. Once capacity is reached all the pair
+    // values are computed in one sweep and the heap is built bottom up.
+    // Set to false before the first add() to build the heap one pair at a
+    // time, clear() sets it back to true.
+    
+    bool pairsDeferred;
+    
+    // Number of threads used to compute the deferred pair values,
+    // 0 means use all cores.
+    
+    int numThreads;
+    
+    // When frozen, add() only assigns each point to the cheapest cluster.
+    // Clusters are never merged and the pair heap is not maintained, so
+    // the pair values go stale until thaw() revalues them.
+    
+    bool frozen;
+    
+    // Freeze once this many points have been added, -1 to disable.
+    
+    int freezeAfter;
+    
+    // Freeze when at most freezeMergeRate * freezeWindow merges were made
+    // over the last freezeWindow points, a window of 0 disables this.
+    
+    int freezeWindow;
+    
+    FP freezeMergeRate;
+    
+    int windowAdditions;
+    
+    int windowMerges;
+    
+    // Approximate add() is enabled when approxEpsilon is not negative, the
+    // scan stops at the first cluster with an addition cost no more than
+    // approxEpsilon times the cheapest merge cost. Clusters that recently
+    // received points are tested first.
+    
+    FP approxEpsilon;
+    
+    // Slots of the most recent winners, most recent first
+    
+    std::vector<int> recentWinners;
+    
+    int maxRecentWinners;
+    
+    std::vector<char> approxVisited;
+    
+    // Number of approximate scans, the number that stopped early
+    // and the total number of clusters tested.
+    
+    int64_t approxScans;
+    
+    int64_t approxExits;
+    
+    int64_t approxTested;
+    
+    // When useLastWinner is set, the exact scan in add() tests the cluster
+    // that received the previous point first and skips any cluster whose
+    // lower bound on the addition cost shows it cannot be cheaper.
+    
+    bool useLastWinner;
+    
+    bool localityValid;
+    
+    int lastWinner;
+    
+    // Lower bound on the distance from the previous point to each centroid
+    
+    std::vector<FP> lowerBounds;
+    
+    // Squared magnitude of each centroid
+    
+    std::vector<FP> centroidMagSqr;
+    
+    std::vector<FP> prevPoint;
+    
+    bool havePrev;
+    
+    // Number of scans and the total number of clusters tested
+    
+    int64_t localityScans;
+    
+    int64_t localityTested;
+    
+    // Optional LSH candidate generator, when set add() only tests
+    // the candidate clusters instead of scanning every cluster.
+    
+    std::unique_ptr<GvmLshIndex<S,V,K,FP> > lshPtr;
+    
+    // Number of points evaluated together by addBatch()
+    
+    int batchSize;
+    
+    // addBatch() cost matrix with one row of capacity costs for each point
+    // in a block, and a flag for each cluster modified within the block.
+    
+    std::vector<FP> batchCosts;
+    std::vector<char> batchDirty;
+    
+    // Optional log of the changes to each cluster slot, the caller must
+    // take care to manage the lifetime of the pointer.
+    
+    GvmEventLog *eventLogPtr;
+    
+    // When monitored, add() counts down checkInterval points and then checks
+    // the deadline, the progress callback and the cancel flag, so the clock
+    // is read at a low frequency. As the deadline comes near, the clusters
+    // are frozen and then the points are subsampled with a stride that
+    // doubles each time, and once the deadline passes or the work is
+    // cancelled later points are ignored.
+    
+    bool monitored;
+    
+    bool hasDeadline;
+    
+    bool budgetExpired;
+    
+    std::chrono::steady_clock::time_point budgetStart;
+    
+    std::chrono::steady_clock::time_point budgetDeadline;
+    
+    std::chrono::steady_clock::time_point lastCheck;
+    
+    // Number of points expected before the deadline, 0 if not known
+    
+    int64_t expectedPoints;
+    
+    // Number of points passed to add() since monitoring started and
+    // the number at the last check
+    
+    int64_t budgetSeen;
+    
+    int64_t seenAtCheck;
+    
+    int checkInterval;
+    
+    int checkCountdown;
+    
+    // 0 for full processing, 1 once frozen, then subsampled
+    
+    int budgetLevel;
+    
+    // Only one point out of sampleStride is clustered, with its mass
+    // scaled by sampleStride
+    
+    int sampleStride;
+    
+    int sampleCounter;
+    
+    // Number of points ignored by subsampling or after the deadline
+    
+    int64_t budgetSkipped;
+    
+    // Invoked at each check with the number of points seen and the seconds
+    // elapsed, returning false cancels the work.
+    
+    std::function<bool(int64_t, double)> progressCallback;
+    
+    std::atomic<bool> cancelRequested;
+    
 #if defined(DEBUG)
     FILE *pointDebugOutput;
 #endif // DEBUG
@@ -103,16 +345,51 @@ namespace Gvm {
     
     GvmClusters<S,V,K,FP>(S inSpace, int inCapacity)
     :
-    space(inSpace),
     capacity(inCapacity),
+    space(inSpace),
     defaultKeyerPtr(new GvmDefaultKeyer<S,V,K,FP>()),
     keyerPtr(nullptr),
     pairs(capacity * (capacity-1) / 2),
     additions(0),
     count(0),
-    bound(0)
+    bound(0),
+    pairsDeferred(true),
+    numThreads(0),
+    frozen(false),
+    freezeAfter(-1),
+    freezeWindow(0),
+    freezeMergeRate(0.0),
+    windowAdditions(0),
+    windowMerges(0),
+    approxEpsilon(-1.0),
+    maxRecentWinners(0),
+    approxScans(0),
+    approxExits(0),
+    approxTested(0),
+    useLastWinner(false),
+    localityValid(false),
+    lastWinner(-1),
+    havePrev(false),
+    localityScans(0),
+    localityTested(0),
+    lshPtr(nullptr),
+    batchSize(16),
+    eventLogPtr(nullptr),
+    monitored(false),
+    hasDeadline(false),
+    budgetExpired(false),
+    expectedPoints(0),
+    budgetSeen(0),
+    seenAtCheck(0),
+    checkInterval(256),
+    checkCountdown(256),
+    budgetLevel(0),
+    sampleStride(1),
+    sampleCounter(0),
+    budgetSkipped(0),
+    cancelRequested(false)
     {
-      assert(inCapacity > 0);
+      assert(inCapacity > 0 && inCapacity <= getMaxCapacity());
       clusters.reserve(capacity);
       for (int i=0; i < capacity; i++) {
         clusters.push_back(nullptr);
@@ -150,21 +427,260 @@ namespace Gvm {
       keyerPtr = nullptr;
     }
     
+    // Log each change to the cluster slots, see GvmEventLog. The log should
+    // be installed before the first point is added, nullptr stops logging.
+    
+    void setEventLog(GvmEventLog *inEventLog) {
+      eventLogPtr = inEventLog;
+    }
+    
+    GvmEventLog* getEventLog() {
+      return eventLogPtr;
+    }
+    
+    // Enable approximate candidate generation in add() with random hyperplane
+    // LSH, see GvmLshIndex. The space must define getDimensions() and both the
+    // points and V must support a const operator[].
+    //
+    // tables : number of hash tables
+    // bits : number of bits in each table code, at most 32
+    // probeRadius : max number of differing code bits for a candidate
+    // validate : also run the exact scan and count misses
+    
+    void setLsh(int tables, int bits, int probeRadius = 1, bool validate = false, uint32_t seed = 1) {
+      lshPtr.reset(new GvmLshIndex<S,V,K,FP>(space.getDimensions(), capacity, tables, bits, probeRadius, validate, seed));
+    }
+    
+    // Return to the exact scan in add()
+    
+    void resetLsh() {
+      lshPtr.reset();
+    }
+    
+    GvmLshIndex<S,V,K,FP>* getLsh() {
+      return lshPtr.get();
+    }
+    
+    // Stop merging clusters, later points are only assigned to the cheapest
+    // cluster. This has no effect until the clusters are full.
+    
+    void freeze() {
+      if (count < capacity) return;
+      buildPairs();
+      frozen = true;
+    }
+    
+    // Resume merging, the pair values that went stale while frozen are all
+    // recomputed and the heap is rebuilt in one pass. reduce() invokes this
+    // so that a final reduce() sees the current cluster state.
+    
+    void thaw() {
+      if (!frozen) return;
+      frozen = false;
+      windowAdditions = 0;
+      windowMerges = 0;
+      fillCachedValues();
+      GvmClusterPair<S,V,K,FP> **heap = pairs.pairs;
+      parallelFor(pairs.getSize(), [heap](int start, int end) {
+        for (int i = start; i < end; i++) {
+          heap[i]->update();
+        }
+      });
+      pairs.heapify();
+    }
+    
+    bool isFrozen() {
+      return frozen;
+    }
+    
+    // Enable approximate add(), a cluster is accepted without testing the
+    // remaining clusters when its addition cost is within epsilon of the
+    // cheapest merge cost. The addition cost is never negative so a cost of
+    // zero is always optimal, a larger epsilon trades quality for speed.
+    //
+    // epsilon : relative threshold, not negative
+    // recent : number of recent winners tested before the other clusters
+    
+    void setApproximate(FP epsilon, int recent = 8) {
+      assert(epsilon >= FP(0.0));
+      approxEpsilon = epsilon;
+      maxRecentWinners = recent;
+      recentWinners.clear();
+      approxVisited.assign(capacity, 0);
+      approxScans = 0;
+      approxExits = 0;
+      approxTested = 0;
+    }
+    
+    // Return to the exact scan in add()
+    
+    void resetApproximate() {
+      approxEpsilon = FP(-1.0);
+      recentWinners.clear();
+    }
+    
+    // Fraction of approximate scans that stopped early
+    
+    FP getEarlyExitRate() {
+      return approxScans == 0 ? FP(0.0) : FP(approxExits) / FP(approxScans);
+    }
+    
+    // Enable or disable the last winner shortcut in the exact scan,
+    // the result is the same as the full scan.
+    
+    void setUseLastWinner(bool enable) {
+      useLastWinner = enable;
+      localityValid = false;
+      localityScans = 0;
+      localityTested = 0;
+    }
+    
+    // Process points under a deadline. Before the deadline the clusters are
+    // frozen and then the points are subsampled when the deadline is at
+    // risk, after it later points are ignored and results() returns the
+    // clusters built so far. A sampled point has its mass multiplied by the
+    // stride and its key passed through GvmKeyer::scaleKey().
+    //
+    // deadline : time after which points are ignored
+    // inExpectedPoints : number of points expected, used to project the
+    // finish time, with 0 the clusters are frozen at half the budget and
+    // the stride doubles at 3/4, 7/8 and so on
+    // inCheckInterval : number of points between checks
+    
+    void setDeadline(std::chrono::steady_clock::time_point deadline, int64_t inExpectedPoints = 0, int inCheckInterval = 256) {
+      startMonitor(inCheckInterval);
+      hasDeadline = true;
+      budgetDeadline = deadline;
+      expectedPoints = inExpectedPoints;
+    }
+    
+    // Process points for at most seconds from now, see setDeadline()
+    
+    void setTimeBudget(double seconds, int64_t inExpectedPoints = 0, int inCheckInterval = 256) {
+      auto duration = std::chrono::duration_cast<std::chrono::steady_clock::duration>(std::chrono::duration<double>(seconds));
+      setDeadline(std::chrono::steady_clock::now() + duration, inExpectedPoints, inCheckInterval);
+    }
+    
+    // Invoke callback every inCheckInterval points, the callback returns
+    // false to cancel. This can be combined with a deadline.
+    
+    void setProgressCallback(std::function<bool(int64_t, double)> callback, int inCheckInterval = 256) {
+      if (!monitored) {
+        startMonitor(inCheckInterval);
+      } else {
+        checkInterval = inCheckInterval;
+      }
+      progressCallback = callback;
+    }
+    
+    // Requests cancellation, safe to invoke from another thread. The flag
+    // is read at the next check so it has an effect only while a deadline
+    // or a progress callback is set.
+    
+    void cancel() {
+      cancelRequested.store(true, std::memory_order_relaxed);
+    }
+    
+    // Stops monitoring and returns to full processing of every point, the
+    // clusters stay frozen until thaw() or reduce() is invoked.
+    
+    void resetDeadline() {
+      monitored = false;
+      hasDeadline = false;
+      budgetExpired = false;
+      budgetLevel = 0;
+      sampleStride = 1;
+      progressCallback = nullptr;
+      cancelRequested.store(false, std::memory_order_relaxed);
+    }
+    
+    // True once the deadline passed or the work was cancelled
+    
+    bool isExpired() {
+      return budgetExpired;
+    }
+    
+    int getBudgetLevel() {
+      return budgetLevel;
+    }
+    
+    int getSampleStride() {
+      return sampleStride;
+    }
+    
+    int64_t getBudgetSkipped() {
+      return budgetSkipped;
+    }
+    
     int getCapacity() {
       return capacity;
     }
     
+    // Memory in use now, see estimateMemory(). The pair storage counts the
+    // pages that hold pairs in use, the full allocation is in reserved.
+    
+    GvmMemoryReport memoryReport() {
+      GvmMemoryReport report;
+      report.pairsArray = pairs.pairsArrayBytesInUse();
+      report.pairs = pairs.pairsBytesInUse();
+      report.reserved = pairs.pairsArrayBytes() + pairs.pairsBytes();
+      report.clusters = clusters.capacity() * sizeof(std::shared_ptr<GvmCluster<S,V,K,FP> >);
+      for ( auto &clusterSharedPtr : clusters ) {
+        GvmCluster<S,V,K,FP> *clusterPtr = clusterSharedPtr.get();
+        if (clusterPtr == nullptr) {
+          continue;
+        }
+        report.clusterPairs += clusterPtr->pairs.capacity() * sizeof(GvmClusterPair<S,V,K,FP>*);
+        report.clusters += clusterObjectBytes() + gvmHeapBytes(clusterPtr->m1) + gvmHeapBytes(clusterPtr->m2);
+        report.keys += gvmHeapBytes(clusterPtr->keyVec);
+      }
+      report.other = sizeof(GvmClusters<S,V,K,FP>);
+      report.other += gvmHeapBytes(recentWinners) + gvmHeapBytes(approxVisited);
+      report.other += gvmHeapBytes(lowerBounds) + gvmHeapBytes(centroidMagSqr) + gvmHeapBytes(prevPoint);
+      report.other += gvmHeapBytes(batchCosts) + gvmHeapBytes(batchDirty);
+      if (lshPtr) {
+        GvmLshIndex<S,V,K,FP> &lsh = *(lshPtr.get());
+        report.other += sizeof(lsh) + gvmHeapBytes(lsh.planes) + gvmHeapBytes(lsh.offsets) + gvmHeapBytes(lsh.codes);
+        report.other += gvmHeapBytes(lsh.projections) + gvmHeapBytes(lsh.pointCodes) + gvmHeapBytes(lsh.candidates);
+        report.other += lsh.bucketBytes();
+      }
+      return report;
+    }
+    
     S getSpace() {
       return space;
     }
     
-    // Removes all clusters and clustered points but retains the keyer.
+    // Removes all clusters and clustered points but retains the keyer. The
+    // clusters are no longer frozen, and the deadline, the progress callback
+    // and a pending cancel are dropped as with resetDeadline().
     
     void clear() {
+      if (eventLogPtr) {
+        for (int i = 0; i < bound; i++) {
+          if (clusters[i] != nullptr && !clusters[i]->removed) {
+            eventLogPtr->restart(i);
+          }
+        }
+      }
       for (int i=0; i < capacity; i++) {
         clusters[i] = nullptr;
       }
       pairs.clear();
+      if (lshPtr) {
+        lshPtr->invalidate();
+      }
+      localityValid = false;
+      recentWinners.clear();
+      pairsDeferred = true;
+      frozen = false;
+      windowAdditions = 0;
+      windowMerges = 0;
+      resetDeadline();
+      budgetSeen = 0;
+      seenAtCheck = 0;
+      sampleCounter = 0;
+      budgetSkipped = 0;
       additions = 0;
       count = 0;
       bound = 0;
@@ -180,9 +696,37 @@ namespace Gvm {
     // of the key object is not managed by the library,
     // the caller will typically pass in a tmp value
     // allocated on the stack. The key can be nullptr.
+    //
+    // The point can be a V or a compact input type like GvmPixelVector,
+    // the cluster accumulators are always of type V.
     
-    void add(const FP m, V &pt, K *key) {
-      if (m == FP(0.0)) return; //nothing to do
+    template<typename P>
+    void add(FP m, P &pt, K *key) {
+      if (monitored) {
+        budgetSeen++;
+        if (--checkCountdown <= 0) {
+          checkBudget();
+        }
+        if (budgetExpired || (sampleStride > 1 && ++sampleCounter < sampleStride)) {
+          budgetSkipped++;
+          if (eventLogPtr) {
+            eventLogPtr->skip();
+          }
+          return;
+        }
+        sampleCounter = 0;
+        if (sampleStride > 1) {
+          m *= FP(sampleStride);
+          key = getKeyer()->scaleKey(key, FP(sampleStride));
+        }
+      }
+      
+      if (m == FP(0.0)) {
+        if (eventLogPtr) {
+          eventLogPtr->skip();
+        }
+        return; //nothing to do
+      }
       
       GvmKeyer<S,V,K,FP>* const keyer = getKeyer();
       
@@ -192,111 +736,652 @@ namespace Gvm {
 #if defined(DEBUG)
         if (pointDebugOutput) {
           std::string ptStr = pt.toString();
-          fprintf(pointDebugOutput, "add to cluster[%d] for point %s\n", additions, ptStr.c_str());
+          fprintf(pointDebugOutput, "add to cluster[%d] for point %s\n", count, ptStr.c_str());
         }
 #endif // DEBUG
         
         auto newClusterPtr = std::make_shared<GvmCluster<S,V,K,FP> >(*this);
 #if defined(DEBUG)
-        assert(clusters[additions] == nullptr);
+        assert(clusters[count] == nullptr);
 #endif // DEBUG
-        clusters[additions] = newClusterPtr;
+        clusters[count] = newClusterPtr;
         GvmCluster<S,V,K,FP> &cluster = *(newClusterPtr.get());
         cluster.set(m, pt);
         addPairs();
         cluster.setKey(keyer->addKey(cluster, key));
+        if (eventLogPtr) {
+          eventLogPtr->add(count);
+        }
         count++;
         bound = count;
+        if (count == capacity) {
+          buildPairs();
+        }
       } else {
-        //identify cheapest merge
-        GvmClusterPair<S,V,K,FP> *mergePairPtr = pairs.peek();
-        FP mergeT = mergePairPtr == nullptr ? std::numeric_limits<FP>::max() : mergePairPtr->value;
+        //find cheapest addition
+        GvmCluster<S,V,K,FP> *additionCPtr = nullptr;
+        FP additionT = std::numeric_limits<FP>::max();
+        int additionI = 0;
+        if (lshPtr) {
+          additionCPtr = lshPtr->findAddition(*this, m, pt, additionT, additionI);
+        } else if (approxEpsilon >= FP(0.0)) {
+          additionCPtr = findApproximateAddition(m, pt, additionT, additionI);
+        } else if (useLastWinner) {
+          additionCPtr = findLocalAddition(m, pt, additionT, additionI);
+        } else {
+          for (int i = 0; i < clusters.size(); i++) {
+            auto &clusterSharedPtr = clusters[i];
+            GvmCluster<S,V,K,FP> *clusterPtr = clusterSharedPtr.get();
+            FP t = clusterPtr->test(m, pt);
+            if (t < additionT) {
+              additionCPtr = clusterPtr;
+              additionT = t;
+              additionI = i;
+            }
+          }
+        }
+        if (approxEpsilon >= FP(0.0) || useLastWinner) {
+          int changed[2];
+          place(m, pt, key, additionCPtr, additionT, additionI, changed);
+          const int winner = changed[1] >= 0 ? changed[1] : changed[0];
+          if (approxEpsilon >= FP(0.0)) {
+            noteWinner(winner);
+          }
+          if (useLastWinner) {
+            noteLocalChange(changed, winner);
+          }
+        } else {
+          place(m, pt, key, additionCPtr, additionT, additionI, nullptr);
+        }
+      }
+      additions++;
+      checkFreeze();
+      
+      return;
+    }
+    
+    // Adds n points to be clustered, the result is identical to invoking
+    // add() for each point in order. Once the clusters are full, the points
+    // are evaluated in blocks of batchSize: each cluster is tested against
+    // every point in the block while its moments are in cache, which fills
+    // a matrix of costs. The decisions are then applied in order and only
+    // the clusters modified by an earlier point in the block are tested
+    // again for the points that follow.
+    //
+    // masses : the mass of each point, nullptr for a mass of 1
+    // points : n points, either V or a compact input type
+    // keys : the key for each point, may be nullptr
+    
+    template<typename P>
+    void addBatch(const FP *masses, P *points, K *keys, int n) {
+      int p = 0;
+      
+      // Fill clusters and handle LSH candidates or approximate
+      // adds one point at a time
+      
+      while (p < n && (count < capacity || lshPtr || approxEpsilon >= FP(0.0) || monitored)) {
+        add(masses == nullptr ? FP(1.0) : masses[p], points[p], keys == nullptr ? nullptr : &keys[p]);
+        p++;
+      }
+      
+      const int numClusters = (int) clusters.size();
+      batchCosts.resize((size_t)batchSize * numClusters);
+      batchDirty.resize(numClusters);
+      
+      while (p < n) {
+        const int num = std::min(batchSize, n - p);
         
-#if defined(DEBUG)
-        if (pointDebugOutput) {
-          std::string ptStr = pt.toString();
-          fprintf(pointDebugOutput, "merge threshold is %0.16f with %d clusters\n", mergeT, count);
+        // Cost matrix for the block
+        
+        for (int i = 0; i < numClusters; i++) {
+          GvmCluster<S,V,K,FP> *clusterPtr = clusters[i].get();
+          for (int b = 0; b < num; b++) {
+            const FP m = masses == nullptr ? FP(1.0) : masses[p + b];
+            batchCosts[(size_t)b * numClusters + i] = (m == FP(0.0)) ? FP(0.0) : clusterPtr->test(m, points[p + b]);
+          }
         }
-#endif // DEBUG
         
-        //find cheapest addition
+        std::fill(batchDirty.begin(), batchDirty.end(), 0);
+        localityValid = false;
+        bool anyDirty = false;
+        
+        for (int b = 0; b < num; b++) {
+          const FP m = masses == nullptr ? FP(1.0) : masses[p + b];
+          if (m == FP(0.0)) {
+            if (eventLogPtr) {
+              eventLogPtr->skip();
+            }
+            continue; //nothing to do
+          }
+          
+          P &pt = points[p + b];
+          const FP *costs = &batchCosts[(size_t)b * numClusters];
+          
+          GvmCluster<S,V,K,FP> *additionCPtr = nullptr;
+          FP additionT = std::numeric_limits<FP>::max();
+          int additionI = 0;
+          for (int i = 0; i < numClusters; i++) {
+            FP t = (anyDirty && batchDirty[i]) ? clusters[i]->test(m, pt) : costs[i];
+            if (t < additionT) {
+              additionCPtr = clusters[i].get();
+              additionT = t;
+              additionI = i;
+            }
+          }
+          
+          int changed[2];
+          place(m, pt, keys == nullptr ? nullptr : &keys[p + b], additionCPtr, additionT, additionI, changed);
+          for (int j = 0; j < 2; j++) {
+            if (changed[j] >= 0) {
+              batchDirty[changed[j]] = 1;
+              anyDirty = true;
+            }
+          }
+          additions++;
+          checkFreeze();
+        }
+        
+        p += num;
+      }
+    }
+
+    // Adds a whole cluster, typically one taken from another GvmClusters
+    // instance. The cluster is treated like a point that carries its own
+    // moments: it is either combined with the cluster where it least
+    // increases the variance, or the two closest clusters are merged and
+    // the freed cluster is set to it. The keys are combined by the keyer.
+    // An event log gives the cluster one point id for each of its points.
+    //
+    // other : a cluster that does not belong to this instance
+
+    void addCluster(GvmCluster<S,V,K,FP> &other) {
+      const int64_t numPoints = other.count > 1 ? other.count : 1;
+
+      if (other.m0 == FP(0.0)) {
+        if (eventLogPtr) {
+          eventLogPtr->skip(numPoints);
+        }
+        return; //nothing to do
+      }
+
+      GvmKeyer<S,V,K,FP>* const keyer = getKeyer();
+
+      if (count < capacity) {
+        auto newClusterPtr = std::make_shared<GvmCluster<S,V,K,FP> >(*this);
+#if defined(DEBUG)
+        assert(clusters[count] == nullptr);
+#endif // DEBUG
+        clusters[count] = newClusterPtr;
+        GvmCluster<S,V,K,FP> &cluster = *(newClusterPtr.get());
+        cluster.set(other);
+        cluster.count = other.count;
+        addPairs();
+        cluster.setKey(keyer->addKey(cluster, other.getKey()));
+        if (eventLogPtr) {
+          eventLogPtr->add(count, numPoints);
+        }
+        count++;
+        bound = count;
+        if (count == capacity) {
+          buildPairs();
+        }
+      } else {
+        //find cheapest combination
         GvmCluster<S,V,K,FP> *additionCPtr = nullptr;
         FP additionT = std::numeric_limits<FP>::max();
-#if defined(DEBUG)
         int additionI = 0;
-#endif // DEBUG
-        for (int i = 0; i < clusters.size(); i++) {
-          auto &clusterSharedPtr = clusters[i];
-          GvmCluster<S,V,K,FP> *clusterPtr = clusterSharedPtr.get();
-          FP t = clusterPtr->test(m, pt);
+        for (int i = 0; i < count; i++) {
+          GvmCluster<S,V,K,FP> *clusterPtr = clusters[i].get();
+          FP t = clusterPtr->test(other) - clusterPtr->var - other.var;
           if (t < additionT) {
             additionCPtr = clusterPtr;
             additionT = t;
-#if defined(DEBUG)
             additionI = i;
-#endif // DEBUG
           }
         }
+
+        GvmClusterPair<S,V,K,FP> *mergePairPtr = frozen ? nullptr : pairs.peek();
+        FP mergeT = mergePairPtr == nullptr ? std::numeric_limits<FP>::max() : mergePairPtr->value;
+
         if (additionT <= mergeT) {
-#if defined(DEBUG)
-          if (pointDebugOutput) {
-            std::string ptStr = pt.toString();
-            fprintf(pointDebugOutput, "cheapest add is %0.16f for cluster[%d] and point %s\n", additionT, additionI, ptStr.c_str());
-          }
-#endif // DEBUG
-          
-          //choose addition
           GvmCluster<S,V,K,FP> &additionC = *additionCPtr;
-          additionC.add(m, pt);
-          updatePairs(additionC);
-          additionC.setKey(keyer->addKey(additionC, key));
-        } else {
-#if defined(DEBUG)
-          if (pointDebugOutput) {
-            std::string ptStr = pt.toString();
-            fprintf(pointDebugOutput, "cheapest merge is %0.16f for cluster[%d] and point %s\n", additionT, additionI, ptStr.c_str());
+          additionC.setKey(keyer->mergeKeys(additionC, other));
+          additionC.add(other);
+          if (eventLogPtr) {
+            eventLogPtr->add(additionI, numPoints);
           }
-#endif // DEBUG
-          
-          //choose merge
+          if (!frozen) {
+            updatePairs(additionC);
+          }
+          if (lshPtr) {
+            lshPtr->update(*this, additionI);
+          }
+        } else {
           GvmCluster<S,V,K,FP> *c1 = mergePairPtr->c1;
           GvmCluster<S,V,K,FP> *c2 = mergePairPtr->c2;
           if (c1->m0 < c2->m0) {
             c1 = c2;
             c2 = mergePairPtr->c1;
-#if defined(DEBUG)
-            if (pointDebugOutput) {
-              std::string ptStr = pt.toString();
-              fprintf(pointDebugOutput, "merge c2 <- c1 : N keys %d <- %d\n", (int)c1->keyVec.size(), (int)c2->keyVec.size());
-            }
-#endif // DEBUG
-          } else {
-#if defined(DEBUG)
-            if (pointDebugOutput) {
-              std::string ptStr = pt.toString();
-              fprintf(pointDebugOutput, "merge c1 <- c2: N keys %d <- %d\n", (int)c2->keyVec.size(), (int)c1->keyVec.size());
-            }
-#endif // DEBUG
           }
           c1->setKey(keyer->mergeKeys(*c1, *c2));
           c1->add(*c2);
           updatePairs(*c1);
-          c2->set(m, pt);
+          c2->set(other);
+          c2->count = other.count;
           updatePairs(*c2);
-          //TODO should this pass through a method on keyer?
+          if (lshPtr) {
+            lshPtr->update(*this, c1);
+            lshPtr->update(*this, c2);
+          }
           c2->setKey(nullptr);
-          c2->setKey(keyer->addKey(*c2, key));
+          c2->setKey(keyer->addKey(*c2, other.getKey()));
+          if (eventLogPtr) {
+            const int s2 = slotOf(c2);
+            eventLogPtr->merge(slotOf(c1), s2);
+            eventLogPtr->add(s2, numPoints);
+          }
         }
       }
+      localityValid = false;
+      recentWinners.clear();
       additions++;
+    }
+
+    // Approximate scan for the cheapest cluster to add a point to, the recent
+    // winners are tested first and the scan stops at the first cluster with
+    // a cost of no more than approxEpsilon times the cheapest merge cost.
+    
+    template<typename P>
+    GvmCluster<S,V,K,FP>* findApproximateAddition(const FP m, P &pt, FP &additionT, int &additionI) {
+      GvmClusterPair<S,V,K,FP> *mergePairPtr = pairs.peek();
+      const FP exitT = mergePairPtr == nullptr ? FP(0.0) : approxEpsilon * mergePairPtr->value;
       
-      return;
+      GvmCluster<S,V,K,FP> *additionCPtr = nullptr;
+      additionT = std::numeric_limits<FP>::max();
+      additionI = 0;
+      approxScans++;
+      
+      bool exit = false;
+      const int numRecent = (int) recentWinners.size();
+      for (int j = 0; j < numRecent && !exit; j++) {
+        const int i = recentWinners[j];
+        approxVisited[i] = 1;
+        GvmCluster<S,V,K,FP> *clusterPtr = clusters[i].get();
+        FP t = clusterPtr->test(m, pt);
+        approxTested++;
+        if (t < additionT) {
+          additionCPtr = clusterPtr;
+          additionT = t;
+          additionI = i;
+          exit = (t <= exitT);
+        }
+      }
+      
+      const int numClusters = (int) clusters.size();
+      for (int i = 0; i < numClusters && !exit; i++) {
+        if (approxVisited[i]) continue;
+        GvmCluster<S,V,K,FP> *clusterPtr = clusters[i].get();
+        FP t = clusterPtr->test(m, pt);
+        approxTested++;
+        if (t < additionT) {
+          additionCPtr = clusterPtr;
+          additionT = t;
+          additionI = i;
+          exit = (t <= exitT);
+        }
+      }
+      
+      for (int j = 0; j < numRecent; j++) {
+        approxVisited[recentWinners[j]] = 0;
+      }
+      if (exit) {
+        approxExits++;
+      }
+      return additionCPtr;
+    }
+    
+    // Exact scan for the cheapest cluster to add a point to, with the last
+    // winner tested first.
+    //
+    // Adding a point x of mass m to a cluster of mass m0 with centroid c
+    // costs w |x - c|^2 with w = m0 m / (m0 + m). A lower bound on |x - c|
+    // is kept for each cluster, when the point moves by step from the
+    // previous point the bound drops by step. A cluster is skipped when
+    // w * bound^2 exceeds the cheapest cost found so far by more than the
+    // rounding error of test(), so it could never have been chosen by the
+    // full scan. A cluster that changes gets a bound of zero.
+    
+    template<typename P>
+    GvmCluster<S,V,K,FP>* findLocalAddition(const FP m, P &pt, FP &additionT, int &additionI) {
+      const int numClusters = (int) clusters.size();
+      const int D = space.getDimensions();
+      
+      if (!localityValid) {
+        lowerBounds.assign(numClusters, FP(0.0));
+        centroidMagSqr.assign(numClusters, FP(0.0));
+        for (int i = 0; i < numClusters; i++) {
+          updateCentroidMagSqr(i);
+        }
+        prevPoint.assign(D, FP(0.0));
+        havePrev = false;
+        lastWinner = -1;
+        localityValid = true;
+      }
+      
+      FP xx = FP(0.0);
+      FP stepSqr = FP(0.0);
+      for (int d = 0; d < D; d++) {
+        FP v = FP(pt[d]);
+        FP s = v - prevPoint[d];
+        xx += v * v;
+        stepSqr += s * s;
+        prevPoint[d] = v;
+      }
+      const FP step = havePrev ? sqrt(stepSqr) : std::numeric_limits<FP>::max();
+      havePrev = true;
+      
+      // Relative rounding error allowed for a test() result
+      
+      const FP eps = std::numeric_limits<FP>::epsilon() * FP(8 * D);
+      
+      localityScans++;
+      
+      FP bestT = std::numeric_limits<FP>::max();
+      FP winnerT = bestT;
+      if (lastWinner >= 0) {
+        winnerT = clusters[lastWinner]->test(m, pt);
+        bestT = winnerT;
+        localityTested++;
+      }
+      
+      GvmCluster<S,V,K,FP> *additionCPtr = nullptr;
+      additionT = std::numeric_limits<FP>::max();
+      additionI = 0;
+      
+      for (int i = 0; i < numClusters; i++) {
+        GvmCluster<S,V,K,FP> &cluster = *(clusters[i].get());
+        FP bound = lowerBounds[i] - step;
+        if (!(bound > FP(0.0))) {
+          bound = FP(0.0);
+        }
+        const FP w = (cluster.m0 * m) / (cluster.m0 + m);
+        const FP tol = eps * (((cluster.m0 + m) * (xx + centroidMagSqr[i])) + cluster.var);
+        FP t;
+        if (i == lastWinner) {
+          t = winnerT;
+        } else {
+          if (((w * bound * bound) - tol) > bestT) {
+            lowerBounds[i] = bound;
+            continue;
+          }
+          t = cluster.test(m, pt);
+          localityTested++;
+          if (t < bestT) {
+            bestT = t;
+          }
+        }
+        const FP distSqr = (w > FP(0.0)) ? ((t - tol) / w) : FP(0.0);
+        lowerBounds[i] = distSqr > FP(0.0) ? sqrt(distSqr) : FP(0.0);
+        if (t < additionT) {
+          additionCPtr = &cluster;
+          additionT = t;
+          additionI = i;
+        }
+      }
+      
+      return additionCPtr;
+    }
+    
+    void updateCentroidMagSqr(int slot) {
+      GvmCluster<S,V,K,FP> &cluster = *(clusters[slot].get());
+      centroidMagSqr[slot] = cluster.m0 == FP(0.0) ? FP(0.0) : space.magnitudeSqr(cluster.m1) / (cluster.m0 * cluster.m0);
+    }
+    
+    // Resets the bounds of the clusters modified by place()
+    
+    void noteLocalChange(int *changed, int winner) {
+      if (!localityValid) return;
+      for (int j = 0; j < 2; j++) {
+        if (changed[j] >= 0) {
+          lowerBounds[changed[j]] = FP(0.0);
+          updateCentroidMagSqr(changed[j]);
+        }
+      }
+      lastWinner = winner;
+    }
+    
+    // Moves a slot to the front of the recent winners
+    
+    void noteWinner(int slot) {
+      if (maxRecentWinners <= 0) return;
+      auto it = std::find(recentWinners.begin(), recentWinners.end(), slot);
+      if (it != recentWinners.end()) {
+        recentWinners.erase(it);
+      } else if ((int)recentWinners.size() >= maxRecentWinners) {
+        recentWinners.pop_back();
+      }
+      recentWinners.insert(recentWinners.begin(), slot);
+    }
+    
+    // Adds a point to the cheapest cluster found by the caller, or merges the
+    // two closest clusters and resets one of them to the point when that is
+    // cheaper. This is shared by add() and addBatch() so that both make the
+    // same decisions.
+    //
+    // additionCPtr : the cluster with the least increase in variance
+    // additionT : the increase in variance for additionCPtr
+    // additionI : the slot of additionCPtr
+    // changed : when not nullptr, set to the slots of the one or two
+    // clusters that were modified, -1 for an unused entry
+    
+    template<typename P>
+    void place(const FP m, P &pt, K *key, GvmCluster<S,V,K,FP> *additionCPtr, FP additionT, int additionI, int *changed) {
+      GvmKeyer<S,V,K,FP>* const keyer = getKeyer();
+      
+      //identify cheapest merge, there is no merge while frozen
+      GvmClusterPair<S,V,K,FP> *mergePairPtr = frozen ? nullptr : pairs.peek();
+      FP mergeT = mergePairPtr == nullptr ? std::numeric_limits<FP>::max() : mergePairPtr->value;
+      
+#if defined(DEBUG)
+      if (pointDebugOutput) {
+        std::string ptStr = pt.toString();
+        fprintf(pointDebugOutput, "merge threshold is %0.16f with %d clusters\n", mergeT, count);
+      }
+#endif // DEBUG
+      
+      if (additionT <= mergeT) {
+#if defined(DEBUG)
+        if (pointDebugOutput) {
+          std::string ptStr = pt.toString();
+          fprintf(pointDebugOutput, "cheapest add is %0.16f for cluster[%d] and point %s\n", additionT, additionI, ptStr.c_str());
+        }
+#endif // DEBUG
+        
+        //choose addition
+        GvmCluster<S,V,K,FP> &additionC = *additionCPtr;
+        additionC.add(m, pt);
+        if (!frozen) {
+          updatePairs(additionC);
+        }
+        if (lshPtr) {
+          lshPtr->update(*this, additionI);
+        }
+        additionC.setKey(keyer->addKey(additionC, key));
+        if (eventLogPtr) {
+          eventLogPtr->add(additionI);
+        }
+        if (changed) {
+          changed[0] = additionI;
+          changed[1] = -1;
+        }
+      } else {
+#if defined(DEBUG)
+        if (pointDebugOutput) {
+          std::string ptStr = pt.toString();
+          fprintf(pointDebugOutput, "cheapest merge is %0.16f for cluster[%d] and point %s\n", additionT, additionI, ptStr.c_str());
+        }
+#endif // DEBUG
+        
+        //choose merge
+        windowMerges++;
+        GvmCluster<S,V,K,FP> *c1 = mergePairPtr->c1;
+        GvmCluster<S,V,K,FP> *c2 = mergePairPtr->c2;
+        if (c1->m0 < c2->m0) {
+          c1 = c2;
+          c2 = mergePairPtr->c1;
+#if defined(DEBUG)
+          if (pointDebugOutput) {
+            std::string ptStr = pt.toString();
+            fprintf(pointDebugOutput, "merge c2 <- c1 : N keys %d <- %d\n", (int)c1->keyVec.size(), (int)c2->keyVec.size());
+          }
+#endif // DEBUG
+        } else {
+#if defined(DEBUG)
+          if (pointDebugOutput) {
+            std::string ptStr = pt.toString();
+            fprintf(pointDebugOutput, "merge c1 <- c2: N keys %d <- %d\n", (int)c2->keyVec.size(), (int)c1->keyVec.size());
+          }
+#endif // DEBUG
+        }
+        c1->setKey(keyer->mergeKeys(*c1, *c2));
+        c1->add(*c2);
+        updatePairs(*c1);
+        c2->set(m, pt);
+        updatePairs(*c2);
+        if (lshPtr) {
+          lshPtr->update(*this, c1);
+          lshPtr->update(*this, c2);
+        }
+        //TODO should this pass through a method on keyer?
+        c2->setKey(nullptr);
+        c2->setKey(keyer->addKey(*c2, key));
+        if (changed || eventLogPtr) {
+          const int s1 = slotOf(c1);
+          const int s2 = slotOf(c2);
+          if (eventLogPtr) {
+            eventLogPtr->merge(s1, s2);
+            eventLogPtr->add(s2);
+          }
+          if (changed) {
+            changed[0] = s1;
+            changed[1] = s2;
+          }
+        }
+      }
+    }
+    
+    // A cluster object with the shared_ptr control block that
+    // make_shared allocates along with it
+    
+    static size_t clusterObjectBytes() {
+      return sizeof(GvmCluster<S,V,K,FP>) + 2 * sizeof(void*);
+    }
+    
+    void startMonitor(int inCheckInterval) {
+      assert(inCheckInterval > 0);
+      
+      // The progress callback and a pending cancel are kept so that a
+      // callback and a deadline can be set in either order
+      
+      monitored = true;
+      budgetExpired = false;
+      budgetLevel = 0;
+      sampleStride = 1;
+      checkInterval = inCheckInterval;
+      checkCountdown = inCheckInterval;
+      budgetStart = std::chrono::steady_clock::now();
+      lastCheck = budgetStart;
+      budgetSeen = 0;
+      seenAtCheck = 0;
+      sampleCounter = 0;
+      budgetSkipped = 0;
+    }
+    
+    // Invoked by add() every checkInterval points while monitored
+    
+    void checkBudget() {
+      checkCountdown = checkInterval;
+      
+      const auto now = std::chrono::steady_clock::now();
+      const double elapsed = std::chrono::duration<double>(now - budgetStart).count();
+      
+      if (cancelRequested.load(std::memory_order_relaxed)) {
+        budgetExpired = true;
+      }
+      if (!budgetExpired && progressCallback && !progressCallback(budgetSeen, elapsed)) {
+        budgetExpired = true;
+      }
+      if (hasDeadline && now >= budgetDeadline) {
+        budgetExpired = true;
+      }
+      
+      if (!budgetExpired && hasDeadline) {
+        const double budget = std::chrono::duration<double>(budgetDeadline - budgetStart).count();
+        bool atRisk;
+        if (expectedPoints > 0) {
+          // Time for the rest of the points at the rate since the last check
+          const double interval = std::chrono::duration<double>(now - lastCheck).count();
+          const double remaining = (double)(expectedPoints - budgetSeen) * interval / (double)(budgetSeen - seenAtCheck);
+          atRisk = (elapsed + remaining) > budget;
+        } else {
+          atRisk = elapsed > budget * (1.0 - ldexp(1.0, -(budgetLevel + 1)));
+        }
+        if (atRisk) {
+          budgetLevel++;
+          if (budgetLevel == 1) {
+            freeze();
+          } else if (sampleStride < (1 << 20)) {
+            sampleStride *= 2;
+          }
+        }
+      }
+      
+      lastCheck = now;
+      seenAtCheck = budgetSeen;
+    }
+    
+    // Freezes once a trigger condition is met, invoked after each addition.
+    
+    void checkFreeze() {
+      if (frozen || count < capacity) return;
+      if (freezeAfter >= 0 && additions >= freezeAfter) {
+        freeze();
+        return;
+      }
+      if (freezeWindow > 0) {
+        windowAdditions++;
+        if (windowAdditions >= freezeWindow) {
+          if (windowMerges <= (freezeMergeRate * freezeWindow)) {
+            freeze();
+          }
+          windowAdditions = 0;
+          windowMerges = 0;
+        }
+      }
+    }
+    
+    // Slot of a cluster in the clusters vector, -1 if not found
+    
+    int slotOf(GvmCluster<S,V,K,FP> *clusterPtr) {
+      for (int i = 0; i < bound; i++) {
+        if (clusters[i].get() == clusterPtr) {
+          return i;
+        }
+      }
+      return -1;
     }
     
     // Collapses the number of clusters subject to constraints on the maximum
     // permitted variance, and the least number of clusters. This method may be
     // called at any time, including between calls to add().
     //
+    // A merged cluster is only marked as removed, its pairs stay in the heap
+    // and are discarded when they reach the top. Whenever half the clusters
+    // have been removed, and once merging stops, the surviving clusters and
+    // their pairs are compacted to the front of the arrays and the heap is
+    // rebuilt from the surviving pairs. Later merges then only visit the
+    // survivors, and the compactions cost O(bound^2) in total.
+    //
     // maxVar : an upper bound on the global variance that may not be exceeded
     // by merging clusters
     // minClusters : a lower bound on the the number of clusters that may not be
@@ -306,16 +1391,28 @@ namespace Gvm {
       assert(minClusters >= 0);
       if (count <= minClusters) return; //nothing to do
       
+      buildPairs();
+      thaw();
+      recentWinners.clear();
+      localityValid = false;
+      
+      // Totals are only needed to enforce maxVar, the merge loop then
+      // updates the total variance with the increase of each merge.
+      
       FP totalVar = FP(0.0);
       FP totalMass = FP(0.0);
-      for (int i = 0; i < count; i++) {
-        auto &clusterSharedPtr = clusters[i];
-        GvmCluster<S,V,K,FP> &cluster = *(clusterSharedPtr.get());
-        totalVar += cluster.var;
-        totalMass += cluster.m0;
+      if (maxVar >= FP(0.0)) {
+        for (int i = 0; i < count; i++) {
+          GvmCluster<S,V,K,FP> &cluster = *(clusters[i].get());
+          totalVar += cluster.var;
+          totalMass += cluster.m0;
+        }
       }
       
       GvmKeyer<S,V,K,FP>* const keyer = getKeyer();
+      if (lshPtr) {
+        lshPtr->invalidate();
+      }
       while (count > minClusters) {
         if (count == 1) {
           //remove the last cluster
@@ -324,12 +1421,19 @@ namespace Gvm {
             GvmCluster<S,V,K,FP> &c = *(clusterSharedPtr.get());
             if (!c.removed) {
               c.removed = true;
+              if (eventLogPtr) {
+                eventLogPtr->restart(i);
+              }
               break;
             }
           }
         } else {
+          //discard pairs of removed clusters at the top of the heap
           GvmClusterPair<S,V,K,FP> *mergePair = pairs.peek();
-          assert(mergePair);
+          while (mergePair->c1->removed || mergePair->c2->removed) {
+            pairs.removeAt(0);
+            mergePair = pairs.peek();
+          }
           GvmCluster<S,V,K,FP> *c1 = mergePair->c1;
           GvmCluster<S,V,K,FP> *c2 = mergePair->c2;
           
@@ -344,26 +1448,47 @@ namespace Gvm {
           }
           c1->setKey(keyer->mergeKeys(*c1, *c2));
           c1->add(*c2);
-          updatePairs(*c1);
-          removePairs(*c2);
+          if (eventLogPtr) {
+            eventLogPtr->merge(slotOf(c1), slotOf(c2));
+          }
           c2->removed = true;
+          updatePairs(*c1);
         }
         count--;
+        
+        //once half the clusters are gone, compact so that the remaining
+        //merges only visit the survivors and the heap drops dead pairs
+        if (count > minClusters && (count * 2) <= bound) {
+          compact();
+        }
       }
-      //iterate over clusters and remove dead clusters
+      
+      compact();
+    }
+    
+    // Moves the surviving clusters to the front of the clusters vector and
+    // their pairs to the front of the pair storage, then rebuilds the heap.
+    //
+    // Pairs are stored in the order they were created, the pair of clusters i
+    // and j with i < j at offset j*(j-1)/2 + i, and survivors keep their order,
+    // so each surviving pair moves to an offset no greater than its own and the
+    // move can be done in place.
+    
+    void compact() {
+      std::vector<int> oldSlots;
+      oldSlots.reserve(count);
       {
         int j = 0;
-        for (int i = 0; i < bound;) {
-          auto &clusterSharedPtr = clusters[i];
-          GvmCluster<S,V,K,FP> &cluster = *(clusterSharedPtr.get());
-          bool lose = cluster.removed;
-          if (lose) {
-            i++;
-          } else {
+        for (int i = 0; i < bound; i++) {
+          GvmCluster<S,V,K,FP> &cluster = *(clusters[i].get());
+          if (!cluster.removed) {
+            oldSlots.push_back(i);
             if (i != j) {
-             clusters[j] = clusters[i];
+              clusters[j] = clusters[i];
+              if (eventLogPtr) {
+                eventLogPtr->move(i, j);
+              }
             }
-            i++;
             j++;
           }
         }
@@ -371,30 +1496,110 @@ namespace Gvm {
           clusters[j] = nullptr;
         }
       }
-      //iterate over cluster pairs and remove dead pairs
-      for (int i = 0; i < count; i++) {
-        auto &clusterSharedPtr = clusters[i];
-        auto &cluster = *(clusterSharedPtr.get());
-        auto &pairs = cluster.pairs;
-        int k = 0;
-        for (int j = 0; j < bound-1;) {
-          auto &pair = pairs[j];
-          bool lose = pair->c1->removed || pair->c2->removed;
-          if (lose) {
-            j++;
-          } else {
-            if (j != k) {
-              pairs[k] = pairs[j];
-            }
-            k++;
-            j++;
+      
+#if defined(DEBUG)
+      assert((int)oldSlots.size() == count);
+#endif // DEBUG
+      
+      GvmClusterPair<S,V,K,FP> *pairsArray = pairs.pairsArray;
+      int used = 0;
+      for (int j = 1; j < count; j++) {
+        auto &clusterPairs = clusters[j]->pairs;
+        for (int i = 0; i < j; i++) {
+          GvmClusterPair<S,V,K,FP> *pair = clusterPairs[oldSlots[i]];
+#if defined(DEBUG)
+          assert(pair >= &pairsArray[used]);
+#endif // DEBUG
+          if (pair != &pairsArray[used]) {
+            pairsArray[used] = *pair;
           }
-        }
-        for (; k < bound; k++) {
-          pairs[k] = nullptr;
+          used++;
         }
       }
+      
+      linkPairs();
+      
       bound = count;
+      pairs.rebuild(used);
+    }
+    
+    // Points each cluster at its pairs in the layout used by compact()
+    
+    void linkPairs() {
+      GvmClusterPair<S,V,K,FP> *pairsArray = pairs.pairsArray;
+      const int N = count;
+      auto &survivors = clusters;
+      parallelFor(N, [N, pairsArray, &survivors](int start, int end) {
+        for (int j = start; j < end; j++) {
+          auto &clusterPairs = survivors[j]->pairs;
+          const int base = j * (j - 1) / 2;
+          for (int i = 0; i < j; i++) {
+            clusterPairs[i] = &pairsArray[base + i];
+          }
+          for (int k = j + 1; k < N; k++) {
+            clusterPairs[k - 1] = &pairsArray[(k * (k - 1) / 2) + j];
+          }
+          for (int p = N - 1; p < (int)clusterPairs.size() && clusterPairs[p] != nullptr; p++) {
+            clusterPairs[p] = nullptr;
+          }
+        }
+      }, 256);
+    }
+    
+    // Releases the memory held for clusters beyond the current count, for
+    // example after reduce() leaves a few clusters out of a large capacity.
+    // The capacity becomes the current count, or 2 if that is greater, and
+    // setCapacity() can grow it again for further adds.
+    
+    void shrinkToFit() {
+      setCapacity(std::max(count, 2));
+    }
+    
+    // Changes the capacity. The pairs in use are moved to pair storage
+    // sized for the new capacity and the old storage is returned to the
+    // OS, the vectors sized by the capacity are reallocated as well.
+    //
+    // newCapacity : at least 2 and not less than the current count
+    
+    void setCapacity(int newCapacity) {
+      assert(newCapacity >= 2 && newCapacity >= count && newCapacity <= getMaxCapacity());
+      if (newCapacity == capacity) return; //nothing to do
+      
+      if (bound != count) {
+        compact();
+      }
+      
+      pairs.reallocate(newCapacity * (newCapacity - 1) / 2);
+      
+      for (int i = 0; i < count; i++) {
+        std::vector<GvmClusterPair<S,V,K,FP>* >(newCapacity, nullptr).swap(clusters[i]->pairs);
+      }
+      
+      clusters.resize(newCapacity);
+      clusters.shrink_to_fit();
+      capacity = newCapacity;
+      
+      linkPairs();
+      
+      // Slot indexed state is rebuilt on demand
+      
+      localityValid = false;
+      std::vector<FP>().swap(lowerBounds);
+      std::vector<FP>().swap(centroidMagSqr);
+      std::vector<FP>().swap(batchCosts);
+      std::vector<char>().swap(batchDirty);
+      recentWinners.clear();
+      if (!approxVisited.empty()) {
+        approxVisited.assign(capacity, 0);
+        approxVisited.shrink_to_fit();
+      }
+      if (lshPtr) {
+        lshPtr->resize(capacity);
+      }
+      
+      if (count == capacity) {
+        buildPairs();
+      }
     }
     
     // Obtains the clusters for the points added. This method may be called
@@ -423,13 +1628,80 @@ namespace Gvm {
       int c = count - 1; //index at which new pairs registered for existing clusters
       for (int i = 0; i < count; i++) {
         GvmCluster<S,V,K,FP> &ci = *(clusters[i].get());
-        auto pair = pairs.newSharedPair(ci, cj);
+        auto pair = pairs.newSharedPair(ci, cj, !pairsDeferred);
         ci.pairs[c] = pair;
         cj.pairs[i] = pair;
-        pairs.add(pair);
+        if (!pairsDeferred) {
+          pairs.add(pair);
+        }
       }
     }
 
+    // Computes the values of the deferred pairs and adds them to the heap
+    // in one pass. This is a nop once the pairs have been built.
+    
+    void buildPairs() {
+      if (!pairsDeferred) return;
+      pairsDeferred = false;
+      
+      const int first = pairs.getSize();
+      const int last = pairs.pairsUsed;
+      const int N = last - first;
+      
+      fillCachedValues();
+      
+      GvmClusterPair<S,V,K,FP> *pairsArray = pairs.pairsArray + first;
+      parallelFor(N, [pairsArray](int start, int end) {
+        for (int i = start; i < end; i++) {
+          pairsArray[i].update();
+        }
+      });
+      
+      pairs.addRange(first, last);
+    }
+    
+    // Evaluate the variance of each cluster once so that any lazily cached
+    // values in the vectors are filled before pairs are valued in parallel.
+    
+    void fillCachedValues() {
+      for (int i = 0; i < count; i++) {
+        GvmCluster<S,V,K,FP> &cluster = *(clusters[i].get());
+        if (cluster.m0 != FP(0.0)) {
+          space.variance(cluster.m0, cluster.m1, cluster.m2);
+        }
+      }
+    }
+    
+    // Invokes func(start, end) over slices of the range 0 to N with
+    // numThreads threads. Ranges of fewer than minN items are not worth
+    // starting threads for.
+    
+    template<typename F>
+    void parallelFor(int N, F func, int minN = 4096) {
+      int T = numThreads;
+      if (T == 0) {
+        T = (int) std::thread::hardware_concurrency();
+      }
+      if (N < minN || T < 1) {
+        T = 1;
+      }
+      if (T == 1) {
+        func(0, N);
+        return;
+      }
+      std::vector<std::thread> threads;
+      int step = (N + T - 1) / T;
+      for (int t = 0; t < T; t++) {
+        int start = t * step;
+        int end = (start + step) > N ? N : (start + step);
+        if (start >= end) break;
+        threads.push_back(std::thread(func, start, end));
+      }
+      for ( auto &thread : threads ) {
+        thread.join();
+      }
+    }
+    
     //does not assume pairs are contiguous
     void updatePairs(GvmCluster<S,V,K,FP> & cluster) {
       auto &pairs = cluster.pairs;
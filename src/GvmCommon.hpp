@@ -29,5 +29,15 @@ namespace Gvm {
   
   template<typename S, typename V, typename K, typename FP> class GvmResult;
   
+  template<typename S, typename V, typename K, typename FP> class GvmDedup;
+  template<typename S, typename V, typename K, typename FP> class GvmRunLength;
+  template<typename S, typename V, typename K, typename FP> class GvmCoreset;
+  template<typename S, typename V, typename K, typename FP> class GvmLshIndex;
+  template<typename S, typename V, typename FP> class GvmProjection;
+  template<typename S, typename V, typename FP> class GvmProjectionKeyer;
+  
   template<typename V, typename FP, int D> class GvmVectorSpace;
+  template<typename V, typename FP, int D> class GvmIntVectorSpace;
+  template<typename V, typename FP> class GvmDynVectorSpace;
+  template<typename V, typename FP> class GvmSparseVectorSpace;
 }
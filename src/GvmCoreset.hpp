@@ -0,0 +1,456 @@
+//
+//  GvmCoreset.hpp
+//  GvmCpp
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+// http://www.apache.org/licenses/LICENSE-2.0
+//
+
+// Builds a weighted coreset that shrinks a very large input before clustering.
+// Points are snapped to a uniform grid over their bounding box and each occupied
+// cell is replaced by a single representative at the cell centroid with the
+// total mass of the cell. The grid resolution is searched so that the number of
+// occupied cells comes as close as possible to a target size without going over.
+// Binning is done in parallel, the cell codes over slices of the input and
+// the count and numbering of the occupied cells over parts of the codes.
+//
+// Since GVM never splits a representative, the total variance of any clustering
+// of the representatives differs from the same clustering of the original points
+// by exactly the variance that was discarded inside the cells. This lost variance
+// is measured and reported so that a coreset size can be chosen per deployment.
+
+#import "GvmCommon.hpp"
+
+#import <unordered_map>
+#import <thread>
+#import <algorithm>
+
+#import <math.h>
+
+namespace Gvm {
+  // S
+  //
+  // Cluster vector space.
+
+  // V
+  //
+  // Cluster vector type.
+
+  // K
+  //
+  // Type of key.
+
+  // FP
+  //
+  // Floating point type.
+
+  template<typename S, typename V, typename K, typename FP>
+  class GvmCoreset {
+  public:
+
+    // Defines the points that will be reduced
+
+    S space;
+
+    // The max number of representatives to generate
+
+    int targetSize;
+
+    // Number of threads used to bin points, 0 means use all cores.
+
+    int numThreads;
+
+    // The number of grid cells along each axis chosen by build().
+
+    int resolution;
+
+    // Representatives, one per occupied cell.
+
+    std::vector<V> points;
+    std::vector<FP> masses;
+    std::vector<int> counts;
+
+    // Offset of the representative for each input point, this can be
+    // used to map cluster results back onto the original points.
+
+    std::vector<int> assignment;
+
+    // Total variance of the input points (mass weighted, not normalized).
+
+    FP totalVar;
+
+    // Variance discarded by replacing the points in each cell with the
+    // cell centroid. Any clustering of the coreset has a total variance
+    // on the original points that is exactly this much larger.
+
+    FP lostVar;
+
+    // constructor
+
+    GvmCoreset<S,V,K,FP>(S inSpace, int inTargetSize, int inNumThreads = 0)
+    : space(inSpace), targetSize(inTargetSize), numThreads(inNumThreads), resolution(0), totalVar(0.0), lostVar(0.0)
+    {
+      assert(targetSize > 0);
+
+      if (numThreads <= 0) {
+        numThreads = (int) std::thread::hardware_concurrency();
+        if (numThreads <= 0) {
+          numThreads = 1;
+        }
+      }
+    }
+
+    // The number of representatives.
+
+    int getSize() {
+      return (int) points.size();
+    }
+
+    // Relative deviation in total variance caused by the reduction, this
+    // is lostVar / totalVar and it is zero when no information was lost.
+
+    FP getDeviation() {
+      return totalVar == FP(0.0) ? FP(0.0) : lostVar / totalVar;
+    }
+
+    // Reduces the input points to at most targetSize representatives.
+    //
+    // inPoints : the points to reduce
+    // inMasses : mass of each point, when nullptr each point has mass 1
+
+    void build(std::vector<V> &inPoints, const std::vector<FP> *inMasses = nullptr) {
+      const int N = (int) inPoints.size();
+      const int D = space.getDimensions();
+
+#if defined(DEBUG)
+      assert(inMasses == nullptr || (int)inMasses->size() == N);
+#endif // DEBUG
+
+      points.clear();
+      masses.clear();
+      counts.clear();
+      assignment.clear();
+      totalVar = FP(0.0);
+      lostVar = FP(0.0);
+      resolution = 0;
+
+      if (N == 0) {
+        return;
+      }
+
+      // Bounding box of the input
+
+      V minPt = space.newCopy(inPoints[0]);
+      V maxPt = space.newCopy(inPoints[0]);
+
+      for (int i = 1; i < N; i++) {
+        V &pt = inPoints[i];
+        for (int d = 0; d < D; d++) {
+          if (pt[d] < minPt[d]) minPt[d] = pt[d];
+          if (pt[d] > maxPt[d]) maxPt[d] = pt[d];
+        }
+      }
+
+      // Cell coordinates are packed into a 64 bit code, so the resolution
+      // along each axis is limited by the number of bits per dimension.
+      // With more than 32 dimensions the coordinates are hashed instead,
+      // see binCodes(), and the resolution is not limited.
+
+      const int bitsPerDim = 64 / D;
+      const uint64_t maxResolution = (bitsPerDim >= 31 || isHashed()) ? (uint64_t)0x7FFFFFFF : (((uint64_t)1 << bitsPerDim) - 1);
+
+      // r^D <= targetSize cells can never exceed the target, search upward
+      // from there for the finest grid that still fits.
+
+      int lo = (int) floor(pow((double)targetSize, 1.0 / D));
+      if (lo < 1) lo = 1;
+      if ((uint64_t)lo > maxResolution) lo = (int) maxResolution;
+
+      std::vector<uint64_t> codes(N);
+
+      int numCells = binCodes(inPoints, minPt, maxPt, lo, codes);
+
+      if (numCells < targetSize && numCells < N) {
+        int hi = lo;
+        int hiCells = numCells;
+        while (hiCells <= targetSize && (uint64_t)hi < maxResolution && hiCells < N) {
+          lo = hi;
+          numCells = hiCells;
+          hi = ((uint64_t)hi * 2 > maxResolution) ? (int) maxResolution : hi * 2;
+          hiCells = binCodes(inPoints, minPt, maxPt, hi, codes);
+        }
+        if (hiCells <= targetSize) {
+          lo = hi;
+        } else {
+          while ((hi - lo) > 1) {
+            int mid = lo + (hi - lo) / 2;
+            if (binCodes(inPoints, minPt, maxPt, mid, codes) <= targetSize) {
+              lo = mid;
+            } else {
+              hi = mid;
+            }
+          }
+        }
+      }
+
+      resolution = lo;
+      binCodes(inPoints, minPt, maxPt, resolution, codes);
+
+      accumulate(inPoints, inMasses, codes);
+    }
+
+    // Adds each representative to clusters with a nullptr key.
+
+    void addTo(GvmClusters<S,V,K,FP> &clusters) {
+      for (int i = 0; i < (int)points.size(); i++) {
+        clusters.add(masses[i], points[i], nullptr);
+      }
+    }
+
+    // Adds each representative to clusters, keyForCell(offset, key) is
+    // invoked to fill a tmp key for the representative at offset.
+
+    template<typename F>
+    void addTo(GvmClusters<S,V,K,FP> &clusters, F keyForCell) {
+      for (int i = 0; i < (int)points.size(); i++) {
+        K key;
+        keyForCell(i, key);
+        clusters.add(masses[i], points[i], &key);
+      }
+    }
+
+    // private utility methods
+
+    // Run func(thread, start, end) over slices of N in parallel.
+
+    template<typename F>
+    void parallelFor(int N, F func) {
+      int T = numThreads;
+      if (T > N) {
+        T = N;
+      }
+      if (T <= 1) {
+        func(0, 0, N);
+        return;
+      }
+      std::vector<std::thread> threads;
+      int step = (N + T - 1) / T;
+      for (int t = 0; t < T; t++) {
+        int start = t * step;
+        int end = (start + step) > N ? N : (start + step);
+        threads.push_back(std::thread(func, t, start, end));
+      }
+      for ( auto &thread : threads ) {
+        thread.join();
+      }
+    }
+
+    // True when 64 bits can not hold 2 bits for each cell coordinate,
+    // the coordinates are then hashed into the cell code.
+
+    bool isHashed() {
+      return space.getDimensions() > 32;
+    }
+
+    // Write the cell code of each point for a given resolution and
+    // return the number of occupied cells. A hashed code can put two
+    // cells together, with 64 bits that is unlikely enough to ignore.
+
+    int binCodes(std::vector<V> &inPoints, V &minPt, V &maxPt, int r, std::vector<uint64_t> &codes) {
+      const int N = (int) inPoints.size();
+      const int D = space.getDimensions();
+      const int bitsPerDim = 64 / D;
+      const bool hashed = isHashed();
+
+      std::vector<FP> scale(D);
+      for (int d = 0; d < D; d++) {
+        FP extent = maxPt[d] - minPt[d];
+        scale[d] = extent > FP(0.0) ? FP(r) / extent : FP(0.0);
+      }
+
+      parallelFor(N, [&](int, int start, int end) {
+        for (int i = start; i < end; i++) {
+          V &pt = inPoints[i];
+          uint64_t code = hashed ? 0x9E3779B97F4A7C15ULL : 0;
+          for (int d = 0; d < D; d++) {
+            int64_t c = (int64_t) ((pt[d] - minPt[d]) * scale[d]);
+            if (c >= r) c = r - 1;
+            if (c < 0) c = 0;
+            if (hashed) {
+              code ^= (uint64_t)c;
+              code *= 0xBF58476D1CE4E5B9ULL;
+              code ^= code >> 31;
+            } else {
+              code = (bitsPerDim >= 64) ? (uint64_t)c : ((code << bitsPerDim) | (uint64_t)c);
+            }
+          }
+          codes[i] = code;
+        }
+      });
+
+      return numberCells(codes, nullptr);
+    }
+
+    // Part of the codes that a thread numbers in numberCells()
+
+    static int partOf(uint64_t code, int T) {
+      return (int) (((code * 0x9E3779B97F4A7C15ULL) >> 32) % (uint64_t)T);
+    }
+
+    // Number the distinct codes in the order they first appear and return
+    // the count, the cell of each point is written to cellOf when it is not
+    // nullptr. The codes are split by hash into one part per thread, each
+    // thread numbers its own part with its own map and the parts are then
+    // merged by first appearance, so the numbering does not depend on the
+    // number of threads.
+
+    int numberCells(std::vector<uint64_t> &codes, std::vector<int> *cellOf) {
+      const int N = (int) codes.size();
+      int T = numThreads > N ? N : numThreads;
+      if (T < 1) T = 1;
+
+      // Points of each part found by each slice, in input order
+
+      std::vector<std::vector<int> > found((size_t)T * T);
+      parallelFor(N, [&](int slice, int start, int end) {
+        std::vector<int> *slicePoints = &found[(size_t)slice * T];
+        for (int i = start; i < end; i++) {
+          slicePoints[partOf(codes[i], T)].push_back(i);
+        }
+      });
+
+      std::vector<int> sizes(T, 0);
+      std::vector<std::vector<int> > firsts(T);
+      parallelFor(T, [&](int, int start, int end) {
+        for (int part = start; part < end; part++) {
+          std::unordered_map<uint64_t, int> cells;
+          cells.reserve((targetSize * 2) / T + 1);
+          for (int slice = 0; slice < T; slice++) {
+            for (int i : found[(size_t)slice * T + part]) {
+              auto it = cells.emplace(codes[i], (int)cells.size());
+              if (cellOf != nullptr) {
+                if (it.second) {
+                  firsts[part].push_back(i);
+                }
+                (*cellOf)[i] = it.first->second;
+              }
+            }
+          }
+          sizes[part] = (int) cells.size();
+        }
+      });
+
+      int numCells = 0;
+      for (int part = 0; part < T; part++) {
+        numCells += sizes[part];
+      }
+      if (cellOf == nullptr) {
+        return numCells;
+      }
+
+      // Renumber each part's cells by the first point in the cell
+
+      std::vector<int> order;
+      order.reserve(numCells);
+      for (int part = 0; part < T; part++) {
+        order.insert(order.end(), firsts[part].begin(), firsts[part].end());
+      }
+      std::sort(order.begin(), order.end());
+
+      std::vector<std::vector<int> > ids(T);
+      for (int part = 0; part < T; part++) {
+        ids[part].resize(sizes[part]);
+      }
+      for (int c = 0; c < numCells; c++) {
+        const int i = order[c];
+        ids[partOf(codes[i], T)][(*cellOf)[i]] = c;
+      }
+
+      parallelFor(N, [&](int, int start, int end) {
+        for (int i = start; i < end; i++) {
+          (*cellOf)[i] = ids[partOf(codes[i], T)][(*cellOf)[i]];
+        }
+      });
+
+      return numCells;
+    }
+
+    // Sum the moments of each cell in parallel, then merge the per thread
+    // partial sums in a fixed order so that results are repeatable.
+
+    void accumulate(std::vector<V> &inPoints, const std::vector<FP> *inMasses, std::vector<uint64_t> &codes) {
+      const int N = (int) inPoints.size();
+
+      assignment.resize(N);
+      const int numCells = numberCells(codes, &assignment);
+
+      int T = numThreads > N ? N : numThreads;
+      if (T < 1) T = 1;
+
+      std::vector<std::vector<FP> > m0s(T, std::vector<FP>(numCells, FP(0.0)));
+      std::vector<std::vector<V> > m1s(T, std::vector<V>(numCells, space.newOrigin()));
+      std::vector<std::vector<V> > m2s(T, std::vector<V>(numCells, space.newOrigin()));
+      std::vector<std::vector<int> > ns(T, std::vector<int>(numCells, 0));
+
+      parallelFor(N, [&](int t, int start, int end) {
+        std::vector<FP> &m0 = m0s[t];
+        std::vector<V> &m1 = m1s[t];
+        std::vector<V> &m2 = m2s[t];
+        std::vector<int> &n = ns[t];
+        for (int i = start; i < end; i++) {
+          const int c = assignment[i];
+          const FP m = inMasses == nullptr ? FP(1.0) : (*inMasses)[i];
+          m0[c] += m;
+          space.addScaled(m1[c], m, inPoints[i]);
+          space.addScaledSqr(m2[c], m, inPoints[i]);
+          n[c] += 1;
+        }
+      });
+
+      for (int t = 1; t < T; t++) {
+        for (int c = 0; c < numCells; c++) {
+          m0s[0][c] += m0s[t][c];
+          space.add(m1s[0][c], m1s[t][c]);
+          space.add(m2s[0][c], m2s[t][c]);
+          ns[0][c] += ns[t][c];
+        }
+      }
+
+      std::vector<FP> &m0 = m0s[0];
+      std::vector<V> &m1 = m1s[0];
+      std::vector<V> &m2 = m2s[0];
+
+      FP sumM0 = FP(0.0);
+      V sumM1 = space.newOrigin();
+      V sumM2 = space.newOrigin();
+
+      points.reserve(numCells);
+      masses.reserve(numCells);
+      counts.reserve(numCells);
+
+      for (int c = 0; c < numCells; c++) {
+        if (m0[c] != FP(0.0)) {
+          lostVar += GvmClusters<S,V,K,FP>::correct(space.variance(m0[c], m1[c], m2[c]));
+        }
+        sumM0 += m0[c];
+        space.add(sumM1, m1[c]);
+        space.add(sumM2, m2[c]);
+
+        V centroid = space.newCopy(m1[c]);
+        if (m0[c] != FP(0.0)) {
+          space.scale(centroid, FP(1.0) / m0[c]);
+        }
+        points.push_back(centroid);
+        masses.push_back(m0[c]);
+        counts.push_back(ns[0][c]);
+      }
+
+      totalVar = sumM0 == FP(0.0) ? FP(0.0) : GvmClusters<S,V,K,FP>::correct(space.variance(sumM0, sumM1, sumM2));
+    }
+
+  }; // end class GvmCoreset
+
+}
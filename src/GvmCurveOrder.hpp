@@ -0,0 +1,302 @@
+//
+//  GvmCurveOrder.hpp
+//  GvmCpp
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+// http://www.apache.org/licenses/LICENSE-2.0
+//
+
+// Ingestion ordering stage that sorts points along a space filling curve
+// before they are passed to GvmClusters::add(). Sorting unique pixels by
+// integer value (R major over 0xRRGGBB) jumps across the whole colour cube
+// each time the low channels wrap, so consecutive points rarely land in the
+// same cluster. Along a Hilbert or Morton curve consecutive points are close
+// in every dimension, so the same few clusters are hit again and again.
+//
+// Each point is quantized to bits per dimension and the quantized values are
+// mapped to a curve key of at most 64 bits. Hilbert keys use the transpose
+// method from Skilling, "Programming the Hilbert curve" (2004), and Morton
+// keys simply interleave the bits. The keys are then sorted with a stable
+// LSD radix sort on 8 bit digits. Each pass counts digits over slices of the
+// keys with numThreads threads and then scatters each slice to its offset, a
+// pass is skipped when every key has the same digit.
+
+#import "GvmCommon.hpp"
+
+#import <thread>
+#import <algorithm>
+
+namespace Gvm {
+
+  // FP
+  //
+  // Floating point type.
+
+  template<typename FP>
+  class GvmCurveOrder {
+  public:
+
+    typedef enum {
+      Morton = 0,
+      Hilbert
+    } Curve;
+
+    Curve curve;
+
+    // Bits per dimension, reduced so that the key fits in 64 bits
+
+    int bits;
+
+    // Number of threads used by the radix sort, 0 uses the
+    // hardware concurrency.
+
+    int numThreads;
+
+    // constructor
+
+    GvmCurveOrder<FP>(Curve inCurve = Hilbert, int inBits = 16)
+    :
+    curve(inCurve),
+    bits(inBits),
+    numThreads(0)
+    {
+      assert(bits >= 1 && bits <= 32);
+    }
+
+    // Bits per dimension used for points of D dimensions
+
+    int bitsFor(int D) {
+      int b = bits;
+      if (D * b > 64) {
+        b = 64 / D;
+      }
+      return b < 1 ? 1 : b;
+    }
+
+    // Curve key of a point already quantized to b bits per dimension,
+    // the values in X are overwritten.
+
+    uint64_t key(uint32_t *X, int D, int b) {
+      if (curve == Hilbert && b > 1) {
+        toTranspose(X, D, b);
+      } else if (curve == Hilbert) {
+        // With one bit the curve is the gray code order of the corners
+
+        for (int i = 1; i < D; i++) {
+          X[i] ^= X[i-1];
+        }
+      }
+
+      uint64_t k = 0;
+      for (int bit = b - 1; bit >= 0; bit--) {
+        for (int i = 0; i < D; i++) {
+          k = (k << 1) | ((X[i] >> bit) & 0x1);
+        }
+      }
+      return k;
+    }
+
+    // Skilling's axes to transpose, converts coordinates to the transposed
+    // form of the Hilbert index in place.
+
+    static
+    void toTranspose(uint32_t *X, int D, int b) {
+      const uint32_t M = 1u << (b - 1);
+
+      // Inverse undo
+
+      for (uint32_t Q = M; Q > 1; Q >>= 1) {
+        const uint32_t P = Q - 1;
+        for (int i = 0; i < D; i++) {
+          if (X[i] & Q) {
+            X[0] ^= P;
+          } else {
+            uint32_t t = (X[0] ^ X[i]) & P;
+            X[0] ^= t;
+            X[i] ^= t;
+          }
+        }
+      }
+
+      // Gray encode
+
+      for (int i = 1; i < D; i++) {
+        X[i] ^= X[i-1];
+      }
+      uint32_t t = 0;
+      for (uint32_t Q = M; Q > 1; Q >>= 1) {
+        if (X[D-1] & Q) {
+          t ^= Q - 1;
+        }
+      }
+      for (int i = 0; i < D; i++) {
+        X[i] ^= t;
+      }
+    }
+
+    // Computes the order of n row major points of D dimensions along the
+    // curve. Each dimension is quantized over the range of its values.
+    //
+    // order : set to the point offsets in curve order
+
+    void order(const FP *points, int n, int D, std::vector<uint32_t> &order) {
+      const int b = bitsFor(D);
+      const uint32_t maxQ = (uint32_t) (((uint64_t)1 << b) - 1);
+      const FP maxValue = FP(maxQ);
+
+      std::vector<FP> minValues(D, FP(0.0));
+      std::vector<FP> scales(D, FP(0.0));
+
+      for (int d = 0; d < D && n > 0; d++) {
+        FP lo = points[d];
+        FP hi = points[d];
+        for (int i = 1; i < n; i++) {
+          FP v = points[((size_t)i * D) + d];
+          lo = std::min(lo, v);
+          hi = std::max(hi, v);
+        }
+        minValues[d] = lo;
+        scales[d] = hi > lo ? (maxValue / (hi - lo)) : FP(0.0);
+      }
+
+      std::vector<uint64_t> keys(n);
+      std::vector<uint32_t> X(D);
+
+      for (int i = 0; i < n; i++) {
+        const FP *pt = points + ((size_t)i * D);
+        for (int d = 0; d < D; d++) {
+          // maxValue can round up past maxQ, so clamp before the conversion
+
+          FP q = ((pt[d] - minValues[d]) * scales[d]) + FP(0.5);
+          X[d] = (q >= maxValue) ? maxQ : ((q > FP(0.0)) ? (uint32_t) q : 0);
+        }
+        keys[i] = key(X.data(), D, b);
+      }
+
+      order.resize(n);
+      for (int i = 0; i < n; i++) {
+        order[i] = i;
+      }
+
+      sort(keys, order, D * b);
+    }
+
+    // Sorts 0xRRGGBB pixels in place along the curve with 8 bits
+    // for each channel, the alpha byte is ignored.
+
+    void sortPixels(std::vector<uint32_t> &pixels) {
+      const int n = (int) pixels.size();
+      std::vector<uint64_t> keys(n);
+      uint32_t X[3];
+
+      for (int i = 0; i < n; i++) {
+        uint32_t pixel = pixels[i];
+        X[0] = pixel & 0xFF;
+        X[1] = (pixel >> 8) & 0xFF;
+        X[2] = (pixel >> 16) & 0xFF;
+        keys[i] = key(X, 3, 8);
+      }
+
+      sort(keys, pixels, 24);
+    }
+
+    // Stable LSD radix sort of keys that carries values along.
+    //
+    // keyBits : number of low bits that can be non-zero in a key
+
+    void sort(std::vector<uint64_t> &keys, std::vector<uint32_t> &values, int keyBits) {
+      const int n = (int) keys.size();
+      assert((int)values.size() == n);
+
+      int T = numThreads;
+      if (T == 0) {
+        T = (int) std::thread::hardware_concurrency();
+      }
+      if (n < 65536 || T < 1) {
+        T = 1;
+      }
+      const int step = (n + T - 1) / T;
+
+      std::vector<uint64_t> tmpKeys(n);
+      std::vector<uint32_t> tmpValues(n);
+
+      // Digit counts for each slice, then the output offset of each
+      // digit in each slice.
+
+      std::vector<int> counts((size_t)T * 256);
+
+      for (int shift = 0; shift < keyBits; shift += 8) {
+        std::fill(counts.begin(), counts.end(), 0);
+
+        parallel(T, step, n, [&](int t, int start, int end) {
+          int *c = &counts[(size_t)t * 256];
+          const uint64_t *k = keys.data();
+          for (int i = start; i < end; i++) {
+            c[(k[i] >> shift) & 0xFF]++;
+          }
+        });
+
+        int offset = 0;
+        bool skip = false;
+        for (int digit = 0; digit < 256; digit++) {
+          int total = 0;
+          for (int t = 0; t < T; t++) {
+            int c = counts[((size_t)t * 256) + digit];
+            counts[((size_t)t * 256) + digit] = offset + total;
+            total += c;
+          }
+          if (total == n) {
+            skip = true;
+            break;
+          }
+          offset += total;
+        }
+        if (skip) {
+          continue;
+        }
+
+        parallel(T, step, n, [&](int t, int start, int end) {
+          int *c = &counts[(size_t)t * 256];
+          const uint64_t *k = keys.data();
+          const uint32_t *v = values.data();
+          uint64_t *dstKeys = tmpKeys.data();
+          uint32_t *dstValues = tmpValues.data();
+          for (int i = start; i < end; i++) {
+            int o = c[(k[i] >> shift) & 0xFF]++;
+            dstKeys[o] = k[i];
+            dstValues[o] = v[i];
+          }
+        });
+
+        keys.swap(tmpKeys);
+        values.swap(tmpValues);
+      }
+    }
+
+  protected:
+
+    // Invokes func(t, start, end) for each of T slices of step values
+
+    template<typename F>
+    void parallel(int T, int step, int n, F func) {
+      if (T == 1) {
+        func(0, 0, n);
+        return;
+      }
+      std::vector<std::thread> threads;
+      for (int t = 0; t < T; t++) {
+        int start = t * step;
+        int end = (start + step) > n ? n : (start + step);
+        threads.push_back(std::thread(func, t, start, end));
+      }
+      for ( auto &thread : threads ) {
+        thread.join();
+      }
+    }
+
+  }; // end class GvmCurveOrder
+
+}
@@ -0,0 +1,284 @@
+//
+//  GvmDedup.hpp
+//  GvmCpp
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+// http://www.apache.org/licenses/LICENSE-2.0
+//
+
+// Optional dedup stage that sits in front of a GvmClusters instance. Points
+// with exactly the same coordinates are accumulated in an open addressing
+// hash table, the mass of each repeated point is summed and the keys are
+// combined. When the table reaches its memory cap, which includes the heap
+// memory of keys that grow as they are combined, or when flush() is
+// invoked, each unique point is passed to GvmClusters::add() once with the
+// accumulated mass. A point that repeats N times then costs N hash probes
+// and a single add() instead of N full cluster scans.
+//
+// The cap is checked before a point is stored, so a single key larger than
+// the cap is still held after the flush that made room for it and the table
+// stays over the cap until the next flush.
+//
+// Note that the cluster count reported by GvmCluster and GvmResult is
+// the number of unique points added, not the number of input points.
+
+#import "GvmCommon.hpp"
+
+#import "GvmMemoryReport.hpp"
+
+#import <string.h>
+
+namespace Gvm {
+  // S
+  //
+  // Cluster vector space.
+
+  // V
+  //
+  // Cluster vector type.
+
+  // K
+  //
+  // Type of key.
+
+  // FP
+  //
+  // Floating point type.
+
+  template<typename S, typename V, typename K, typename FP>
+  class GvmDedup {
+  public:
+
+    // The clusters that unique points are flushed into.
+
+    GvmClusters<S,V,K,FP> &clusters;
+
+    // Optional key combiner, when nullptr the first non-null
+    // key for a point is retained in the same way that
+    // GvmDefaultKeyer retains the existing key.
+
+    GvmSimpleKeyer<S,V,K,FP> *combinerPtr;
+
+    // Number of dimensions in each point
+
+    int dimensions;
+
+    // The max number of unique points held before a flush.
+
+    int maxEntries;
+
+    // Memory cap and the heap bytes of the pending keys, see gvmHeapBytes()
+
+    size_t maxBytes;
+
+    size_t keyBytes;
+
+    // Open addressing table of entry offsets, -1 indicates an
+    // empty slot. The table size is a power of 2 that is at
+    // least twice maxEntries so that probe runs stay short.
+
+    std::vector<int> table;
+
+    uint32_t tableMask;
+
+    // Unique entries in insertion order, this makes flush()
+    // deterministic and keeps the order of first appearance.
+
+    std::vector<V> points;
+    std::vector<FP> masses;
+    std::vector<K> keys;
+    std::vector<char> keyed;
+    std::vector<uint32_t> slots;
+
+    // The number of points passed to add().
+
+    int additions;
+
+    // The number of times the table was flushed.
+
+    int flushes;
+
+    // constructor
+    //
+    // inClusters : clusters that unique points are added to
+    // maxBytes : memory cap for the table and the pending entries
+    // inCombinerPtr : combines keys of repeated points, can be nullptr
+
+    GvmDedup<S,V,K,FP>(GvmClusters<S,V,K,FP> &inClusters, size_t inMaxBytes, GvmSimpleKeyer<S,V,K,FP> *inCombinerPtr = nullptr)
+    : clusters(inClusters), combinerPtr(inCombinerPtr), maxBytes(inMaxBytes), keyBytes(0), additions(0), flushes(0)
+    {
+      dimensions = clusters.space.getDimensions();
+
+      maxEntries = (int) (maxBytes / bytesPerEntry());
+      assert(maxEntries > 0);
+
+      uint32_t tableSize = 2;
+      while (tableSize < (uint32_t)maxEntries * 2) {
+        tableSize <<= 1;
+      }
+      tableMask = tableSize - 1;
+      table.resize(tableSize, -1);
+
+      points.reserve(maxEntries);
+      masses.reserve(maxEntries);
+      keys.reserve(maxEntries);
+      keyed.reserve(maxEntries);
+      slots.reserve(maxEntries);
+    }
+
+    // Copy constructor explicitly deleted
+
+    GvmDedup<S,V,K,FP>(const GvmDedup<S,V,K,FP> &that) = delete;
+    GvmDedup<S,V,K,FP>& operator=(const GvmDedup<S,V,K,FP>& x) = delete;
+
+    // Memory used for each unique entry, the table holds two slots per entry.
+
+    static size_t bytesPerEntry() {
+      return sizeof(V) + sizeof(FP) + sizeof(K) + sizeof(char) + sizeof(uint32_t) + (2 * sizeof(int));
+    }
+
+    // The number of unique points waiting to be flushed.
+
+    int getSize() {
+      return (int) points.size();
+    }
+
+    // Memory held by the unique points waiting to be flushed,
+    // including the heap memory of their keys.
+
+    size_t getBytes() {
+      return (points.size() * bytesPerEntry()) + keyBytes;
+    }
+
+    // Adds a point. The arguments are the same as GvmClusters::add(),
+    // a copy of the key is made so the caller can pass a tmp value.
+
+    void add(const FP m, V &pt, K *key) {
+      if (m == FP(0.0)) return; //nothing to do
+
+      additions++;
+
+      uint32_t slot = hash(pt) & tableMask;
+
+      for ( ; ; ) {
+        int offset = table[slot];
+
+        if (offset == -1) {
+          break;
+        }
+
+        if (equals(points[offset], pt)) {
+          masses[offset] += m;
+
+          if (key != nullptr) {
+            keyBytes -= gvmHeapBytes(keys[offset]);
+            if (!keyed[offset]) {
+              keys[offset] = K(*key);
+              keyed[offset] = 1;
+            } else if (combinerPtr != nullptr) {
+              K *combined = combinerPtr->combineKeys(&keys[offset], key);
+              if (combined != &keys[offset]) {
+                keys[offset] = K(*combined);
+              }
+            }
+            keyBytes += gvmHeapBytes(keys[offset]);
+
+            // A combined key can grow past the cap
+
+            if (getBytes() > maxBytes) {
+              flush();
+            }
+          }
+
+          return;
+        }
+
+        slot = (slot + 1) & tableMask;
+      }
+
+      // New unique point, flush first when the cap has been reached
+
+      const size_t newKeyBytes = (key != nullptr) ? gvmHeapBytes(*key) : 0;
+
+      if ((int)points.size() == maxEntries || (getBytes() + bytesPerEntry() + newKeyBytes) > maxBytes) {
+        flush();
+        slot = hash(pt) & tableMask;
+        while (table[slot] != -1) {
+          slot = (slot + 1) & tableMask;
+        }
+      }
+
+      table[slot] = (int) points.size();
+      points.push_back(pt);
+      masses.push_back(m);
+      slots.push_back(slot);
+      if (key != nullptr) {
+        keys.push_back(K(*key));
+        keyed.push_back(1);
+      } else {
+        keys.push_back(K());
+        keyed.push_back(0);
+      }
+      keyBytes += gvmHeapBytes(keys.back());
+    }
+
+    // Passes each pending unique point to the clusters as a single
+    // mass weighted add and then empties the table. This method must be
+    // invoked before results are read from the clusters.
+
+    void flush() {
+      int numEntries = (int) points.size();
+
+      for (int i = 0; i < numEntries; i++) {
+        clusters.add(masses[i], points[i], keyed[i] ? &keys[i] : nullptr);
+        table[slots[i]] = -1;
+      }
+
+      points.clear();
+      masses.clear();
+      keys.clear();
+      keyed.clear();
+      slots.clear();
+      keyBytes = 0;
+
+      if (numEntries > 0) {
+        flushes++;
+      }
+    }
+
+    // private utility methods
+
+    // Hash the bits of each coordinate, note that -0.0 and 0.0
+    // compare as equal so both are hashed as 0.0.
+
+    uint32_t hash(V &pt) {
+      uint64_t h = 0x9E3779B97F4A7C15ULL;
+      for (int i = 0; i < dimensions; i++) {
+        FP v = pt[i];
+        if (v == FP(0.0)) {
+          v = FP(0.0);
+        }
+        uint64_t bits = 0;
+        memcpy(&bits, &v, sizeof(FP) < sizeof(bits) ? sizeof(FP) : sizeof(bits));
+        h ^= bits;
+        h *= 0xBF58476D1CE4E5B9ULL;
+        h ^= h >> 31;
+      }
+      return (uint32_t) (h ^ (h >> 32));
+    }
+
+    bool equals(V &pt1, V &pt2) {
+      for (int i = 0; i < dimensions; i++) {
+        if (pt1[i] != pt2[i]) {
+          return false;
+        }
+      }
+      return true;
+    }
+
+  }; // end class GvmDedup
+
+}
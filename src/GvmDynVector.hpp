@@ -0,0 +1,299 @@
+//
+//  GvmDynVector.hpp
+//  GvmCpp
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+// http://www.apache.org/licenses/LICENSE-2.0
+//
+// Vector with a number of dimensions defined at runtime, this is used with
+// GvmDynVectorSpace for high dimensional inputs like 128 to 768 dimensional
+// embeddings where D is only known once a data file has been read.
+//
+// Values live in a row of a GvmDynSlab. A slab hands out rows that are
+// 64 byte aligned and padded with zeros to a multiple of 64 bytes, so no cache
+// line holds values of two rows. Rows are carved from large blocks in address
+// order, a cluster takes its m1 row and then its m2 row, so for clusters
+// created one after another the m1 rows are every other row of a block. A
+// vector also caches the sum and the squared magnitude of its values, these
+// are recomputed lazily after a write.
+//
+// The slab is shared by every copy of a space and rows are handed out under a
+// lock, so GvmClusters instances that run on different threads can share one
+// space. A single vector must still not be used by two threads at once.
+
+#import "GvmCommon.hpp"
+
+#import <memory>
+#import <mutex>
+
+#import <stdlib.h>
+#import <string.h>
+
+namespace Gvm {
+
+  // FP
+  //
+  // Floating point type.
+
+  template<typename FP>
+  class GvmDynSlab {
+  public:
+
+    // Number of dimensions in each row
+
+    int dimensions;
+
+    // Number of FP values in each row including padding
+
+    int stride;
+
+    // Number of rows in each allocated block
+
+    int rowsPerBlock;
+
+    std::vector<FP*> blocks;
+
+    std::vector<FP*> freeRows;
+
+    // Guards blocks and freeRows
+
+    std::mutex rowsMutex;
+
+    // constructor
+
+    GvmDynSlab<FP>(int inDimensions, int inRowsPerBlock = 1024)
+    : dimensions(inDimensions), rowsPerBlock(inRowsPerBlock)
+    {
+      assert(dimensions >= 1);
+      const int align = 64 / sizeof(FP);
+      stride = ((dimensions + align - 1) / align) * align;
+    }
+
+    ~GvmDynSlab<FP>() {
+      for ( FP *block : blocks ) {
+        free(block);
+      }
+    }
+
+    // Copy constructor explicitly deleted
+
+    GvmDynSlab<FP>(const GvmDynSlab<FP> &that) = delete;
+    GvmDynSlab<FP>& operator=(const GvmDynSlab<FP>& x) = delete;
+
+    // Returns a zero filled row
+
+    FP* allocRow() {
+      FP *row;
+      {
+        std::lock_guard<std::mutex> lock(rowsMutex);
+        row = takeRow();
+      }
+      memset(row, 0, stride * sizeof(FP));
+      return row;
+    }
+
+    void freeRow(FP *row) {
+      std::lock_guard<std::mutex> lock(rowsMutex);
+      freeRows.push_back(row);
+    }
+
+  protected:
+
+    // Pops a free row, rowsMutex must be held
+
+    FP* takeRow() {
+      if (freeRows.empty()) {
+        void *ptr = nullptr;
+        size_t numBytes = (size_t)stride * rowsPerBlock * sizeof(FP);
+        int result = posix_memalign(&ptr, 64, numBytes);
+        assert(result == 0 && ptr != nullptr);
+        FP *block = (FP*) ptr;
+        blocks.push_back(block);
+        // Push in reverse so that rows are handed out in address order
+        for (int i = rowsPerBlock - 1; i >= 0; i--) {
+          freeRows.push_back(block + ((size_t)i * stride));
+        }
+      }
+      FP *row = freeRows.back();
+      freeRows.pop_back();
+      return row;
+    }
+
+  }; // end class GvmDynSlab
+
+  template<typename FP>
+  class GvmDynVector {
+  public:
+
+    // The slab that values were allocated from, this is shared
+    // so that a vector can outlive the space that created it.
+
+    std::shared_ptr<GvmDynSlab<FP> > slab;
+
+    // Aligned and zero padded row of values, nullptr for a
+    // default constructed vector.
+
+    FP *values;
+
+    // Cached sum of values and squared magnitude
+
+    mutable FP cachedSum;
+
+    mutable FP cachedMagnitudeSqr;
+
+    mutable bool dirty;
+
+    // constructor
+
+    GvmDynVector<FP>()
+    : values(nullptr), cachedSum(0.0), cachedMagnitudeSqr(0.0), dirty(false)
+    {
+    }
+
+    GvmDynVector<FP>(std::shared_ptr<GvmDynSlab<FP> > inSlab)
+    : slab(inSlab), cachedSum(0.0), cachedMagnitudeSqr(0.0), dirty(false)
+    {
+      values = slab->allocRow();
+    }
+
+    // copy constructor
+
+    GvmDynVector<FP>(const GvmDynVector<FP> &other)
+    : slab(other.slab), values(nullptr), cachedSum(other.cachedSum), cachedMagnitudeSqr(other.cachedMagnitudeSqr), dirty(other.dirty)
+    {
+      if (slab) {
+        values = slab->allocRow();
+        memcpy(values, other.values, slab->stride * sizeof(FP));
+      }
+    }
+
+    GvmDynVector<FP>(GvmDynVector<FP> &&other)
+    : slab(other.slab), values(other.values), cachedSum(other.cachedSum), cachedMagnitudeSqr(other.cachedMagnitudeSqr), dirty(other.dirty)
+    {
+      other.values = nullptr;
+      other.slab.reset();
+    }
+
+    ~GvmDynVector<FP>() {
+      if (values != nullptr) {
+        slab->freeRow(values);
+      }
+    }
+
+    GvmDynVector<FP>& operator=(const GvmDynVector<FP> &other) {
+      if (this == &other) {
+        return *this;
+      }
+      if (slab != other.slab) {
+        if (values != nullptr) {
+          slab->freeRow(values);
+          values = nullptr;
+        }
+        slab = other.slab;
+        if (slab) {
+          values = slab->allocRow();
+        }
+      }
+      if (slab) {
+        memcpy(values, other.values, slab->stride * sizeof(FP));
+      }
+      cachedSum = other.cachedSum;
+      cachedMagnitudeSqr = other.cachedMagnitudeSqr;
+      dirty = other.dirty;
+      return *this;
+    }
+
+    GvmDynVector<FP>& operator=(GvmDynVector<FP> &&other) {
+      if (this == &other) {
+        return *this;
+      }
+      if (values != nullptr) {
+        slab->freeRow(values);
+      }
+      slab = other.slab;
+      values = other.values;
+      cachedSum = other.cachedSum;
+      cachedMagnitudeSqr = other.cachedMagnitudeSqr;
+      dirty = other.dirty;
+      other.values = nullptr;
+      other.slab.reset();
+      return *this;
+    }
+
+    // Number of dimensions
+
+    int getDimensions() {
+      return slab ? slab->dimensions : 0;
+    }
+
+    // Writing through the non-const operator invalidates the cached values
+
+    FP& operator[](std::size_t idx)       {
+      dirty = true;
+      return values[idx];
+    };
+    const FP& operator[](std::size_t idx) const {
+      return values[idx];
+    };
+
+    FP iSquared(std::size_t idx) {
+      FP v = values[idx];
+      FP vSq = v * v;
+      return vSq;
+    }
+
+    // Mark cached values as stale after values were written directly
+
+    void invalidate() {
+      dirty = true;
+    }
+
+    FP sum() const {
+      if (dirty) {
+        refresh();
+      }
+      return cachedSum;
+    }
+
+    FP magnitudeSqr() const {
+      if (dirty) {
+        refresh();
+      }
+      return cachedMagnitudeSqr;
+    }
+
+    void refresh() const {
+      const int N = slab->stride;
+      FP s0 = FP(0.0), s1 = FP(0.0), s2 = FP(0.0), s3 = FP(0.0);
+      FP q0 = FP(0.0), q1 = FP(0.0), q2 = FP(0.0), q3 = FP(0.0);
+      for (int i = 0; i < N; i += 4) {
+        FP v0 = values[i], v1 = values[i+1], v2 = values[i+2], v3 = values[i+3];
+        s0 += v0; s1 += v1; s2 += v2; s3 += v3;
+        q0 += v0 * v0; q1 += v1 * v1; q2 += v2 * v2; q3 += v3 * v3;
+      }
+      cachedSum = (s0 + s1) + (s2 + s3);
+      cachedMagnitudeSqr = (q0 + q1) + (q2 + q3);
+      dirty = false;
+    }
+
+    std::string toString() {
+      std::stringstream sb;
+      const int D = getDimensions();
+
+      for (int i = 0; i < D; i++) {
+        if (i < (D-1)) {
+          sb << values[i] << " ";
+        } else {
+          sb << values[i];
+        }
+      }
+
+      return sb.str();
+    }
+
+  }; // end class GvmDynVector
+
+}
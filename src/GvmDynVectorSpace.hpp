@@ -0,0 +1,243 @@
+//
+//  GvmDynVectorSpace.hpp
+//  GvmCpp
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+// http://www.apache.org/licenses/LICENSE-2.0
+//
+// Vector space with a number of dimensions defined at runtime. Vectors are
+// GvmDynVector rows allocated from one GvmDynSlab that is shared by every
+// copy of the space, so all the cluster m1 and m2 rows of a GvmClusters
+// instance come from the same pooled and aligned storage. The slab is locked,
+// see GvmDynSlab, but the lazily cached values of a vector are not, which is
+// why GvmClusters fills them before valuing pairs on several threads.
+//
+// The variance kernels are rewritten in terms of the cached sum of m2 and the
+// cached squared magnitude of m1 and of the point. Testing a point against a
+// cluster then costs a single dot product between the cluster m1 row and the
+// point, the cached sum stands in for the m2 row, which is never read. The
+// m1 and m2 rows of a cluster are interleaved in the slab, so the cluster
+// scan in GvmClusters::add() is one dot product per cluster over every other
+// row, not a blocked matrix vector product. Kernels loop over the zero padded
+// row length with 4 independent accumulators so that the compiler can
+// vectorize them.
+
+#import "GvmCommon.hpp"
+
+#import "GvmDynVector.hpp"
+
+#import <tgmath.h>
+
+namespace Gvm {
+
+  // V
+  //
+  // Vector type, this must be GvmDynVector<FP>.
+
+  // FP
+  //
+  // Floating point type.
+
+  template<typename V, typename FP>
+  class GvmDynVectorSpace {
+  public:
+
+    // Shared pool of aligned rows
+
+    std::shared_ptr<GvmDynSlab<FP> > slab;
+
+    int getDimensions() {
+      return slab->dimensions;
+    }
+
+    // constructor
+
+    GvmDynVectorSpace(int D, int rowsPerBlock = 1024)
+    : slab(std::make_shared<GvmDynSlab<FP> >(D, rowsPerBlock))
+    {
+      assert(D >= 1);
+    }
+
+    // vectorized kernels over a zero padded row
+
+    static inline
+    FP dot(const FP * __restrict a, const FP * __restrict b, const int N) {
+      FP s0 = FP(0.0), s1 = FP(0.0), s2 = FP(0.0), s3 = FP(0.0);
+      for (int i = 0; i < N; i += 4) {
+        s0 += a[i] * b[i];
+        s1 += a[i+1] * b[i+1];
+        s2 += a[i+2] * b[i+2];
+        s3 += a[i+3] * b[i+3];
+      }
+      return (s0 + s1) + (s2 + s3);
+    }
+
+    // space factory methods
+
+    V newOrigin() {
+      return V(slab);
+    }
+
+    V newCopy(V &pt) {
+      // Invoke copy constructor
+      return V(pt);
+    }
+
+    // space point operations
+
+    FP magnitudeSqr(V &pt) {
+      return pt.magnitudeSqr();
+    }
+
+    FP sum(V &pt) {
+      return pt.sum();
+    }
+
+    void setToOrigin(V &pt) {
+      memset(pt.values, 0, slab->stride * sizeof(FP));
+      pt.invalidate();
+    }
+
+    void setTo(V &dstPt, V &srcPt) {
+      memcpy(dstPt.values, srcPt.values, slab->stride * sizeof(FP));
+      dstPt.invalidate();
+    }
+
+    void setToScaled(V &dstPt, FP m, V &srcPt) {
+      FP * __restrict dst = dstPt.values;
+      const FP * __restrict src = srcPt.values;
+      const int N = slab->stride;
+      for (int i = 0; i < N; i++) {
+        dst[i] = m * src[i];
+      }
+      dstPt.invalidate();
+    }
+
+    void setToScaledSqr(V &dstPt, FP m, V &srcPt) {
+      FP * __restrict dst = dstPt.values;
+      const FP * __restrict src = srcPt.values;
+      const int N = slab->stride;
+      for (int i = 0; i < N; i++) {
+        dst[i] = m * (src[i] * src[i]);
+      }
+      dstPt.invalidate();
+    }
+
+    void add(V &dstPt, V &srcPt) {
+      FP * __restrict dst = dstPt.values;
+      const FP * __restrict src = srcPt.values;
+      const int N = slab->stride;
+      for (int i = 0; i < N; i++) {
+        dst[i] += src[i];
+      }
+      dstPt.invalidate();
+    }
+
+    void addScaled(V &dstPt, FP m, V &srcPt) {
+      FP * __restrict dst = dstPt.values;
+      const FP * __restrict src = srcPt.values;
+      const int N = slab->stride;
+      for (int i = 0; i < N; i++) {
+        dst[i] += m * src[i];
+      }
+      dstPt.invalidate();
+    }
+
+    void addScaledSqr(V &dstPt, FP m, V &srcPt) {
+      FP * __restrict dst = dstPt.values;
+      const FP * __restrict src = srcPt.values;
+      const int N = slab->stride;
+      for (int i = 0; i < N; i++) {
+        dst[i] += m * (src[i] * src[i]);
+      }
+      dstPt.invalidate();
+    }
+
+    void subtract(V &dstPt, V &srcPt) {
+      FP * __restrict dst = dstPt.values;
+      const FP * __restrict src = srcPt.values;
+      const int N = slab->stride;
+      for (int i = 0; i < N; i++) {
+        dst[i] -= src[i];
+      }
+      dstPt.invalidate();
+    }
+
+    void subtractScaled(V &dstPt, FP m, V &srcPt) {
+      FP * __restrict dst = dstPt.values;
+      const FP * __restrict src = srcPt.values;
+      const int N = slab->stride;
+      for (int i = 0; i < N; i++) {
+        dst[i] -= m * src[i];
+      }
+      dstPt.invalidate();
+    }
+
+    void subtractScaledSqr(V &dstPt, FP m, V &srcPt) {
+      FP * __restrict dst = dstPt.values;
+      const FP * __restrict src = srcPt.values;
+      const int N = slab->stride;
+      for (int i = 0; i < N; i++) {
+        dst[i] -= m * (src[i] * src[i]);
+      }
+      dstPt.invalidate();
+    }
+
+    void scale(V &pt, FP m) {
+      FP * __restrict dst = pt.values;
+      const int N = slab->stride;
+      for (int i = 0; i < N; i++) {
+        dst[i] *= m;
+      }
+      pt.invalidate();
+    }
+
+    void square(V &pt) {
+      FP * __restrict dst = pt.values;
+      const int N = slab->stride;
+      for (int i = 0; i < N; i++) {
+        dst[i] *= dst[i];
+      }
+      pt.invalidate();
+    }
+
+    FP distance(V &pt1, V &pt2) {
+      FP sum = pt1.magnitudeSqr() + pt2.magnitudeSqr() - (FP(2.0) * dot(pt1.values, pt2.values, slab->stride));
+      return sqrt(sum > FP(0.0) ? sum : FP(0.0));
+    }
+
+    // Variance kernels, with S2 = sum(m2) and Q = |m1|^2 the
+    // variance of a cluster is S2 - Q / m0.
+
+    FP variance(const FP m, const V &pt, const V &ptSqr) {
+      return ptSqr.sum() - (pt.magnitudeSqr() / m);
+    }
+
+    // Adding a point x with mass m2 gives
+    // S2 + m2 |x|^2 - (Q + 2 m2 (m1 . x) + m2^2 |x|^2) / (m0 + m2)
+    // so the only O(D) work is the dot product m1 . x
+
+    FP variance(const FP m1, const V &pt1, const V &ptSqr1, const FP m2, const V &pt2) {
+      const FP m0 = m1 + m2;
+      const FP xx = pt2.magnitudeSqr();
+      const FP cx = dot(pt1.values, pt2.values, slab->stride);
+      const FP cc = pt1.magnitudeSqr() + (FP(2.0) * m2 * cx) + (m2 * m2 * xx);
+      return ptSqr1.sum() + (m2 * xx) - (cc / m0);
+    }
+
+    FP variance(const FP m1, const V &pt1, const V &ptSqr1, const FP m2, const V &pt2, const V &ptSqr2) {
+      const FP m0 = m1 + m2;
+      const FP cc = pt1.magnitudeSqr() + pt2.magnitudeSqr() + (FP(2.0) * dot(pt1.values, pt2.values, slab->stride));
+      return ptSqr1.sum() + ptSqr2.sum() - (cc / m0);
+    }
+
+    std::string toString(V &pt) {
+      return pt.toString();
+    }
+
+  }; // end class GvmDynVectorSpace
+
+}
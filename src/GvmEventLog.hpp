@@ -0,0 +1,487 @@
+//
+//  GvmEventLog.hpp
+//  GvmCpp
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+// http://www.apache.org/licenses/LICENSE-2.0
+//
+
+// Streaming log of the changes made to the clusters, an alternative to
+// carrying a list of point keys inside every cluster. When a GvmEventLog is
+// installed with GvmClusters::setEventLog() each change to a cluster slot is
+// written as a compact binary event:
+//
+// add(slot, n) : the next n points join the cluster in slot, an empty slot
+// starts a new cluster, n is greater than 1 for a whole cluster
+// merge(a, b) : the cluster in slot b is merged into the cluster in slot a,
+// slot b is then empty
+// restart(slot) : the cluster in slot is discarded, by clear() or when
+// reduce() removes the last cluster
+// move(from, to) : the cluster in slot from moves to the empty slot to
+//
+// Point ids are not stored with the clusters: the points passed to add()
+// and addBatch() are numbered in order from 0, a cluster passed to
+// addCluster() takes one id for each of its points, GvmCluster::count, so
+// its points are numbered as if they had been added one at a time. Points
+// with a zero mass take their ids but are never added to a cluster. The ids
+// are not reset by clear().
+//
+// Each event is a varint holding the slot and the event type, followed by a
+// varint for the second slot of a merge or move. An add is followed by the
+// gap to the id of the previous point shifted left by one, the low bit is set
+// when a varint with the number of points less 2 follows. A typical event
+// takes 2 or 3 bytes. The events are collected in a buffer that is appended
+// to memory or written to a file once full, the keys can then be left as
+// nullptr and the key memory drops to zero.
+//
+// GvmEventReplay reads a log back, offline and in chunks of any size, and
+// rebuilds the memberships of the points, the merge tree and a cut of the
+// tree at any number of clusters.
+
+#import "GvmCommon.hpp"
+
+#import <stdio.h>
+
+namespace Gvm {
+
+  enum GvmEventType {
+    GvmEventAdd = 0,
+    GvmEventMerge = 1,
+    GvmEventRestart = 2,
+    GvmEventMove = 3
+  };
+
+  class GvmEventLog {
+  public:
+
+    // Events written to memory, filled as the buffer is flushed
+
+    std::vector<uint8_t> bytes;
+
+    // constructor, events are written to bytes
+
+    GvmEventLog()
+    : file(nullptr)
+    {
+      init();
+    }
+
+    // constructor, events are written to a file opened by the caller,
+    // the caller closes the file after this object is destroyed
+
+    GvmEventLog(FILE *inFile)
+    : file(inFile)
+    {
+      assert(file);
+      init();
+    }
+
+    ~GvmEventLog() {
+      flush();
+    }
+
+    // Copy constructor explicitly deleted
+
+    GvmEventLog(const GvmEventLog &that) = delete;
+    GvmEventLog& operator=(const GvmEventLog& x) = delete;
+
+    // The next n points join the cluster in slot
+
+    void add(int slot, int64_t n = 1) {
+#if defined(DEBUG)
+      assert(n >= 1);
+#endif // DEBUG
+      head(slot, GvmEventAdd);
+      const uint64_t gap = (uint64_t)(nextId - lastId - 1);
+      if (n == 1) {
+        putVarint(gap << 1);
+      } else {
+        putVarint((gap << 1) | 1);
+        putVarint((uint64_t)(n - 2));
+      }
+      lastId = nextId + n - 1;
+      nextId += n;
+    }
+
+    // The next n points are not clustered, they only take ids
+
+    void skip(int64_t n = 1) {
+      nextId += n;
+    }
+
+    // The cluster in slot b is merged into the cluster in slot a
+
+    void merge(int a, int b) {
+      head(a, GvmEventMerge);
+      putVarint((uint64_t) b);
+    }
+
+    // The cluster in slot is discarded
+
+    void restart(int slot) {
+      head(slot, GvmEventRestart);
+    }
+
+    // The cluster in slot from moves to slot to
+
+    void move(int from, int to) {
+      head(to, GvmEventMove);
+      putVarint((uint64_t) from);
+    }
+
+    // Writes the buffered events to memory or to the file
+
+    void flush() {
+      if (used == 0) {
+        return;
+      }
+      if (file) {
+        size_t written = fwrite(buffer.data(), 1, used, file);
+        assert(written == (size_t) used);
+        (void) written;
+      } else {
+        bytes.insert(bytes.end(), buffer.begin(), buffer.begin() + used);
+      }
+      flushed += used;
+      used = 0;
+    }
+
+    // Number of point ids handed out
+
+    int64_t getPointCount() {
+      return nextId;
+    }
+
+    int64_t getEventCount() {
+      return events;
+    }
+
+    // Number of bytes logged, including the bytes not yet flushed
+
+    int64_t getSize() {
+      return flushed + used;
+    }
+
+  protected:
+
+    FILE *file;
+
+    std::vector<uint8_t> buffer;
+
+    int used;
+
+    int64_t flushed;
+
+    int64_t events;
+
+    // Id of the next point and of the last point added to a cluster
+
+    int64_t nextId;
+
+    int64_t lastId;
+
+    void init() {
+      buffer.resize(1 << 16);
+      used = 0;
+      flushed = 0;
+      events = 0;
+      nextId = 0;
+      lastId = -1;
+    }
+
+    void head(int slot, GvmEventType type) {
+#if defined(DEBUG)
+      assert(slot >= 0);
+#endif // DEBUG
+      putVarint(((uint64_t) slot << 2) | (uint64_t) type);
+      events++;
+    }
+
+    // Writes 7 bits per byte, the high bit is set when more bytes follow
+
+    void putVarint(uint64_t v) {
+      if ((used + 10) > (int) buffer.size()) {
+        flush();
+      }
+      uint8_t *p = &buffer[used];
+      while (v >= 0x80) {
+        *p++ = (uint8_t)(v | 0x80);
+        v >>= 7;
+      }
+      *p++ = (uint8_t) v;
+      used = (int)(p - buffer.data());
+    }
+
+  }; // end class GvmEventLog
+
+  // Rebuilds the clustering from a GvmEventLog. A group is a cluster from
+  // the time it starts in an empty slot until it is merged into another
+  // cluster or discarded, the merges of groups form the merge tree.
+
+  class GvmEventReplay {
+  public:
+
+    // Group that each point id was added to, -1 for a skipped id
+
+    std::vector<int> pointGroup;
+
+    // Group that each group was merged into and the offset of that merge
+    // in merges, -1 when the group was not merged
+
+    std::vector<int> mergedInto;
+
+    std::vector<int> mergeIndex;
+
+    // Set for a group that was discarded by a restart
+
+    std::vector<char> dropped;
+
+    // Each merge in log order, the group merged into and the merged group
+
+    std::vector<std::pair<int,int> > merges;
+
+    // Group held by each slot, -1 for an empty slot
+
+    std::vector<int> slotGroup;
+
+    int64_t events;
+
+    GvmEventReplay()
+    : events(0), nextId(0)
+    {
+    }
+
+    // Replays one chunk of a log, an event split across two chunks is
+    // completed by the next call.
+    //
+    // return false when the log is not valid
+
+    bool replay(const uint8_t *data, size_t n) {
+      if (!pending.empty()) {
+        std::vector<uint8_t> chunk;
+        chunk.swap(pending);
+        chunk.insert(chunk.end(), data, data + n);
+        return parse(chunk.data(), chunk.size());
+      }
+      return parse(data, n);
+    }
+
+    bool replay(const std::vector<uint8_t> &log) {
+      return replay(log.data(), log.size());
+    }
+
+    // Replays the rest of a file
+
+    bool replay(FILE *fp) {
+      std::vector<uint8_t> chunk(1 << 16);
+      size_t n;
+      while ((n = fread(chunk.data(), 1, chunk.size(), fp)) > 0) {
+        if (!replay(chunk.data(), n)) {
+          return false;
+        }
+      }
+      return isComplete();
+    }
+
+    // True when the last chunk did not end inside an event
+
+    bool isComplete() {
+      return pending.empty();
+    }
+
+    // Number of clusters at the end of the log
+
+    int getClusterCount() {
+      int n = 0;
+      for ( int g : slotGroup ) {
+        if (g >= 0) {
+          n++;
+        }
+      }
+      return n;
+    }
+
+    int getGroupCount() {
+      return (int) mergedInto.size();
+    }
+
+    // Cluster of each point id when the log is cut at k clusters. The
+    // clusters at the end of the log keep the order of their slots, which is
+    // the order of GvmClusters::results(), and a k greater than that number
+    // undoes the latest merges, each undone merge adds the merged group as
+    // the next cluster. A k of 0 or a k less than the number of clusters at
+    // the end of the log gives the clusters at the end of the log.
+    //
+    // return the cluster of each point id, -1 for a point that was skipped
+    // or discarded
+
+    std::vector<int> membership(int k = 0) {
+      const int G = getGroupCount();
+
+      // Cluster that each group belongs to, -2 when not yet known
+
+      std::vector<int> groupCluster(G, -2);
+      int clusters = 0;
+      for ( int g : slotGroup ) {
+        if (g >= 0) {
+          groupCluster[g] = clusters++;
+        }
+      }
+
+      // Undo the latest merges of groups that still exist
+
+      for (int m = (int) merges.size() - 1; m >= 0 && clusters < k; m--) {
+        if (rootOf(merges[m].first) >= 0) {
+          groupCluster[merges[m].second] = clusters++;
+        }
+      }
+
+      std::vector<int> path;
+      for (int g = 0; g < G; g++) {
+        int up = g;
+        while (groupCluster[up] == -2) {
+          path.push_back(up);
+          up = mergedInto[up];
+          if (up < 0) {
+            break;
+          }
+        }
+        const int cluster = (up < 0) ? -1 : groupCluster[up];
+        for ( int p : path ) {
+          groupCluster[p] = cluster;
+        }
+        path.clear();
+      }
+
+      std::vector<int> list(pointGroup.size());
+      for (size_t i = 0; i < pointGroup.size(); i++) {
+        const int g = pointGroup[i];
+        list[i] = (g < 0) ? -1 : groupCluster[g];
+      }
+      return list;
+    }
+
+  protected:
+
+    // Events not yet complete at the end of the last chunk
+
+    std::vector<uint8_t> pending;
+
+    int64_t nextId;
+
+    // Group at the top of the merge tree that holds g, -1 if discarded
+
+    int rootOf(int g) {
+      while (mergedInto[g] >= 0) {
+        g = mergedInto[g];
+      }
+      return dropped[g] ? -1 : g;
+    }
+
+    static bool getVarint(const uint8_t *&p, const uint8_t *end, uint64_t &v) {
+      v = 0;
+      for (int shift = 0; p < end && shift < 64; shift += 7) {
+        uint8_t b = *p++;
+        v |= (uint64_t)(b & 0x7F) << shift;
+        if ((b & 0x80) == 0) {
+          return true;
+        }
+      }
+      return false;
+    }
+
+    int groupIn(int slot) {
+      if (slot >= (int) slotGroup.size()) {
+        slotGroup.resize(slot + 1, -1);
+      }
+      return slotGroup[slot];
+    }
+
+    bool parse(const uint8_t *data, size_t n) {
+      const uint8_t *p = data;
+      const uint8_t *end = data + n;
+
+      while (p < end) {
+        const uint8_t *start = p;
+        uint64_t h, v = 0;
+        if (!getVarint(p, end, h)) {
+          pending.assign(start, end);
+          return true;
+        }
+        const int type = (int)(h & 0x3);
+        const int slot = (int)(h >> 2);
+        if (type != GvmEventRestart && !getVarint(p, end, v)) {
+          pending.assign(start, end);
+          return true;
+        }
+        uint64_t num = 0;
+        if (type == GvmEventAdd && (v & 1) && !getVarint(p, end, num)) {
+          pending.assign(start, end);
+          return true;
+        }
+
+        int g = groupIn(slot);
+
+        switch (type) {
+          case GvmEventAdd: {
+            if (g < 0) {
+              g = newGroup();
+              slotGroup[slot] = g;
+            }
+            const int64_t n = (v & 1) ? (int64_t) num + 2 : 1;
+            nextId += (int64_t)(v >> 1);
+            pointGroup.resize(nextId + n, -1);
+            for (int64_t i = 0; i < n; i++) {
+              pointGroup[nextId++] = g;
+            }
+            break;
+          }
+          case GvmEventMerge: {
+            const int b = (int) v;
+            const int gb = groupIn(b);
+            if (g < 0 || gb < 0 || b == slot) {
+              return false;
+            }
+            mergedInto[gb] = g;
+            mergeIndex[gb] = (int) merges.size();
+            merges.push_back(std::make_pair(g, gb));
+            slotGroup[b] = -1;
+            break;
+          }
+          case GvmEventRestart: {
+            if (g >= 0) {
+              dropped[g] = 1;
+              slotGroup[slot] = -1;
+            }
+            break;
+          }
+          case GvmEventMove: {
+            const int from = (int) v;
+            const int gf = groupIn(from);
+            if (g >= 0 || gf < 0) {
+              return false;
+            }
+            slotGroup[slot] = gf;
+            slotGroup[from] = -1;
+            break;
+          }
+        }
+
+        events++;
+      }
+      return true;
+    }
+
+    int newGroup() {
+      mergedInto.push_back(-1);
+      mergeIndex.push_back(-1);
+      dropped.push_back(0);
+      return (int) mergedInto.size() - 1;
+    }
+
+  }; // end class GvmEventReplay
+
+}
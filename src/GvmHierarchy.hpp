@@ -0,0 +1,263 @@
+//
+//  GvmHierarchy.hpp
+//  GvmCpp
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+// http://www.apache.org/licenses/LICENSE-2.0
+//
+
+// Two level clustering for very large cluster counts. A flat GvmClusters keeps
+// every cluster pair, so memory is O(K^2) and each point costs O(K). Here a
+// coarse GvmClusters with a capacity of about sqrt(K) routes each point to a
+// coarse cell and every cell owns a GvmClusters for its fine clusters with a
+// capacity of about sqrt(K). Memory is then O(K sqrt(K)) and each point costs
+// O(sqrt(K)) for the coarse scan plus the fine scan of a single cell.
+//
+// The coarse clusters carry the id of their cell as their key. When two
+// coarse clusters merge, the fine clusters of the lighter cell are added to
+// the fine clusters of the heavier cell with GvmClusters::addCluster(), so
+// the fine clusters are rebalanced into the merged cell and the lighter cell
+// is recycled for the next new coarse cluster.
+
+#import "GvmCommon.hpp"
+
+#import "GvmClusters.hpp"
+
+#import <math.h>
+
+namespace Gvm {
+
+  // S
+  //
+  // Cluster vector space.
+
+  // V
+  //
+  // Cluster vector type.
+
+  // K
+  //
+  // Type of key.
+
+  // FP
+  //
+  // Floating point type.
+
+  template<typename S, typename V, typename K, typename FP>
+  class GvmHierarchy;
+
+  // Keyer for the coarse clusters, each key holds a single cell id.
+
+  template<typename S, typename V, typename K, typename FP>
+  class GvmCellKeyer : public GvmKeyer<S,V,std::vector<int>,FP> {
+  public:
+
+    typedef std::vector<int> CK;
+
+    GvmHierarchy<S,V,K,FP> &hierarchy;
+
+    GvmCellKeyer<S,V,K,FP>(GvmHierarchy<S,V,K,FP> &inHierarchy)
+    : hierarchy(inHierarchy)
+    {
+    }
+
+    // Two coarse clusters merge, c1 has the greater mass and keeps its cell
+
+    CK* mergeKeys(GvmCluster<S,V,CK,FP> &c1, GvmCluster<S,V,CK,FP> &c2)
+    {
+      CK* k1 = c1.getKey();
+      CK* k2 = c2.getKey();
+      if (k1 == nullptr) return k2;
+      if (k2 == nullptr) return k1;
+      hierarchy.mergeCells((*k1)[0], (*k2)[0]);
+      return k1;
+    }
+
+    // A point is routed to a coarse cluster, a cluster without a
+    // cell is given a new cell through key.
+
+    CK* addKey(GvmCluster<S,V,CK,FP> &cluster, CK* key)
+    {
+      CK* k = cluster.getKey();
+      if (k == nullptr) {
+        k = key;
+        (*k)[0] = hierarchy.newCell();
+      }
+      hierarchy.routedCell = (*k)[0];
+      return k;
+    }
+
+  }; // end class GvmCellKeyer
+
+  template<typename S, typename V, typename K, typename FP>
+  class GvmHierarchy {
+  public:
+
+    typedef std::vector<int> CK;
+
+    S space;
+
+    // Number of coarse cells and fine clusters in each cell
+
+    int coarseCapacity;
+
+    int fineCapacity;
+
+    GvmCellKeyer<S,V,K,FP> cellKeyer;
+
+    // Routes points to cells
+
+    GvmClusters<S,V,CK,FP> coarse;
+
+    // Fine clusters of each cell, indexed by cell id. A cell without
+    // any clusters is on the free list.
+
+    std::vector<std::unique_ptr<GvmClusters<S,V,K,FP> > > cells;
+
+    std::vector<int> freeCells;
+
+    // Keyer installed on the fine clusters, nullptr for the default
+
+    GvmKeyer<S,V,K,FP> *keyerPtr;
+
+    // Cell that the last point was routed to
+
+    int routedCell;
+
+    // Number of times two cells were merged
+
+    int64_t cellMerges;
+
+    // constructor
+    //
+    // inSpace : cluster vector space
+    // capacity : the total number of fine clusters
+    // inCoarseCapacity : number of coarse cells, 0 for about sqrt(capacity)
+
+    GvmHierarchy<S,V,K,FP>(S inSpace, int capacity, int inCoarseCapacity = 0)
+    :
+    space(inSpace),
+    coarseCapacity(inCoarseCapacity > 0 ? inCoarseCapacity : (int) ceil(sqrt((double) capacity))),
+    fineCapacity((capacity + coarseCapacity - 1) / coarseCapacity),
+    cellKeyer(*this),
+    coarse(inSpace, coarseCapacity),
+    keyerPtr(nullptr),
+    routedCell(-1),
+    cellMerges(0)
+    {
+      assert(capacity > 0);
+      coarse.setKeyer(&cellKeyer);
+    }
+
+    // Copy constructor explicitly deleted
+
+    GvmHierarchy<S,V,K,FP>(const GvmHierarchy<S,V,K,FP> &that) = delete;
+    GvmHierarchy<S,V,K,FP>& operator=(const GvmHierarchy<S,V,K,FP>& x) = delete;
+
+    // Total number of fine clusters that can be recorded
+
+    int getCapacity() {
+      return coarseCapacity * fineCapacity;
+    }
+
+    // Number of fine clusters over all cells
+
+    int getCount() {
+      int n = 0;
+      for ( auto &cell : cells ) {
+        n += cell->count;
+      }
+      return n;
+    }
+
+    // Number of cells with clusters
+
+    int getCellCount() {
+      return (int)(cells.size() - freeCells.size());
+    }
+
+    // Keyer for the fine clusters, the caller manages the lifetime
+
+    void setKeyer(GvmKeyer<S,V,K,FP> *inKeyer) {
+      keyerPtr = inKeyer;
+      for ( auto &cell : cells ) {
+        if (keyerPtr) {
+          cell->setKeyer(keyerPtr);
+        } else {
+          cell->resetKeyer();
+        }
+      }
+    }
+
+    // Adds a point to be clustered, see GvmClusters::add()
+
+    template<typename P>
+    void add(const FP m, P &pt, K *key) {
+      if (m == FP(0.0)) return; //nothing to do
+
+      CK cellKey(1, -1);
+
+      routedCell = -1;
+      coarse.add(m, pt, &cellKey);
+      assert(routedCell >= 0);
+
+      cells[routedCell]->add(m, pt, key);
+    }
+
+    // Takes a cell from the free list or creates one
+
+    int newCell() {
+      if (!freeCells.empty()) {
+        int cell = freeCells.back();
+        freeCells.pop_back();
+        return cell;
+      }
+      cells.push_back(std::unique_ptr<GvmClusters<S,V,K,FP> >(new GvmClusters<S,V,K,FP>(space, fineCapacity)));
+      if (keyerPtr) {
+        cells.back()->setKeyer(keyerPtr);
+      }
+      return (int) cells.size() - 1;
+    }
+
+    // Merges the fine clusters of cell from into cell to and frees cell from
+
+    void mergeCells(int to, int from) {
+      GvmClusters<S,V,K,FP> &dst = *(cells[to].get());
+      GvmClusters<S,V,K,FP> &src = *(cells[from].get());
+      for (int i = 0; i < src.count; i++) {
+        dst.addCluster(*(src.clusters[i].get()));
+      }
+      src.clear();
+      freeCells.push_back(from);
+      cellMerges++;
+    }
+
+    // Removes all clusters but retains the keyer
+
+    void clear() {
+      coarse.clear();
+      freeCells.clear();
+      for (int i = (int) cells.size() - 1; i >= 0; i--) {
+        cells[i]->clear();
+        freeCells.push_back(i);
+      }
+    }
+
+    // Fine clusters of every cell
+
+    std::vector<GvmResult<S,V,K,FP>> results() {
+      std::vector<GvmResult<S,V,K,FP>> list;
+      for ( auto &cell : cells ) {
+        for (int i = 0; i < cell->count; i++) {
+          list.push_back(GvmResult<S,V,K,FP>(*(cell->clusters[i].get())));
+        }
+      }
+      return list;
+    }
+
+  }; // end class GvmHierarchy
+
+}
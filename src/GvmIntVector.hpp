@@ -0,0 +1,87 @@
+//
+//  GvmIntVector.hpp
+//  GvmCpp
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+// http://www.apache.org/licenses/LICENSE-2.0
+//
+// Fixed size vector of 64 bit integer values. This vector is used with
+// GvmIntVectorSpace to accumulate exact cluster moments for integer valued
+// inputs like 8 bit pixel channels. With whole number masses, the sums
+// m1 and m2 of 8 bit coordinates fit in 64 bits for clusters of billions
+// of points.
+
+#import "GvmCommon.hpp"
+
+namespace Gvm {
+
+  // D
+  //
+  // Number of dimensions, typically 2 or 3.
+
+  template<int D>
+  class GvmIntVector {
+  public:
+
+    // Statically sized array of values
+
+    int64_t values[D];
+
+    // Number of dimensions
+
+    int getDimensions() {
+      return D;
+    }
+
+    // constructor
+
+    GvmIntVector<D>()
+    {
+      assert(D >= 1);
+      for (int i = 0; i < D; i++) {
+        values[i] = 0;
+      }
+    }
+
+    // copy constructor
+
+    GvmIntVector<D>(const GvmIntVector<D> &other)
+    {
+      for (int i = 0; i < D; i++) {
+        values[i] = other.values[i];
+      }
+    }
+
+    int64_t& operator[](std::size_t idx)       {
+      return values[idx];
+    };
+    const int64_t& operator[](std::size_t idx) const {
+      return values[idx];
+    };
+
+    int64_t iSquared(std::size_t idx) const {
+      int64_t v = values[idx];
+      int64_t vSq = v * v;
+      return vSq;
+    }
+
+    std::string toString() {
+      std::stringstream sb;
+
+      for (int i = 0; i < D; i++) {
+        if (i < (D-1)) {
+          sb << values[i] << " ";
+        } else {
+          sb << values[i];
+        }
+      }
+
+      return sb.str();
+    }
+
+  }; // end class GvmIntVector
+
+}
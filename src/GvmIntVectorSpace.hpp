@@ -0,0 +1,306 @@
+//
+//  GvmIntVectorSpace.hpp
+//  GvmCpp
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+// http://www.apache.org/licenses/LICENSE-2.0
+//
+// Vector space for integer valued inputs. Points and the cluster moments
+// m1 and m2 are stored as 64 bit integers in a GvmIntVector so that adds
+// and merges are exact and the result does not depend on the order of
+// floating point operations on a specific machine. A variance is computed
+// only at comparison time as (m0 * m2 - m1 * m1) / m0 where the numerator
+// is evaluated exactly with 128 bit integers, this avoids the cancellation
+// error of m2 - (m1 * m1 / m0) in floating point.
+//
+// The updates are plain int64 loops and each comparison converts the
+// masses and the exact sum, so this space is slower than a double space,
+// it is meant for results that are exact and the same on every machine.
+//
+// Masses passed to add() must be whole numbers, see toInt(). Note that the
+// centroid computed for a GvmResult via scale() is rounded to the nearest
+// integer coordinate, an exact centroid can be computed from m1 / m0.
+
+#import "GvmCommon.hpp"
+
+#import <math.h>
+#import <stdlib.h>
+
+namespace Gvm {
+
+  // V
+  //
+  // Vector of 64 bit integer coordinates, typically GvmIntVector<D>.
+
+  // FP
+  //
+  // Floating point type that variances are reported in.
+
+  template<typename V, typename FP, int D>
+  class GvmIntVectorSpace {
+  public:
+
+#if defined(__SIZEOF_INT128__)
+    typedef __int128 WideInt;
+#else
+    typedef long double WideInt;
+#endif // __SIZEOF_INT128__
+
+    int getDimensions() {
+      return D;
+    }
+
+    // constructor
+
+    GvmIntVectorSpace()
+    {
+      assert(D >= 1);
+    }
+
+    // True when m is a whole number that fits in 64 bits, false for a
+    // fraction, NaN, an infinity or a value out of range.
+
+    static inline
+    bool isWholeMass(const FP m) {
+      if (!(m >= FP(-9223372036854775808.0) && m < FP(9223372036854775808.0))) {
+        return false;
+      }
+      return FP((int64_t) m) == m;
+    }
+
+    // Convert a whole number mass to an integer. Any other mass would make
+    // the integer moments disagree with the cluster mass, or could not be
+    // converted at all, so it aborts in every build, NDEBUG included.
+
+    static inline
+    int64_t toInt(const FP m) {
+      if (!isWholeMass(m)) {
+        abort();
+      }
+      return (int64_t) m;
+    }
+
+    // Convert an exact sum to floating point. The 128 bit conversion
+    // is split into two 64 bit halves since the compiler runtime call
+    // for a full 128 bit conversion is slow on the hot path.
+
+    static inline
+    FP toFP(const WideInt sum) {
+#if defined(__SIZEOF_INT128__)
+      const int64_t hi = (int64_t) (sum >> 64);
+      const uint64_t lo = (uint64_t) sum;
+      if ((hi == 0 && (int64_t)lo >= 0) || (hi == -1 && (int64_t)lo < 0)) {
+        return FP((int64_t) lo);
+      }
+      return (FP(hi) * FP(18446744073709551616.0)) + FP(lo);
+#else
+      return FP(sum);
+#endif // __SIZEOF_INT128__
+    }
+
+    // space factory methods
+
+    V newOrigin() {
+      // Invoke default constructor
+      return V();
+    }
+
+    V newCopy(V &pt) {
+      // Invoke copy constructor
+      return V(pt);
+    }
+
+    // space point operations
+
+    FP magnitudeSqr(V &pt) {
+      int64_t sum = 0;
+      for (int i = 0; i < D; i++) {
+        sum += pt.iSquared(i);
+      }
+      return FP(sum);
+    }
+
+    FP sum(V &pt) {
+      int64_t sum = 0;
+      for (int i = 0; i < D; i++) {
+        sum += pt[i];
+      }
+      return FP(sum);
+    }
+
+    void setToOrigin(V &pt) {
+      for (int i = 0; i < D; i++) {
+        pt[i] = 0;
+      }
+    }
+
+    void setTo(V &dstPt, V &srcPt) {
+      for (int i = 0; i < D; i++) {
+        dstPt[i] = srcPt[i];
+      }
+    }
+
+    void setToScaled(V &dstPt, FP m, V &srcPt) {
+      const int64_t im = toInt(m);
+      for (int i = 0; i < D; i++) {
+        dstPt[i] = im * srcPt[i];
+      }
+    }
+
+    void setToScaledSqr(V &dstPt, FP m, V &srcPt) {
+      const int64_t im = toInt(m);
+      for (int i = 0; i < D; i++) {
+        dstPt[i] = im * srcPt.iSquared(i);
+      }
+    }
+
+    void add(V &dstPt, V &srcPt) {
+      for (int i = 0; i < D; i++) {
+        dstPt[i] += srcPt[i];
+      }
+    }
+
+    void addScaled(V &dstPt, FP m, V &srcPt) {
+      const int64_t im = toInt(m);
+      for (int i = 0; i < D; i++) {
+        dstPt[i] += im * srcPt[i];
+      }
+    }
+
+    void addScaledSqr(V &dstPt, FP m, V &srcPt) {
+      const int64_t im = toInt(m);
+      for (int i = 0; i < D; i++) {
+        dstPt[i] += im * srcPt.iSquared(i);
+      }
+    }
+
+    // Compact input point operations, see GvmPixelVector.
+
+    template<typename P>
+    void setToScaled(V &dstPt, FP m, const P &srcPt) {
+      const int64_t im = toInt(m);
+      for (int i = 0; i < D; i++) {
+        dstPt[i] = im * int64_t(srcPt[i]);
+      }
+    }
+
+    template<typename P>
+    void setToScaledSqr(V &dstPt, FP m, const P &srcPt) {
+      const int64_t im = toInt(m);
+      for (int i = 0; i < D; i++) {
+        int64_t c = int64_t(srcPt[i]);
+        dstPt[i] = im * (c * c);
+      }
+    }
+
+    template<typename P>
+    void addScaled(V &dstPt, FP m, const P &srcPt) {
+      const int64_t im = toInt(m);
+      for (int i = 0; i < D; i++) {
+        dstPt[i] += im * int64_t(srcPt[i]);
+      }
+    }
+
+    template<typename P>
+    void addScaledSqr(V &dstPt, FP m, const P &srcPt) {
+      const int64_t im = toInt(m);
+      for (int i = 0; i < D; i++) {
+        int64_t c = int64_t(srcPt[i]);
+        dstPt[i] += im * (c * c);
+      }
+    }
+
+    void subtract(V &dstPt, V &srcPt) {
+      for (int i = 0; i < D; i++) {
+        dstPt[i] -= srcPt[i];
+      }
+    }
+
+    void subtractScaled(V &dstPt, FP m, V &srcPt) {
+      const int64_t im = toInt(m);
+      for (int i = 0; i < D; i++) {
+        dstPt[i] -= im * srcPt[i];
+      }
+    }
+
+    void subtractScaledSqr(V &dstPt, FP m, V &srcPt) {
+      const int64_t im = toInt(m);
+      for (int i = 0; i < D; i++) {
+        dstPt[i] -= im * srcPt.iSquared(i);
+      }
+    }
+
+    // Scale rounds to the nearest integer, this is how a GvmResult
+    // centroid is computed from m1.
+
+    void scale(V &pt, FP m) {
+      for (int i = 0; i < D; i++) {
+        pt[i] = (int64_t) llround(FP(pt[i]) * m);
+      }
+    }
+
+    void square(V &pt) {
+      for (int i = 0; i < D; i++) {
+        pt[i] *= pt[i];
+      }
+    }
+
+    FP distance(V &pt1, V &pt2) {
+      int64_t sum = 0;
+      for (int i = 0; i < D; i++) {
+        int64_t d = pt1[i] - pt2[i];
+        sum += d * d;
+      }
+      return sqrt(FP(sum));
+    }
+
+    // Exact variance kernels, each dimension contributes
+    // (m0 * m2 - m1 * m1) / m0 and the sum of the numerators
+    // is converted to floating point once. The per dimension
+    // sums fit in 64 bits, only the products need 128 bits.
+
+    FP variance(const FP m, const V &pt, const V &ptSqr) {
+      const int64_t m0 = toInt(m);
+      WideInt sum = 0;
+      for (int i = 0; i < D; i++) {
+        int64_t c = pt[i];
+        sum += (WideInt(m0) * ptSqr[i]) - (WideInt(c) * c);
+      }
+      return toFP(sum) / FP(m0);
+    }
+
+    template<typename P>
+    FP variance(const FP m1, const V &pt1, const V &ptSqr1, const FP m2, const P &pt2) {
+      const int64_t im2 = toInt(m2);
+      const int64_t m0 = toInt(m1) + im2;
+      WideInt sum = 0;
+      for (int i = 0; i < D; i++) {
+        int64_t c2 = int64_t(pt2[i]);
+        int64_t c = pt1[i] + (im2 * c2);
+        int64_t cSqr = ptSqr1[i] + (im2 * (c2 * c2));
+        sum += (WideInt(m0) * cSqr) - (WideInt(c) * c);
+      }
+      return toFP(sum) / FP(m0);
+    }
+
+    FP variance(const FP m1, const V &pt1, const V &ptSqr1, const FP m2, const V &pt2, const V &ptSqr2) {
+      const int64_t m0 = toInt(m1) + toInt(m2);
+      WideInt sum = 0;
+      for (int i = 0; i < D; i++) {
+        int64_t c = pt1[i] + pt2[i];
+        int64_t cSqr = ptSqr1[i] + ptSqr2[i];
+        sum += (WideInt(m0) * cSqr) - (WideInt(c) * c);
+      }
+      return toFP(sum) / FP(m0);
+    }
+
+    std::string toString(V &pt) {
+      return pt.toString();
+    }
+
+  }; // end class GvmIntVectorSpace
+
+}
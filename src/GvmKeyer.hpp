@@ -62,6 +62,18 @@ namespace Gvm {
 
     virtual K* addKey(GvmCluster<S,V,K,FP> &cluster, K* key) = 0;
     
+    // Called when a subsampled point stands for scale points before its key
+    // is added, see GvmClusters::setDeadline(). A keyer whose keys are mass
+    // weighted sums scales the key to match the mass, the default keeps it.
+    //
+    // key : the key of the sampled point, not owned by the keyer, may be nullptr
+    // scale : the factor the mass of the point was multiplied by
+    // return the key to add in place of key
+    
+    virtual K* scaleKey(K* key, FP) {
+      return key;
+    }
+    
   }; // end class GvmKeyer
 
 }
@@ -0,0 +1,319 @@
+//
+//  GvmLevels.hpp
+//  GvmCpp
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+// http://www.apache.org/licenses/LICENSE-2.0
+//
+
+// Results at many cluster counts from a single reduction. The current
+// clusters of a GvmClusters are copied and merged, cheapest pair first, all
+// the way down to one cluster. Each time the number of clusters reaches one
+// of the requested counts a level is recorded, so the levels are nested and
+// the cost is one reduction instead of one full clustering for each count.
+// The GvmClusters itself is not modified.
+//
+// The cost of a merge is the increase in variance, the same value that
+// GvmClusters uses for its pairs. Rather than a heap over all N^2 pairs each
+// cluster keeps its cheapest partner, so memory is O(N). After a merge only
+// the clusters whose partner was one of the merged clusters scan again, the
+// others just compare against the merged cluster.
+
+#import "GvmCommon.hpp"
+
+#import "GvmClusters.hpp"
+#import "GvmResult.hpp"
+
+#import <algorithm>
+
+namespace Gvm {
+
+  // S
+  //
+  // Cluster vector space.
+
+  // V
+  //
+  // Cluster vector type.
+
+  // K
+  //
+  // Type of key.
+
+  // FP
+  //
+  // Floating point type.
+
+  template<typename S, typename V, typename K, typename FP>
+  class GvmLevel {
+  public:
+
+    // Number of clusters at this level
+
+    int k;
+
+    // Sum of the mass weighted variance of the clusters
+
+    FP totalVariance;
+
+    // Clusters at this level. The key of a result is the key of the input
+    // cluster when it holds a single input cluster, otherwise nullptr.
+
+    std::vector<GvmResult<S,V,K,FP>> results;
+
+    // For each input cluster, in GvmClusters::results() order, the offset
+    // of the result that holds it
+
+    std::vector<int> membership;
+
+    // For each result, the offset of the result that holds it at the next
+    // level, -1 at the last level
+
+    std::vector<int> parent;
+
+  }; // end class GvmLevel
+
+  template<typename S, typename V, typename K, typename FP>
+  class GvmLevels {
+  public:
+
+    S space;
+
+    // Number of merges done by the last levels()
+
+    int merges;
+
+    // Number of merge costs computed by the last levels()
+
+    int64_t tests;
+
+    // constructor
+
+    GvmLevels<S,V,K,FP>(S inSpace)
+    : space(inSpace), merges(0), tests(0)
+    {
+    }
+
+    // Reduces a copy of the clusters down to a single cluster.
+    //
+    // clusters : the clusters to start from, not modified
+    // ks : cluster counts to record, a count greater than the number of
+    // clusters records the clusters as they are
+    // return one level for each distinct count, from the most clusters
+    // to the fewest
+
+    std::vector<GvmLevel<S,V,K,FP>> levels(GvmClusters<S,V,K,FP> &clusters, const std::vector<int> &ks) {
+      std::vector<GvmLevel<S,V,K,FP>> list;
+
+      const int N = clusters.count;
+
+      merges = 0;
+      tests = 0;
+
+      std::vector<int> wanted;
+      for ( int k : ks ) {
+        if (k >= 1) {
+          wanted.push_back(std::min(k, N));
+        }
+      }
+      std::sort(wanted.begin(), wanted.end(), std::greater<int>());
+      wanted.erase(std::unique(wanted.begin(), wanted.end()), wanted.end());
+
+      if (N == 0 || wanted.empty()) {
+        return list;
+      }
+
+      // Copy the moments, slot i starts as input cluster i
+
+      count.resize(N);
+      m0.resize(N);
+      m1.clear();
+      m2.clear();
+      var.resize(N);
+      keys.resize(N);
+      for (int i = 0; i < N; i++) {
+        GvmCluster<S,V,K,FP> &cluster = *(clusters.clusters[i].get());
+        count[i] = cluster.count;
+        m0[i] = cluster.m0;
+        m1.push_back(space.newCopy(cluster.m1));
+        m2.push_back(space.newCopy(cluster.m2));
+        var[i] = cluster.var;
+        keys[i] = cluster.getKey();
+      }
+
+      alive.assign(N, 1);
+      members.assign(N, 1);
+      merged.assign(N, -1);
+      nearest.assign(N, -1);
+      cost.assign(N, FP(0.0));
+
+      for (int i = 0; i < N; i++) {
+        scan(i, N);
+      }
+
+      int remaining = N;
+      int next = 0;
+
+      while (true) {
+        if (remaining == wanted[next]) {
+          list.push_back(snapshot(remaining, N));
+          next++;
+          if (next == (int) wanted.size()) {
+            break;
+          }
+        }
+
+        // Cheapest merge over all clusters
+
+        int a = -1;
+        for (int i = 0; i < N; i++) {
+          if (alive[i] && nearest[i] >= 0 && (a == -1 || cost[i] < cost[a])) {
+            a = i;
+          }
+        }
+        int b = nearest[a];
+        if (b < a) {
+          std::swap(a, b);
+        }
+
+        // b is merged into a
+
+        count[a] += count[b];
+        members[a] += members[b];
+        m0[a] += m0[b];
+        space.add(m1[a], m1[b]);
+        space.add(m2[a], m2[b]);
+        var[a] = (m0[a] == FP(0.0)) ? FP(0.0) : space.variance(m0[a], m1[a], m2[a]);
+        alive[b] = 0;
+        merged[b] = a;
+        remaining--;
+        merges++;
+
+        nearest[a] = -1;
+        for (int i = 0; i < N; i++) {
+          if (!alive[i] || i == a) {
+            continue;
+          }
+          FP c = test(a, i);
+          if (nearest[a] == -1 || c < cost[a]) {
+            nearest[a] = i;
+            cost[a] = c;
+          }
+          if (nearest[i] == a || nearest[i] == b) {
+            scan(i, N);
+          } else if (c < cost[i]) {
+            nearest[i] = a;
+            cost[i] = c;
+          }
+        }
+      }
+
+      for (int l = 0; l < (int) list.size() - 1; l++) {
+        GvmLevel<S,V,K,FP> &level = list[l];
+        GvmLevel<S,V,K,FP> &coarser = list[l+1];
+        for (int i = 0; i < N; i++) {
+          level.parent[level.membership[i]] = coarser.membership[i];
+        }
+      }
+
+      m1.clear();
+      m2.clear();
+
+      return list;
+    }
+
+  protected:
+
+    // Per slot state of the reduction
+
+    std::vector<int> count;
+    std::vector<FP> m0;
+    std::vector<V> m1;
+    std::vector<V> m2;
+    std::vector<FP> var;
+    std::vector<K*> keys;
+    std::vector<char> alive;
+
+    // Number of input clusters held by each slot
+
+    std::vector<int> members;
+
+    // Slot that a dead slot was merged into
+
+    std::vector<int> merged;
+
+    // Cheapest partner of each slot and the cost of that merge
+
+    std::vector<int> nearest;
+    std::vector<FP> cost;
+
+    // Increase in variance when slots i and j merge
+
+    FP test(int i, int j) {
+      tests++;
+      if (m0[i] == FP(0.0) && m0[j] == FP(0.0)) {
+        return FP(0.0);
+      }
+      return space.variance(m0[i], m1[i], m2[i], m0[j], m1[j], m2[j]) - var[i] - var[j];
+    }
+
+    // Finds the cheapest partner of slot i
+
+    void scan(int i, int N) {
+      nearest[i] = -1;
+      for (int j = 0; j < N; j++) {
+        if (!alive[j] || j == i) {
+          continue;
+        }
+        FP c = test(i, j);
+        if (nearest[i] == -1 || c < cost[i]) {
+          nearest[i] = j;
+          cost[i] = c;
+        }
+      }
+    }
+
+    // Slot that holds input cluster i
+
+    int find(int i) {
+      int root = i;
+      while (merged[root] >= 0) {
+        root = merged[root];
+      }
+      while (merged[i] >= 0) {
+        int up = merged[i];
+        merged[i] = root;
+        i = up;
+      }
+      return root;
+    }
+
+    GvmLevel<S,V,K,FP> snapshot(int k, int N) {
+      GvmLevel<S,V,K,FP> level;
+      level.k = k;
+      level.totalVariance = FP(0.0);
+      level.membership.resize(N);
+      level.parent.assign(k, -1);
+
+      std::vector<int> offset(N, -1);
+      for (int i = 0; i < N; i++) {
+        if (!alive[i]) {
+          continue;
+        }
+        offset[i] = (int) level.results.size();
+        K *key = (members[i] == 1) ? keys[i] : nullptr;
+        level.results.push_back(GvmResult<S,V,K,FP>(space, count[i], m0[i], m1[i], var[i], key));
+        level.totalVariance += var[i];
+      }
+      for (int i = 0; i < N; i++) {
+        level.membership[i] = offset[find(i)];
+      }
+      return level;
+    }
+
+  }; // end class GvmLevels
+
+}
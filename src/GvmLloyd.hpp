@@ -0,0 +1,462 @@
+//
+//  GvmLloyd.hpp
+//  GvmCpp
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+// http://www.apache.org/licenses/LICENSE-2.0
+//
+
+// Lloyd (k-means) refinement seeded from GVM results. GVM gives a good one
+// pass seeding, a few Lloyd iterations over the weighted input points then
+// move each centroid to the mean of the points nearest to it. Points are
+// typically the unique points from a GvmDedup or GvmCoreset stage with their
+// masses.
+//
+// Distance computations are skipped with Hamerly's bounds: each point keeps
+// an upper bound on the distance to its assigned centroid and a lower bound
+// on the distance to every other centroid. A point is only tested again when
+// its upper bound is greater than both its lower bound and half the distance
+// from its centroid to the nearest other centroid, and the full scan is only
+// done when the tightened upper bound still fails that test. The bounds are
+// loosened by the distance each centroid moves.
+//
+// Points and centroids are copied into row major arrays so that the distance
+// kernel runs over contiguous values and can be vectorized. Assignment and
+// the centroid sums run over slices of the points in parallel.
+//
+// Iterations stop when no point changes cluster, when no centroid moves more
+// than tolerance or after maxIterations. The result centroids, masses, counts
+// and variances are then updated in place. Result keys are not changed.
+
+#import "GvmCommon.hpp"
+
+#import <thread>
+
+#import <math.h>
+
+namespace Gvm {
+
+  // S
+  //
+  // Cluster vector space.
+
+  // V
+  //
+  // Cluster vector type.
+
+  // K
+  //
+  // Type of key.
+
+  // FP
+  //
+  // Floating point type.
+
+  template<typename S, typename V, typename K, typename FP>
+  class GvmLloyd {
+  public:
+
+    S space;
+
+    // The max number of iterations
+
+    int maxIterations;
+
+    // Stop once no centroid moves more than this distance
+
+    FP tolerance;
+
+    // Number of threads, 0 means use all cores.
+
+    int numThreads;
+
+    // Number of iterations run by refine()
+
+    int iterations;
+
+    // Number of point to centroid distances computed
+
+    int64_t distances;
+
+    // Number of point visits where the bounds skipped every distance
+
+    int64_t skipped;
+
+    // Offset of the result that each input point is assigned to
+
+    std::vector<int> assignment;
+
+    // constructor
+
+    GvmLloyd<S,V,K,FP>(S inSpace, int inMaxIterations = 10, FP inTolerance = FP(0.0), int inNumThreads = 0)
+    : space(inSpace), maxIterations(inMaxIterations), tolerance(inTolerance), numThreads(inNumThreads), iterations(0), distances(0), skipped(0)
+    {
+      assert(maxIterations >= 0);
+
+      if (numThreads <= 0) {
+        numThreads = (int) std::thread::hardware_concurrency();
+        if (numThreads <= 0) {
+          numThreads = 1;
+        }
+      }
+    }
+
+    // Squared distance between two rows
+
+    static inline
+    FP distanceSqr(const FP * __restrict a, const FP * __restrict b, const int D) {
+      FP s0 = FP(0.0), s1 = FP(0.0), s2 = FP(0.0), s3 = FP(0.0);
+      int d = 0;
+      for (; d + 4 <= D; d += 4) {
+        FP d0 = a[d] - b[d];
+        FP d1 = a[d+1] - b[d+1];
+        FP d2 = a[d+2] - b[d+2];
+        FP d3 = a[d+3] - b[d+3];
+        s0 += d0 * d0;
+        s1 += d1 * d1;
+        s2 += d2 * d2;
+        s3 += d3 * d3;
+      }
+      for (; d < D; d++) {
+        FP d0 = a[d] - b[d];
+        s0 += d0 * d0;
+      }
+      return (s0 + s1) + (s2 + s3);
+    }
+
+    // Refines the results with Lloyd iterations over the points.
+    //
+    // results : seeds, updated in place
+    // inPoints : the clustered points
+    // inMasses : mass of each point, when nullptr each point has mass 1
+
+    void refine(std::vector<GvmResult<S,V,K,FP>> &results, std::vector<V> &inPoints, const std::vector<FP> *inMasses = nullptr) {
+      const int N = (int) inPoints.size();
+      const int D = space.getDimensions();
+      const int C = (int) results.size();
+
+#if defined(DEBUG)
+      assert(inMasses == nullptr || (int)inMasses->size() == N);
+#endif // DEBUG
+
+      iterations = 0;
+      distances = 0;
+      skipped = 0;
+
+      if (N == 0 || C == 0) {
+        assignment.clear();
+        return;
+      }
+
+      points.resize((size_t)N * D);
+      masses.resize(N);
+      for (int i = 0; i < N; i++) {
+        V &pt = inPoints[i];
+        for (int d = 0; d < D; d++) {
+          points[((size_t)i * D) + d] = pt[d];
+        }
+        masses[i] = inMasses == nullptr ? FP(1.0) : (*inMasses)[i];
+      }
+
+      centroids.resize((size_t)C * D);
+      for (int j = 0; j < C; j++) {
+        V &pt = results[j].point;
+        for (int d = 0; d < D; d++) {
+          centroids[((size_t)j * D) + d] = pt[d];
+        }
+      }
+
+      assignment.assign(N, 0);
+      upper.assign(N, FP(0.0));
+      lower.assign(N, FP(0.0));
+      drift.assign(C, FP(0.0));
+      halfGap.assign(C, FP(0.0));
+      threadSums.assign((size_t)numThreads * C * D, FP(0.0));
+      threadMasses.assign((size_t)numThreads * C, FP(0.0));
+      threadCounts.assign((size_t)numThreads * 3, 0);
+
+      // Initial assignment with a full scan of every point
+
+      parallelFor(N, [this, C, D](int t, int start, int end) {
+        int64_t *counts = &threadCounts[(size_t)t * 3];
+        for (int i = start; i < end; i++) {
+          scan(i, C, D);
+        }
+        counts[0] += (int64_t)(end - start) * C;
+      });
+      collectCounts();
+
+      bool moved = true;
+
+      while (iterations < maxIterations) {
+        iterations++;
+
+        FP maxDrift = updateCentroids(N, C, D);
+        moved = false;
+        if (maxDrift <= tolerance) {
+          break;
+        }
+
+        updateBounds(N, C, D);
+
+        int64_t changed = assign(N, C, D);
+        if (changed == 0) {
+          break;
+        }
+        moved = true;
+      }
+
+      if (moved) {
+        updateCentroids(N, C, D);
+      }
+
+      updateResults(results, N, C, D);
+    }
+
+  protected:
+
+    std::vector<FP> points;
+    std::vector<FP> masses;
+    std::vector<FP> centroids;
+
+    // Hamerly bounds for each point
+
+    std::vector<FP> upper;
+    std::vector<FP> lower;
+
+    // Distance each centroid moved and half the distance from each
+    // centroid to the nearest other centroid.
+
+    std::vector<FP> drift;
+    std::vector<FP> halfGap;
+
+    // Per thread centroid sums, masses and counters
+
+    std::vector<FP> threadSums;
+    std::vector<FP> threadMasses;
+    std::vector<int64_t> threadCounts;
+
+    // Full scan of point i, sets the assignment and both bounds
+
+    void scan(int i, const int C, const int D) {
+      const FP *x = &points[(size_t)i * D];
+      FP best = std::numeric_limits<FP>::max();
+      FP second = std::numeric_limits<FP>::max();
+      int bestJ = 0;
+      const FP *c = centroids.data();
+      for (int j = 0; j < C; j++) {
+        FP dist = distanceSqr(x, c, D);
+        if (dist < best) {
+          second = best;
+          best = dist;
+          bestJ = j;
+        } else if (dist < second) {
+          second = dist;
+        }
+        c += D;
+      }
+      assignment[i] = bestJ;
+      upper[i] = sqrt(best);
+      lower[i] = C > 1 ? sqrt(second) : std::numeric_limits<FP>::max();
+    }
+
+    // Sums the counters from each thread
+
+    void collectCounts() {
+      for (int t = 0; t < numThreads; t++) {
+        int64_t *counts = &threadCounts[(size_t)t * 3];
+        distances += counts[0];
+        skipped += counts[1];
+        counts[0] = 0;
+        counts[1] = 0;
+      }
+    }
+
+    // Moves each centroid to the weighted mean of its points and
+    // returns the greatest distance moved. A centroid without any
+    // points does not move.
+
+    FP updateCentroids(const int N, const int C, const int D) {
+      std::fill(threadSums.begin(), threadSums.end(), FP(0.0));
+      std::fill(threadMasses.begin(), threadMasses.end(), FP(0.0));
+
+      parallelFor(N, [this, C, D](int t, int start, int end) {
+        FP *sums = &threadSums[(size_t)t * C * D];
+        FP *ms = &threadMasses[(size_t)t * C];
+        for (int i = start; i < end; i++) {
+          const int j = assignment[i];
+          const FP m = masses[i];
+          const FP *x = &points[(size_t)i * D];
+          FP *sum = sums + ((size_t)j * D);
+          for (int d = 0; d < D; d++) {
+            sum[d] += m * x[d];
+          }
+          ms[j] += m;
+        }
+      });
+
+      FP maxDrift = FP(0.0);
+      std::vector<FP> next(D);
+
+      for (int j = 0; j < C; j++) {
+        FP m = FP(0.0);
+        std::fill(next.begin(), next.end(), FP(0.0));
+        for (int t = 0; t < numThreads; t++) {
+          const FP *sum = &threadSums[(((size_t)t * C) + j) * D];
+          for (int d = 0; d < D; d++) {
+            next[d] += sum[d];
+          }
+          m += threadMasses[((size_t)t * C) + j];
+        }
+        FP *c = &centroids[(size_t)j * D];
+        if (m == FP(0.0)) {
+          drift[j] = FP(0.0);
+          continue;
+        }
+        const FP scale = FP(1.0) / m;
+        for (int d = 0; d < D; d++) {
+          next[d] *= scale;
+        }
+        drift[j] = sqrt(distanceSqr(c, next.data(), D));
+        for (int d = 0; d < D; d++) {
+          c[d] = next[d];
+        }
+        if (drift[j] > maxDrift) {
+          maxDrift = drift[j];
+        }
+      }
+
+      return maxDrift;
+    }
+
+    // Loosens the bounds by the centroid drift and computes the half
+    // distance from each centroid to its nearest neighbour.
+
+    void updateBounds(const int N, const int C, const int D) {
+      int far1 = 0;
+      int far2 = -1;
+      for (int j = 1; j < C; j++) {
+        if (drift[j] > drift[far1]) {
+          far2 = far1;
+          far1 = j;
+        } else if (far2 < 0 || drift[j] > drift[far2]) {
+          far2 = j;
+        }
+      }
+      const FP drift1 = drift[far1];
+      const FP drift2 = far2 < 0 ? FP(0.0) : drift[far2];
+
+      parallelFor(N, [this, far1, drift1, drift2](int, int start, int end) {
+        for (int i = start; i < end; i++) {
+          const int j = assignment[i];
+          upper[i] += drift[j];
+          lower[i] -= (j == far1) ? drift2 : drift1;
+        }
+      });
+
+      for (int j = 0; j < C; j++) {
+        FP nearest = std::numeric_limits<FP>::max();
+        const FP *c = &centroids[(size_t)j * D];
+        for (int k = 0; k < C; k++) {
+          if (k == j) continue;
+          FP dist = distanceSqr(c, &centroids[(size_t)k * D], D);
+          if (dist < nearest) {
+            nearest = dist;
+          }
+        }
+        halfGap[j] = C > 1 ? FP(0.5) * sqrt(nearest) : std::numeric_limits<FP>::max();
+      }
+    }
+
+    // Assigns each point to its nearest centroid, returns the number
+    // of points that changed cluster.
+
+    int64_t assign(const int N, const int C, const int D) {
+      parallelFor(N, [this, C, D](int t, int start, int end) {
+        int64_t *counts = &threadCounts[(size_t)t * 3];
+        for (int i = start; i < end; i++) {
+          const int j = assignment[i];
+          const FP bound = halfGap[j] > lower[i] ? halfGap[j] : lower[i];
+          if (upper[i] <= bound) {
+            counts[1]++;
+            continue;
+          }
+          upper[i] = sqrt(distanceSqr(&points[(size_t)i * D], &centroids[(size_t)j * D], D));
+          counts[0]++;
+          if (upper[i] <= bound) {
+            continue;
+          }
+          scan(i, C, D);
+          counts[0] += C;
+          if (assignment[i] != j) {
+            counts[2]++;
+          }
+        }
+      });
+
+      int64_t changed = 0;
+      for (int t = 0; t < numThreads; t++) {
+        changed += threadCounts[((size_t)t * 3) + 2];
+        threadCounts[((size_t)t * 3) + 2] = 0;
+      }
+      collectCounts();
+      return changed;
+    }
+
+    // Writes the centroid, mass, count and variance of each result
+
+    void updateResults(std::vector<GvmResult<S,V,K,FP>> &results, const int N, const int C, const int D) {
+      std::vector<FP> sse(C, FP(0.0));
+      std::vector<FP> ms(C, FP(0.0));
+      std::vector<int> counts(C, 0);
+
+      for (int i = 0; i < N; i++) {
+        const int j = assignment[i];
+        const FP m = masses[i];
+        sse[j] += m * distanceSqr(&points[(size_t)i * D], &centroids[(size_t)j * D], D);
+        ms[j] += m;
+        counts[j]++;
+      }
+
+      for (int j = 0; j < C; j++) {
+        GvmResult<S,V,K,FP> &result = results[j];
+        V &pt = result.point;
+        for (int d = 0; d < D; d++) {
+          pt[d] = centroids[((size_t)j * D) + d];
+        }
+        result.setMass(ms[j]);
+        result.setCount(counts[j]);
+        result.setVariance(ms[j] == FP(0.0) ? FP(0.0) : sse[j] / ms[j]);
+      }
+    }
+
+    // Run func(threadi, start, end) over slices of N in parallel.
+
+    template<typename F>
+    void parallelFor(int N, F func) {
+      int T = numThreads;
+      if (T > N) {
+        T = N;
+      }
+      if (T <= 1) {
+        func(0, 0, N);
+        return;
+      }
+      std::vector<std::thread> threads;
+      int step = (N + T - 1) / T;
+      for (int t = 0; t < T; t++) {
+        int start = t * step;
+        int end = (start + step) > N ? N : (start + step);
+        threads.push_back(std::thread(func, t, start, end));
+      }
+      for ( auto &thread : threads ) {
+        thread.join();
+      }
+    }
+
+  }; // end class GvmLloyd
+
+}
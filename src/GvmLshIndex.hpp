@@ -0,0 +1,438 @@
+//
+//  GvmLshIndex.hpp
+//  GvmCpp
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+// http://www.apache.org/licenses/LICENSE-2.0
+//
+// Optional approximate candidate generator for GvmClusters::add(). With
+// high dimensional points the exact scan tests every cluster and costs
+// O(capacity * D) for each point. This index hashes each cluster centroid
+// with random hyperplane LSH into a number of tables, each with a code of
+// a number of bits. Each table keeps a bucket of cluster slots for every
+// code in use. A point is hashed the same way and the buckets of every code
+// within probeRadius bits of the point code are probed, so the clusters
+// found in any table are tested exactly. If no cluster is a candidate then
+// the exact scan is used for that point.
+//
+// A query costs tables * numPlanes * D for the projections and one bucket
+// lookup for each of the sum of C(bits, r), r <= probeRadius, probed codes
+// in each table, plus the exact tests of the candidates. Keep probeRadius
+// small when bits is large, at 32 bits a radius of 2 is already 529 probes
+// a table.
+//
+// Each hyperplane passes through the median of the centroid projections
+// at the time the index is built, so the bits split the clusters evenly.
+// The index is built when the clusters are first full and is rebuilt after
+// reduce() or clear(). The code of a cluster is recomputed each time the
+// cluster centroid moves and the slot moves to the bucket of its new code.
+//
+// In validation mode the exact scan is also run for each point and a miss
+// is counted when a cluster outside the candidate set was cheaper, the
+// approximate choice is still the one used. The ratio of misses to queries
+// shows how many tables and bits a data set needs.
+
+#import "GvmCommon.hpp"
+
+#import "GvmCluster.hpp"
+#import "GvmMemoryReport.hpp"
+
+#import <random>
+#import <algorithm>
+#import <unordered_map>
+
+namespace Gvm {
+
+  // S
+  //
+  // Cluster vector space.
+
+  // V
+  //
+  // Cluster vector type.
+
+  // K
+  //
+  // Type of key.
+
+  // FP
+  //
+  // Floating point type.
+
+  template<typename S, typename V, typename K, typename FP>
+  class GvmLshIndex {
+  public:
+
+    // Number of hash tables
+
+    int tables;
+
+    // Number of hyperplanes and code bits in each table, at most 32
+
+    int bits;
+
+    // A cluster is a candidate when its code differs from the point code
+    // in at most this many bits in at least one table.
+
+    int probeRadius;
+
+    // When true the exact scan is also run to count misses
+
+    bool validate;
+
+    int dimensions;
+
+    // Hyperplane normals, tables * bits rows of dimensions values
+
+    std::vector<FP> planes;
+
+    // Hyperplane offsets, tables * bits values
+
+    std::vector<FP> offsets;
+
+    // Code of each cluster slot in each table
+
+    std::vector<uint32_t> codes;
+
+    // Slots of the clusters with each code, one map for each table
+
+    std::vector<std::unordered_map<uint32_t, std::vector<int> > > buckets;
+
+    // Slot of each cluster when the index was built
+
+    std::unordered_map<GvmCluster<S,V,K,FP>*, int> slots;
+
+    // Stamp of the query that last made each slot a candidate
+
+    std::vector<int64_t> marks;
+
+    int64_t stamp;
+
+    // Set once codes have been computed for all the clusters
+
+    bool built;
+
+    // Number of points hashed
+
+    int64_t queries;
+
+    // Number of clusters tested exactly
+
+    int64_t scored;
+
+    // Number of points with no candidate that used the exact scan
+
+    int64_t fallbacks;
+
+    // Number of points where a cheaper cluster was not a candidate,
+    // only counted in validation mode.
+
+    int64_t misses;
+
+    // Scratch space
+
+    std::vector<FP> projections;
+
+    std::vector<uint32_t> pointCodes;
+
+    std::vector<int> candidates;
+
+    // constructor
+
+    GvmLshIndex<S,V,K,FP>(int inDimensions, int capacity, int inTables, int inBits, int inProbeRadius, bool inValidate, uint32_t seed)
+    :
+    tables(inTables),
+    bits(inBits),
+    probeRadius(inProbeRadius),
+    validate(inValidate),
+    dimensions(inDimensions),
+    stamp(0),
+    built(false),
+    queries(0),
+    scored(0),
+    fallbacks(0),
+    misses(0)
+    {
+      assert(tables >= 1);
+      assert(bits >= 1 && bits <= 32);
+      assert(probeRadius >= 0);
+
+      const int numPlanes = tables * bits;
+
+      std::mt19937 rng(seed);
+      std::normal_distribution<double> normal(0.0, 1.0);
+
+      planes.resize((size_t)numPlanes * dimensions);
+      for (size_t i = 0; i < planes.size(); i++) {
+        planes[i] = FP(normal(rng));
+      }
+
+      offsets.resize(numPlanes, FP(0.0));
+      codes.resize((size_t)capacity * tables, 0);
+      buckets.resize(tables);
+      marks.resize(capacity, -1);
+      projections.resize(numPlanes);
+      pointCodes.resize(tables);
+    }
+
+    // Heap bytes of the buckets and the slot map, estimated from their
+    // sizes since the node layout is up to the library.
+
+    size_t bucketBytes() {
+      size_t total = gvmHeapBytes(buckets) + gvmHeapBytes(marks);
+      for (int t = 0; t < (int)buckets.size(); t++) {
+        total += buckets[t].bucket_count() * sizeof(void*);
+        for (auto &entry : buckets[t]) {
+          total += sizeof(entry) + sizeof(void*) + gvmHeapBytes(entry.second);
+        }
+      }
+      total += slots.bucket_count() * sizeof(void*);
+      total += slots.size() * (sizeof(std::pair<GvmCluster<S,V,K,FP>*, int>) + sizeof(void*));
+      return total;
+    }
+
+    // Fraction of points where the exact best cluster was missed
+
+    FP getMissRate() {
+      return queries == 0 ? FP(0.0) : FP(misses) / FP(queries);
+    }
+
+    void clearStatistics() {
+      queries = 0;
+      scored = 0;
+      fallbacks = 0;
+      misses = 0;
+    }
+
+    // Codes for a new cluster capacity, the index is rebuilt on the next query
+
+    void resize(int capacity) {
+      codes.assign((size_t)capacity * tables, 0);
+      codes.shrink_to_fit();
+      marks.assign(capacity, -1);
+      marks.shrink_to_fit();
+      invalidate();
+    }
+
+    // Mark the codes as stale, the index is rebuilt on the next query
+
+    void invalidate() {
+      for (int t = 0; t < tables; t++) {
+        buckets[t].clear();
+      }
+      slots.clear();
+      built = false;
+    }
+
+    // Projects a point or a cluster sum onto each hyperplane and
+    // multiplies by scale.
+
+    template<typename P>
+    void project(const P &pt, FP scale, FP *out) {
+      const int numPlanes = tables * bits;
+      const FP *plane = planes.data();
+      for (int j = 0; j < numPlanes; j++) {
+        FP sum = FP(0.0);
+        for (int d = 0; d < dimensions; d++) {
+          sum += plane[d] * FP(pt[d]);
+        }
+        out[j] = sum * scale;
+        plane += dimensions;
+      }
+    }
+
+    // Converts projections to one code per table
+
+    void encode(const FP *proj, uint32_t *out) {
+      for (int t = 0; t < tables; t++) {
+        uint32_t code = 0;
+        const int base = t * bits;
+        for (int b = 0; b < bits; b++) {
+          if (proj[base + b] >= offsets[base + b]) {
+            code |= (1u << b);
+          }
+        }
+        out[t] = code;
+      }
+    }
+
+    // Computes hyperplane offsets and codes for every cluster
+
+    void build(GvmClusters<S,V,K,FP> &clusters) {
+      const int numPlanes = tables * bits;
+      const int count = clusters.count;
+      std::vector<FP> allProj((size_t)count * numPlanes);
+
+      for (int i = 0; i < count; i++) {
+        GvmCluster<S,V,K,FP> &cluster = *(clusters.clusters[i].get());
+        FP scale = cluster.m0 == FP(0.0) ? FP(0.0) : FP(1.0) / cluster.m0;
+        project(cluster.m1, scale, &allProj[(size_t)i * numPlanes]);
+      }
+
+      std::vector<FP> column(count);
+      for (int j = 0; j < numPlanes; j++) {
+        for (int i = 0; i < count; i++) {
+          column[i] = allProj[(size_t)i * numPlanes + j];
+        }
+        std::nth_element(column.begin(), column.begin() + count / 2, column.end());
+        offsets[j] = count == 0 ? FP(0.0) : column[count / 2];
+      }
+
+      for (int t = 0; t < tables; t++) {
+        buckets[t].clear();
+      }
+      slots.clear();
+      for (int i = 0; i < count; i++) {
+        uint32_t *clusterCodes = &codes[(size_t)i * tables];
+        encode(&allProj[(size_t)i * numPlanes], clusterCodes);
+        for (int t = 0; t < tables; t++) {
+          buckets[t][clusterCodes[t]].push_back(i);
+        }
+        slots[clusters.clusters[i].get()] = i;
+      }
+
+      built = true;
+    }
+
+    // Moves slot from the bucket of oldCode to the bucket of newCode in table t
+
+    void move(int t, int slot, uint32_t oldCode, uint32_t newCode) {
+      auto found = buckets[t].find(oldCode);
+      if (found != buckets[t].end()) {
+        std::vector<int> &bucket = found->second;
+        for (size_t j = 0; j < bucket.size(); j++) {
+          if (bucket[j] == slot) {
+            bucket[j] = bucket.back();
+            bucket.pop_back();
+            break;
+          }
+        }
+        if (bucket.empty()) {
+          buckets[t].erase(found);
+        }
+      }
+      buckets[t][newCode].push_back(slot);
+    }
+
+    // Adds the slots in the bucket of every code that differs from code
+    // in at most radius bits at or above bit first to the candidates.
+
+    void probe(int t, uint32_t code, int first, int radius) {
+      auto bucket = buckets[t].find(code);
+      if (bucket != buckets[t].end()) {
+        for (int slot : bucket->second) {
+          if (marks[slot] != stamp) {
+            marks[slot] = stamp;
+            candidates.push_back(slot);
+          }
+        }
+      }
+      if (radius > 0) {
+        for (int b = first; b < bits; b++) {
+          probe(t, code ^ (1u << b), b + 1, radius - 1);
+        }
+      }
+    }
+
+    // Recompute the code for the cluster in slot
+
+    void update(GvmClusters<S,V,K,FP> &clusters, int slot) {
+      if (!built) {
+        return;
+      }
+      GvmCluster<S,V,K,FP> &cluster = *(clusters.clusters[slot].get());
+      FP scale = cluster.m0 == FP(0.0) ? FP(0.0) : FP(1.0) / cluster.m0;
+      project(cluster.m1, scale, projections.data());
+      encode(projections.data(), pointCodes.data());
+      uint32_t *clusterCodes = &codes[(size_t)slot * tables];
+      for (int t = 0; t < tables; t++) {
+        if (clusterCodes[t] != pointCodes[t]) {
+          move(t, slot, clusterCodes[t], pointCodes[t]);
+          clusterCodes[t] = pointCodes[t];
+        }
+      }
+    }
+
+    void update(GvmClusters<S,V,K,FP> &clusters, GvmCluster<S,V,K,FP> *clusterPtr) {
+      if (!built) {
+        return;
+      }
+      auto found = slots.find(clusterPtr);
+      if (found != slots.end()) {
+        update(clusters, found->second);
+      }
+    }
+
+    // Finds the cheapest cluster to add a point to among the candidates.
+    //
+    // additionT : set to the increase in variance for the returned cluster
+    // additionI : set to the slot of the returned cluster
+
+    template<typename P>
+    GvmCluster<S,V,K,FP>* findAddition(GvmClusters<S,V,K,FP> &clusters, const FP m, P &pt, FP &additionT, int &additionI) {
+      if (!built) {
+        build(clusters);
+      }
+
+      queries++;
+
+      project(pt, FP(1.0), projections.data());
+      encode(projections.data(), pointCodes.data());
+
+      GvmCluster<S,V,K,FP> *additionCPtr = nullptr;
+      additionT = std::numeric_limits<FP>::max();
+      additionI = 0;
+
+      const int count = clusters.count;
+
+      candidates.clear();
+      stamp++;
+      for (int t = 0; t < tables; t++) {
+        probe(t, pointCodes[t], 0, probeRadius);
+      }
+
+      // the lowest slot wins a tie, as in the exact scan
+
+      for (int i : candidates) {
+        scored++;
+        GvmCluster<S,V,K,FP> *clusterPtr = clusters.clusters[i].get();
+        FP t = clusterPtr->test(m, pt);
+        if (t < additionT || (t == additionT && i < additionI)) {
+          additionCPtr = clusterPtr;
+          additionT = t;
+          additionI = i;
+        }
+      }
+
+      if (additionCPtr == nullptr || validate) {
+        GvmCluster<S,V,K,FP> *exactCPtr = nullptr;
+        FP exactT = std::numeric_limits<FP>::max();
+        int exactI = 0;
+        for (int i = 0; i < count; i++) {
+          GvmCluster<S,V,K,FP> *clusterPtr = clusters.clusters[i].get();
+          FP t = clusterPtr->test(m, pt);
+          if (t < exactT) {
+            exactCPtr = clusterPtr;
+            exactT = t;
+            exactI = i;
+          }
+        }
+        if (additionCPtr == nullptr) {
+          fallbacks++;
+          additionCPtr = exactCPtr;
+          additionT = exactT;
+          additionI = exactI;
+        } else if (exactT < additionT) {
+          misses++;
+        }
+      }
+
+      return additionCPtr;
+    }
+
+  }; // end class GvmLshIndex
+
+}
@@ -0,0 +1,92 @@
+//
+//  GvmMemoryReport.hpp
+//  GvmCpp
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+// http://www.apache.org/licenses/LICENSE-2.0
+//
+
+// Bytes used by a GvmClusters instance broken down by component, as
+// estimated before construction by GvmClusters::estimateMemory() or as
+// measured by GvmClusters::memoryReport(). Allocator overhead is not
+// included. The pair storage is reserved address space for every pair at
+// the full capacity, only the pages that hold pairs in use are counted and
+// the reserved size is reported on its own, outside of the total. Pair
+// storage of 2MB or more is advised to use huge pages and is counted in 2MB
+// pages, see GvmClusterPairs::pairsArrayBytesInUse().
+
+#import "GvmCommon.hpp"
+
+#import <stdio.h>
+
+namespace Gvm {
+
+  // Heap bytes owned by a key or a vector outside of the object itself,
+  // a type that owns heap memory can add an overload.
+
+  template<typename T>
+  inline size_t gvmHeapBytes(const T &) {
+    return 0;
+  }
+
+  template<typename T, typename A>
+  inline size_t gvmHeapBytes(const std::vector<T,A> &value) {
+    return value.capacity() * sizeof(T);
+  }
+
+  class GvmMemoryReport {
+  public:
+
+    // GvmClusterPairs pairsArray, one pair for every two clusters, the
+    // pages in use
+
+    size_t pairsArray;
+
+    // GvmClusterPairs pairs, the heap of pointers into pairsArray, the
+    // pages in use
+
+    size_t pairs;
+
+    // The pairs vector of each cluster
+
+    size_t clusterPairs;
+
+    // Cluster objects with their shared_ptr slots and the heap memory
+    // of their vectors
+
+    size_t clusters;
+
+    // Heap memory of the keys held by the clusters
+
+    size_t keys;
+
+    // The GvmClusters object and its scratch arrays
+
+    size_t other;
+
+    // Address space reserved for pairsArray and pairs, not in the total
+
+    size_t reserved;
+
+    GvmMemoryReport()
+    : pairsArray(0), pairs(0), clusterPairs(0), clusters(0), keys(0), other(0), reserved(0)
+    {
+    }
+
+    size_t getTotal() {
+      return pairsArray + pairs + clusterPairs + clusters + keys + other;
+    }
+
+    std::string toString() {
+      char buffer[256];
+      snprintf(buffer, sizeof(buffer), "pairsArray: %zu  pairs: %zu  clusterPairs: %zu  clusters: %zu  keys: %zu  other: %zu  total: %zu  reserved: %zu",
+               pairsArray, pairs, clusterPairs, clusters, keys, other, getTotal(), reserved);
+      return std::string(buffer);
+    }
+
+  }; // end class GvmMemoryReport
+
+}
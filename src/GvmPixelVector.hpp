@@ -0,0 +1,69 @@
+//
+//  GvmPixelVector.hpp
+//  GvmCpp
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+// http://www.apache.org/licenses/LICENSE-2.0
+//
+// Compact input point type for 32 bit BGRA pixels. The cluster
+// accumulators m1 and m2 still use the space vector type V, but
+// a point passed to GvmClusters::add() can be this 4 byte type
+// so that a buffer of pixels can be fed in directly without first
+// widening each pixel into a vector of floating point values.
+// The (B, G, R) components map to dimensions (0, 1, 2) and
+// the alpha channel is ignored.
+//
+// Any other compact type with an operator[] that returns a value
+// convertible to FP can also be passed as an input point, for
+// example GvmStdVector<uint16_t,D> or GvmStdVector<float,D>.
+
+#import "GvmCommon.hpp"
+
+namespace Gvm {
+
+  class GvmPixelVector {
+  public:
+
+    // BGRA pixel with B in the least significant byte
+
+    uint32_t pixel;
+
+    // Number of dimensions
+
+    int getDimensions() {
+      return 3;
+    }
+
+    // constructor
+
+    GvmPixelVector()
+    : pixel(0)
+    {
+    }
+
+    GvmPixelVector(uint32_t inPixel)
+    : pixel(inPixel)
+    {
+    }
+
+    // Read a component as an integer value in the range 0 to 255
+
+    uint32_t operator[](std::size_t idx) const {
+#if defined(DEBUG)
+      assert(idx < 3);
+#endif // DEBUG
+      return (pixel >> (idx * 8)) & 0xFF;
+    };
+
+    std::string toString() {
+      std::stringstream sb;
+      sb << (*this)[0] << " " << (*this)[1] << " " << (*this)[2];
+      return sb.str();
+    }
+
+  }; // end class GvmPixelVector
+
+}
@@ -0,0 +1,313 @@
+//
+//  GvmProjection.hpp
+//  GvmCpp
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+// http://www.apache.org/licenses/LICENSE-2.0
+//
+
+// Random projection stage that sits in front of a GvmClusters instance. High
+// dimensional input points, for example 768 dimensional embeddings, are mapped
+// to a low dimensional space with a sparse Johnson-Lindenstrauss transform
+// before they are clustered, so the cluster scan and the cluster moments cost
+// outputDimensions instead of inputDimensions per cluster.
+//
+// The transform is an inputDimensions x outputDimensions matrix with entries
+// +sqrt(s/k) or -sqrt(s/k) each with probability 1/(2s) and 0 otherwise, where
+// k is the output dimension and s is the sparsity. Squared distances are then
+// preserved in expectation. Since every non-zero entry has the same magnitude,
+// each row of the transform is stored as the lists of output dimensions with a
+// positive and with a negative sign. Projecting a point is then only adds and
+// subtracts of the input values followed by a single scale of the output, on
+// average inputDimensions * k / s adds in place of the inputDimensions * k
+// multiply adds of a dense transform.
+//
+// When keepOriginal is set, a GvmProjectionKeyer is installed on the clusters
+// and the key of each cluster is the mass weighted sum of the original points.
+// The original space centroid of a result is then exact. Otherwise the centroid
+// is approximated by mapping the reduced centroid back through the transpose of
+// the transform.
+
+#import "GvmCommon.hpp"
+
+#import "GvmSimpleKeyer.hpp"
+
+#import <random>
+#import <algorithm>
+
+#import <math.h>
+#import <string.h>
+
+namespace Gvm {
+
+  // S
+  //
+  // Cluster vector space.
+
+  // V
+  //
+  // Cluster vector type.
+
+  // FP
+  //
+  // Floating point type.
+
+  // Sums the original space points of each cluster, the key type is
+  // a std::vector<FP> that holds a mass weighted sum.
+
+  template<typename S, typename V, typename FP>
+  class GvmProjectionKeyer : public GvmSimpleKeyer<S,V,std::vector<FP>,FP> {
+  public:
+
+    GvmProjectionKeyer<S,V,FP>()
+    {
+    }
+
+    // A scaled copy, the caller's key is left alone
+
+    std::vector<FP>* scaleKey(std::vector<FP>* key, FP scale)
+    {
+      if (key == nullptr) {
+        return key;
+      }
+      scaled.resize(key->size());
+      for (size_t i = 0; i < key->size(); i++) {
+        scaled[i] = (*key)[i] * scale;
+      }
+      return &scaled;
+    }
+
+    std::vector<FP>* combineKeys(std::vector<FP>* sum1, std::vector<FP>* sum2)
+    {
+      FP *dst = sum1->data();
+      const FP *src = sum2->data();
+      const int N = (int) sum1->size();
+      for (int i = 0; i < N; i++) {
+        dst[i] += src[i];
+      }
+      return sum1;
+    }
+
+    // Scratch for scaleKey()
+
+    std::vector<FP> scaled;
+
+  }; // end class GvmProjectionKeyer
+
+  template<typename S, typename V, typename FP>
+  class GvmProjection {
+  public:
+
+    typedef std::vector<FP> K;
+
+    // The clusters that projected points are added to.
+
+    GvmClusters<S,V,K,FP> &clusters;
+
+    int inputDimensions;
+
+    int outputDimensions;
+
+    // One in sparsity entries of the transform is non-zero,
+    // a sparsity of 1 gives a dense random sign matrix.
+
+    int sparsity;
+
+    // Magnitude of the non-zero transform entries
+
+    FP value;
+
+    // For input dimension i, the output dimensions with a positive
+    // entry are plusColumns[plusStart[i]] to plusColumns[plusStart[i+1]-1]
+    // and likewise for the negative entries.
+
+    std::vector<int> plusStart;
+    std::vector<int> plusColumns;
+    std::vector<int> minusStart;
+    std::vector<int> minusColumns;
+
+    // Number of points projected together
+
+    int blockSize;
+
+    // When true cluster keys hold the original space sums
+
+    bool keepOriginal;
+
+    GvmProjectionKeyer<S,V,FP> keyer;
+
+    // Scratch space for one block of projected points
+
+    std::vector<FP> block;
+
+    std::vector<FP> keyScratch;
+
+    // constructor
+    //
+    // inClusters : clusters in the reduced space
+    // inInputDimensions : dimensions of the original points
+    // inKeepOriginal : keep original space sums as cluster keys
+    // inSparsity : one in sparsity transform entries is non-zero
+    // seed : random seed for the transform
+
+    GvmProjection<S,V,FP>(GvmClusters<S,V,K,FP> &inClusters, int inInputDimensions, bool inKeepOriginal = true, int inSparsity = 3, uint32_t seed = 1)
+    :
+    clusters(inClusters),
+    inputDimensions(inInputDimensions),
+    sparsity(inSparsity),
+    blockSize(64),
+    keepOriginal(inKeepOriginal)
+    {
+      outputDimensions = clusters.space.getDimensions();
+      assert(inputDimensions >= 1);
+      assert(outputDimensions >= 1);
+      assert(sparsity >= 1);
+
+      value = FP(sqrt(double(sparsity) / double(outputDimensions)));
+
+      std::mt19937 rng(seed);
+      std::uniform_int_distribution<int> pick(0, (2 * sparsity) - 1);
+
+      plusStart.reserve(inputDimensions + 1);
+      minusStart.reserve(inputDimensions + 1);
+      for (int i = 0; i < inputDimensions; i++) {
+        plusStart.push_back((int) plusColumns.size());
+        minusStart.push_back((int) minusColumns.size());
+        for (int j = 0; j < outputDimensions; j++) {
+          int r = pick(rng);
+          if (r == 0) {
+            plusColumns.push_back(j);
+          } else if (r == 1) {
+            minusColumns.push_back(j);
+          }
+        }
+      }
+      plusStart.push_back((int) plusColumns.size());
+      minusStart.push_back((int) minusColumns.size());
+
+      block.resize((size_t)blockSize * outputDimensions);
+      keyScratch.resize(inputDimensions);
+
+      if (keepOriginal) {
+        clusters.setKeyer(&keyer);
+      }
+    }
+
+    // Copy constructor explicitly deleted
+
+    GvmProjection<S,V,FP>(const GvmProjection<S,V,FP> &that) = delete;
+    GvmProjection<S,V,FP>& operator=(const GvmProjection<S,V,FP>& x) = delete;
+
+    // Projects n row major points of inputDimensions into n row major
+    // points of outputDimensions. Zero input values are skipped.
+
+    void projectBatch(const FP *in, int n, FP *out) {
+      const int inD = inputDimensions;
+      const int outD = outputDimensions;
+      const int *pStart = plusStart.data();
+      const int *pCols = plusColumns.data();
+      const int *mStart = minusStart.data();
+      const int *mCols = minusColumns.data();
+
+      memset(out, 0, (size_t)n * outD * sizeof(FP));
+
+      for (int p = 0; p < n; p++) {
+        const FP *x = in + ((size_t)p * inD);
+        FP *o = out + ((size_t)p * outD);
+        for (int i = 0; i < inD; i++) {
+          const FP xi = x[i];
+          if (xi == FP(0.0)) {
+            continue;
+          }
+          for (int k = pStart[i]; k < pStart[i+1]; k++) {
+            o[pCols[k]] += xi;
+          }
+          for (int k = mStart[i]; k < mStart[i+1]; k++) {
+            o[mCols[k]] -= xi;
+          }
+        }
+        for (int j = 0; j < outD; j++) {
+          o[j] *= value;
+        }
+      }
+    }
+
+    void project(const FP *in, FP *out) {
+      projectBatch(in, 1, out);
+    }
+
+    // Maps a reduced space point back to the original space with the
+    // transpose of the transform. This is only an approximation, the
+    // part of the original point outside the projected subspace is lost.
+
+    void backProject(const FP *reduced, FP *out) {
+      for (int i = 0; i < inputDimensions; i++) {
+        FP sum = FP(0.0);
+        for (int k = plusStart[i]; k < plusStart[i+1]; k++) {
+          sum += reduced[plusColumns[k]];
+        }
+        for (int k = minusStart[i]; k < minusStart[i+1]; k++) {
+          sum -= reduced[minusColumns[k]];
+        }
+        out[i] = sum * value;
+      }
+    }
+
+    // Projects n row major points and adds them to the clusters.
+    //
+    // in : n points of inputDimensions
+    // masses : mass of each point, nullptr for a mass of 1
+
+    void add(const FP *in, int n, const FP *masses = nullptr) {
+      const int inD = inputDimensions;
+      const int outD = outputDimensions;
+      V pt = clusters.space.newOrigin();
+
+      for (int b = 0; b < n; b += blockSize) {
+        const int num = std::min(blockSize, n - b);
+        projectBatch(in + ((size_t)b * inD), num, block.data());
+
+        for (int p = 0; p < num; p++) {
+          const FP *reduced = &block[(size_t)p * outD];
+          for (int j = 0; j < outD; j++) {
+            pt[j] = reduced[j];
+          }
+          const FP m = masses == nullptr ? FP(1.0) : masses[b + p];
+          if (keepOriginal) {
+            const FP *original = in + ((size_t)(b + p) * inD);
+            for (int i = 0; i < inD; i++) {
+              keyScratch[i] = m * original[i];
+            }
+            clusters.add(m, pt, &keyScratch);
+          } else {
+            clusters.add(m, pt, nullptr);
+          }
+        }
+      }
+    }
+
+    // Original space centroid of a cluster result
+
+    std::vector<FP> originalPoint(GvmResult<S,V,K,FP> &result) {
+      std::vector<FP> out(inputDimensions);
+      if (result.key != nullptr && (int)result.key->size() == inputDimensions) {
+        const FP scale = FP(1.0) / result.mass;
+        for (int i = 0; i < inputDimensions; i++) {
+          out[i] = (*result.key)[i] * scale;
+        }
+      } else {
+        std::vector<FP> reduced(outputDimensions);
+        for (int j = 0; j < outputDimensions; j++) {
+          reduced[j] = result.point[j];
+        }
+        backProject(reduced.data(), out.data());
+      }
+      return out;
+    }
+
+  }; // end class GvmProjection
+
+}
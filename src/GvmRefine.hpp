@@ -0,0 +1,196 @@
+//
+//  GvmRefine.hpp
+//  GvmCpp
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+// http://www.apache.org/licenses/LICENSE-2.0
+//
+
+// Post pass that splits oversized clusters. With a fixed capacity a few
+// clusters often end up holding a large share of the mass and variance.
+// Each result with a variance above a threshold is clustered again on its
+// own: the points of its key are added to a fresh GvmClusters with a small
+// capacity and the children replace the parent in the results. This gives
+// finer detail where it is needed without raising the global capacity and
+// the O(N^2) pair memory that comes with it.
+//
+// The key of a cluster must be a list of point keys, as produced by
+// GvmListKeyer, and the caller supplies a function that converts one
+// element of a key back to a point and its mass. The selected clusters are
+// refined on numThreads threads, each thread takes the next cluster from a
+// shared counter so that a few large clusters do not hold up the others.
+// All the threads share the space, so it must be safe for concurrent use,
+// the built in spaces are.
+//
+// The children are owned by this object, so the keys of the refined results
+// remain valid until clear() is invoked. Results can be refined again since
+// each refine() keeps the children of the earlier ones.
+
+#import "GvmCommon.hpp"
+
+#import "GvmClusters.hpp"
+#import "GvmListKeyer.hpp"
+
+#import <thread>
+#import <atomic>
+
+namespace Gvm {
+
+  // S
+  //
+  // Cluster vector space.
+
+  // V
+  //
+  // Cluster vector type.
+
+  // K
+  //
+  // Type of key, a list of point keys.
+
+  // FP
+  //
+  // Floating point type.
+
+  template<typename S, typename V, typename K, typename FP>
+  class GvmRefine {
+  public:
+
+    S space;
+
+    // Number of children each refined cluster is split into
+
+    int splitCount;
+
+    // Number of threads, 0 uses the hardware concurrency
+
+    int numThreads;
+
+    // Number of clusters refined by the last refine()
+
+    int refined;
+
+    GvmListKeyer<S,V,K,FP> listKeyer;
+
+    // Clusters that hold the children of each refined cluster
+
+    std::vector<std::unique_ptr<GvmClusters<S,V,K,FP> > > children;
+
+    // constructor
+    //
+    // inSpace : cluster vector space
+    // inSplitCount : the max number of children for each refined cluster
+
+    GvmRefine<S,V,K,FP>(S inSpace, int inSplitCount)
+    :
+    space(inSpace),
+    splitCount(inSplitCount),
+    numThreads(0),
+    refined(0)
+    {
+      assert(splitCount >= 2);
+    }
+
+    // Copy constructor explicitly deleted
+
+    GvmRefine<S,V,K,FP>(const GvmRefine<S,V,K,FP> &that) = delete;
+    GvmRefine<S,V,K,FP>& operator=(const GvmRefine<S,V,K,FP>& x) = delete;
+
+    // Releases the children of every refine()
+
+    void clear() {
+      children.clear();
+      refined = 0;
+    }
+
+    // Splits each result with a variance greater than maxVariance.
+    //
+    // results : results from GvmClusters::results()
+    // maxVariance : results with a greater variance are refined
+    // pointOf : FP pointOf(const typename K::value_type &element, V &pt)
+    // sets pt to the point for one element of a key and returns its mass
+    // return the results with each refined result replaced by its children
+
+    template<typename F>
+    std::vector<GvmResult<S,V,K,FP>> refine(std::vector<GvmResult<S,V,K,FP>> &results, FP maxVariance, F pointOf) {
+      std::vector<int> selected;
+      for (int i = 0; i < (int) results.size(); i++) {
+        GvmResult<S,V,K,FP> &result = results[i];
+        if (result.getVariance() > maxVariance && result.key != nullptr && result.key->size() > 1) {
+          selected.push_back(i);
+        }
+      }
+
+      const int N = (int) selected.size();
+      const int first = (int) children.size();
+      for (int i = 0; i < N; i++) {
+        children.push_back(std::unique_ptr<GvmClusters<S,V,K,FP> >(new GvmClusters<S,V,K,FP>(space, splitCount)));
+        children.back()->setKeyer(&listKeyer);
+        children.back()->numThreads = 1;
+      }
+
+      std::atomic<int> next(0);
+
+      auto worker = [&]() {
+        for (int j = next++; j < N; j = next++) {
+          split(*(results[selected[j]].key), *(children[first + j].get()), pointOf);
+        }
+      };
+
+      int T = numThreads;
+      if (T == 0) {
+        T = (int) std::thread::hardware_concurrency();
+      }
+      if (T > N) {
+        T = N;
+      }
+      if (T <= 1) {
+        worker();
+      } else {
+        std::vector<std::thread> threads;
+        for (int t = 0; t < T; t++) {
+          threads.push_back(std::thread(worker));
+        }
+        for ( auto &thread : threads ) {
+          thread.join();
+        }
+      }
+
+      refined = N;
+
+      std::vector<GvmResult<S,V,K,FP>> list;
+      int j = 0;
+      for (int i = 0; i < (int) results.size(); i++) {
+        if (j < N && selected[j] == i) {
+          std::vector<GvmResult<S,V,K,FP>> split = children[first + j]->results();
+          list.insert(list.end(), split.begin(), split.end());
+          j++;
+        } else {
+          list.push_back(results[i]);
+        }
+      }
+      return list;
+    }
+
+  protected:
+
+    // Clusters the elements of one key
+
+    template<typename F>
+    void split(K &key, GvmClusters<S,V,K,FP> &clusters, F pointOf) {
+      V pt = space.newOrigin();
+      K elementKey;
+      for ( auto &element : key ) {
+        FP m = pointOf(element, pt);
+        elementKey.clear();
+        elementKey.push_back(element);
+        clusters.add(m, pt, &elementKey);
+      }
+    }
+
+  }; // end class GvmRefine
+
+}
@@ -83,6 +83,23 @@ namespace Gvm {
       space.scale(point, FP(1.0) / mass);
     }
     
+    // constructor from the moments of a cluster
+    //
+    // m1 : the mass weighted sum of the points
+    // var : the mass weighted variance, as held by GvmCluster
+    
+    GvmResult(S inSpace, int inCount, FP inMass, V &m1, FP var, K *inKey)
+    : space(inSpace)
+    {
+      count = inCount;
+      mass = inMass;
+      variance = var / mass;
+      stdDeviation = FP(-1.0);
+      key = inKey;
+      point = space.newCopy(m1);
+      space.scale(point, FP(1.0) / mass);
+    }
+    
     // getters
     
     // The number of points in the cluster.
@@ -0,0 +1,143 @@
+//
+//  GvmRunLength.hpp
+//  GvmCpp
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+// http://www.apache.org/licenses/LICENSE-2.0
+//
+
+// Scanline ingestion helper. A row of 32 bit pixels is scanned for runs of
+// identical values and each run is passed to GvmClusters::add() as a single
+// point with a mass equal to the run length. Images with large flat areas
+// (screenshots, synthetic images, letterboxed video) contain long runs, so
+// this cuts the number of add() calls without changing the clustered mass.
+//
+// Note that the cluster count reported by GvmCluster and GvmResult is
+// the number of runs added, not the number of pixels.
+
+#import "GvmCommon.hpp"
+
+#if defined(__SSE2__)
+#import <emmintrin.h>
+#elif defined(__ARM_NEON) && defined(__aarch64__)
+#import <arm_neon.h>
+#endif
+
+namespace Gvm {
+  // S
+  //
+  // Cluster vector space.
+
+  // V
+  //
+  // Cluster vector type.
+
+  // K
+  //
+  // Type of key.
+
+  // FP
+  //
+  // Floating point type.
+
+  template<typename S, typename V, typename K, typename FP>
+  class GvmRunLength {
+  public:
+
+    // Returns the number of pixels starting at offset that are equal to
+    // row[offset], the result is always at least 1. Pixels are compared
+    // 4 at a time with SIMD instructions when available.
+
+    static inline
+    int runLength(const uint32_t *row, int offset, int width) {
+#if defined(DEBUG)
+      assert(offset >= 0);
+      assert(offset < width);
+#endif // DEBUG
+
+      const uint32_t pixel = row[offset];
+      int i = offset + 1;
+
+#if defined(__SSE2__)
+      const __m128i pixel4 = _mm_set1_epi32((int)pixel);
+      for ( ; (i + 4) <= width; i += 4) {
+        __m128i vec = _mm_loadu_si128((const __m128i *) &row[i]);
+        int mask = _mm_movemask_ps(_mm_castsi128_ps(_mm_cmpeq_epi32(vec, pixel4)));
+        if (mask != 0xF) {
+          return i + __builtin_ctz(~mask) - offset;
+        }
+      }
+#elif defined(__ARM_NEON) && defined(__aarch64__)
+      const uint32x4_t pixel4 = vdupq_n_u32(pixel);
+      for ( ; (i + 4) <= width; i += 4) {
+        uint32x4_t eq = vceqq_u32(vld1q_u32(&row[i]), pixel4);
+        if (vminvq_u32(eq) == 0) {
+          break;
+        }
+      }
+#endif // __SSE2__
+
+      for ( ; i < width; i++) {
+        if (row[i] != pixel) {
+          break;
+        }
+      }
+
+      return i - offset;
+    }
+
+    // Adds a row of pixels to clusters with each run of identical pixels
+    // folded into a single add().
+    //
+    // clusters : the clusters points are added to
+    // row : buffer of width pixels
+    // convertPoint : functor invoked as convertPoint(pixel, pt) to fill
+    // the point coordinates for a pixel
+    // keyForRun : functor invoked as keyForRun(runPtr, runLength, key) to
+    // attach keys for every pixel in the run to a tmp key in bulk
+    // return the number of add() calls that were made
+
+    template<typename C, typename F>
+    static
+    int addRow(GvmClusters<S,V,K,FP> &clusters, const uint32_t *row, int width, C convertPoint, F keyForRun) {
+      V pt = clusters.space.newOrigin();
+      int numAdds = 0;
+
+      for (int offset = 0; offset < width; ) {
+        const int n = runLength(row, offset, width);
+        convertPoint(row[offset], pt);
+        K key;
+        keyForRun(&row[offset], n, key);
+        clusters.add(FP(n), pt, &key);
+        offset += n;
+        numAdds++;
+      }
+
+      return numAdds;
+    }
+
+    // Adds a row of pixels without keys.
+
+    template<typename C>
+    static
+    int addRow(GvmClusters<S,V,K,FP> &clusters, const uint32_t *row, int width, C convertPoint) {
+      V pt = clusters.space.newOrigin();
+      int numAdds = 0;
+
+      for (int offset = 0; offset < width; ) {
+        const int n = runLength(row, offset, width);
+        convertPoint(row[offset], pt);
+        clusters.add(FP(n), pt, nullptr);
+        offset += n;
+        numAdds++;
+      }
+
+      return numAdds;
+    }
+
+  }; // end class GvmRunLength
+
+}
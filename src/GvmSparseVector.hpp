@@ -0,0 +1,118 @@
+//
+//  GvmSparseVector.hpp
+//  GvmCpp
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+// http://www.apache.org/licenses/LICENSE-2.0
+//
+// Sparse input point for high dimensional features like bag of words or
+// hashed feature vectors with tens of thousands of dimensions and only a
+// few dozen non-zero values. Only the non-zero (index, value) entries are
+// stored along with the cached squared magnitude. A sparse point is passed
+// to GvmClusters::add() as an input point for a GvmSparseVectorSpace, the
+// cluster accumulators remain dense GvmDynVector rows.
+
+#import "GvmCommon.hpp"
+
+#import <algorithm>
+
+namespace Gvm {
+
+  // FP
+  //
+  // Floating point type.
+
+  template<typename FP>
+  class GvmSparseVector {
+  public:
+
+    // Number of dimensions
+
+    int dimensions;
+
+    // Indexes of the non-zero values in ascending order
+
+    std::vector<int> indexes;
+
+    // The non-zero values
+
+    std::vector<FP> values;
+
+    // Squared magnitude of the values
+
+    FP magnitudeSqrValue;
+
+    // constructor
+
+    GvmSparseVector<FP>(int inDimensions = 0)
+    : dimensions(inDimensions), magnitudeSqrValue(0.0)
+    {
+    }
+
+    int getDimensions() {
+      return dimensions;
+    }
+
+    // Number of non-zero values
+
+    int getNonZeroCount() const {
+      return (int) indexes.size();
+    }
+
+    // Removes all values
+
+    void clear() {
+      indexes.clear();
+      values.clear();
+      magnitudeSqrValue = FP(0.0);
+    }
+
+    // Appends a value, indexes must be pushed in ascending order.
+
+    void push(int index, FP value) {
+#if defined(DEBUG)
+      assert(index >= 0 && index < dimensions);
+      assert(indexes.empty() || indexes.back() < index);
+#endif // DEBUG
+      if (value == FP(0.0)) {
+        return;
+      }
+      indexes.push_back(index);
+      values.push_back(value);
+      magnitudeSqrValue += value * value;
+    }
+
+    FP magnitudeSqr() const {
+      return magnitudeSqrValue;
+    }
+
+    // Read a value by dimension, this is a binary search and is
+    // only intended for generic code that is not performance critical.
+
+    FP operator[](std::size_t idx) const {
+      auto it = std::lower_bound(indexes.begin(), indexes.end(), (int)idx);
+      if (it == indexes.end() || *it != (int)idx) {
+        return FP(0.0);
+      }
+      return values[it - indexes.begin()];
+    };
+
+    std::string toString() {
+      std::stringstream sb;
+
+      for (int i = 0; i < (int)indexes.size(); i++) {
+        if (i > 0) {
+          sb << " ";
+        }
+        sb << indexes[i] << ":" << values[i];
+      }
+
+      return sb.str();
+    }
+
+  }; // end class GvmSparseVector
+
+}
@@ -0,0 +1,159 @@
+//
+//  GvmSparseVectorSpace.hpp
+//  GvmCpp
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+// http://www.apache.org/licenses/LICENSE-2.0
+//
+// Vector space for sparse input points. The cluster moments m1 and m2 are
+// dense GvmDynVector rows exactly as in GvmDynVectorSpace, but an input point
+// is a GvmSparseVector. Testing a sparse point against a cluster is a sparse
+// dense dot product between the point and the cluster m1 row, combined with
+// the cached squared magnitudes and m2 sum, so it costs O(nnz) instead of O(D).
+// Adding a sparse point to a cluster scatters the non-zero values into the
+// dense rows and updates the cached values incrementally, this is also O(nnz).
+
+#import "GvmCommon.hpp"
+
+#import "GvmDynVectorSpace.hpp"
+#import "GvmSparseVector.hpp"
+
+namespace Gvm {
+
+  // V
+  //
+  // Dense vector type, this must be GvmDynVector<FP>.
+
+  // FP
+  //
+  // Floating point type.
+
+  template<typename V, typename FP>
+  class GvmSparseVectorSpace : public GvmDynVectorSpace<V,FP> {
+  public:
+
+    typedef GvmSparseVector<FP> SV;
+
+    using GvmDynVectorSpace<V,FP>::setToScaled;
+    using GvmDynVectorSpace<V,FP>::setToScaledSqr;
+    using GvmDynVectorSpace<V,FP>::addScaled;
+    using GvmDynVectorSpace<V,FP>::addScaledSqr;
+    using GvmDynVectorSpace<V,FP>::variance;
+
+    // constructor
+
+    GvmSparseVectorSpace(int D, int rowsPerBlock = 1024)
+    : GvmDynVectorSpace<V,FP>(D, rowsPerBlock)
+    {
+    }
+
+    // Empty sparse point with the dimensions of this space
+
+    SV newSparse() {
+      return SV(this->getDimensions());
+    }
+
+    // Sparse dense dot product
+
+    static inline
+    FP dot(const V &dense, const SV &sparse) {
+      const FP *values = dense.values;
+      const int N = (int) sparse.indexes.size();
+      const int *indexes = sparse.indexes.data();
+      const FP *sparseValues = sparse.values.data();
+      FP sum = FP(0.0);
+      for (int i = 0; i < N; i++) {
+        sum += values[indexes[i]] * sparseValues[i];
+      }
+      return sum;
+    }
+
+    // Sparse input point operations
+
+    void setToScaled(V &dstPt, FP m, const SV &srcPt) {
+      this->setToOrigin(dstPt);
+      FP sum = FP(0.0);
+      const int N = (int) srcPt.indexes.size();
+      for (int i = 0; i < N; i++) {
+        FP v = m * srcPt.values[i];
+        dstPt.values[srcPt.indexes[i]] = v;
+        sum += v;
+      }
+      dstPt.cachedSum = sum;
+      dstPt.cachedMagnitudeSqr = m * m * srcPt.magnitudeSqr();
+      dstPt.dirty = false;
+    }
+
+    void setToScaledSqr(V &dstPt, FP m, const SV &srcPt) {
+      this->setToOrigin(dstPt);
+      FP sum = FP(0.0);
+      FP magSqr = FP(0.0);
+      const int N = (int) srcPt.indexes.size();
+      for (int i = 0; i < N; i++) {
+        FP c = srcPt.values[i];
+        FP v = m * (c * c);
+        dstPt.values[srcPt.indexes[i]] = v;
+        sum += v;
+        magSqr += v * v;
+      }
+      dstPt.cachedSum = sum;
+      dstPt.cachedMagnitudeSqr = magSqr;
+      dstPt.dirty = false;
+    }
+
+    void addScaled(V &dstPt, FP m, const SV &srcPt) {
+      const bool dirty = dstPt.dirty;
+      FP sum = FP(0.0);
+      FP magDelta = FP(0.0);
+      const int N = (int) srcPt.indexes.size();
+      for (int i = 0; i < N; i++) {
+        FP &dst = dstPt.values[srcPt.indexes[i]];
+        FP old = dst;
+        FP v = m * srcPt.values[i];
+        dst = old + v;
+        sum += v;
+        magDelta += (dst * dst) - (old * old);
+      }
+      if (!dirty) {
+        dstPt.cachedSum += sum;
+        dstPt.cachedMagnitudeSqr += magDelta;
+      }
+    }
+
+    void addScaledSqr(V &dstPt, FP m, const SV &srcPt) {
+      const bool dirty = dstPt.dirty;
+      FP sum = FP(0.0);
+      FP magDelta = FP(0.0);
+      const int N = (int) srcPt.indexes.size();
+      for (int i = 0; i < N; i++) {
+        FP &dst = dstPt.values[srcPt.indexes[i]];
+        FP old = dst;
+        FP c = srcPt.values[i];
+        FP v = m * (c * c);
+        dst = old + v;
+        sum += v;
+        magDelta += (dst * dst) - (old * old);
+      }
+      if (!dirty) {
+        dstPt.cachedSum += sum;
+        dstPt.cachedMagnitudeSqr += magDelta;
+      }
+    }
+
+    // Variance of a cluster with a sparse point x of mass m2 added,
+    // S2 + m2 |x|^2 - (Q + 2 m2 (m1 . x) + m2^2 |x|^2) / (m0 + m2)
+
+    FP variance(const FP m1, const V &pt1, const V &ptSqr1, const FP m2, const SV &pt2) {
+      const FP m0 = m1 + m2;
+      const FP xx = pt2.magnitudeSqr();
+      const FP cx = dot(pt1, pt2);
+      const FP cc = pt1.magnitudeSqr() + (FP(2.0) * m2 * cx) + (m2 * m2 * xx);
+      return ptSqr1.sum() + (m2 * xx) - (cc / m0);
+    }
+
+  }; // end class GvmSparseVectorSpace
+
+}
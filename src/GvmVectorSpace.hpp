@@ -42,7 +42,7 @@ namespace Gvm {
     
     // constructor
     
-    GvmVectorSpace<FP,D>()
+    GvmVectorSpace()
     {
       assert(D >= 1);
     }
@@ -123,6 +123,40 @@ namespace Gvm {
       }
     }
     
+    // Compact input point operations. P is an input point type
+    // like GvmPixelVector whose values are converted to FP as
+    // they are read, the destination is always a V accumulator.
+
+    template<typename P>
+    void setToScaled(V &dstPt, FP m, const P &srcPt) {
+      for (int i = 0; i < D; i++) {
+        dstPt[i] = m * FP(srcPt[i]);
+      }
+    }
+
+    template<typename P>
+    void setToScaledSqr(V &dstPt, FP m, const P &srcPt) {
+      for (int i = 0; i < D; i++) {
+        FP c = FP(srcPt[i]);
+        dstPt[i] = m * (c * c);
+      }
+    }
+
+    template<typename P>
+    void addScaled(V &dstPt, FP m, const P &srcPt) {
+      for (int i = 0; i < D; i++) {
+        dstPt[i] += m * FP(srcPt[i]);
+      }
+    }
+
+    template<typename P>
+    void addScaledSqr(V &dstPt, FP m, const P &srcPt) {
+      for (int i = 0; i < D; i++) {
+        FP c = FP(srcPt[i]);
+        dstPt[i] += m * (c * c);
+      }
+    }
+
     void subtract(V &dstPt, V &srcPt) {
       for (int i = 0; i < D; i++) {
         dstPt[i] -= srcPt[i];
@@ -193,6 +227,20 @@ namespace Gvm {
       return sum;
     }
     
+    template<typename P>
+    FP variance(const FP m1, const V &pt1, const V &ptSqr1, const FP m2, const P &pt2) {
+      const FP m0 = m1 + m2;
+      const FP m0Mult = FP(1.0) / m0;
+      FP sum = FP(0.0);
+      for (int i = 0; i < D; i++) {
+        FP c2 = FP(pt2[i]);
+        FP c = pt1[i] + (m2 * c2);
+        FP cSqr = ptSqr1[i] + (m2 * (c2 * c2));
+        sum += cSqr - ((c * c) * m0Mult);
+      }
+      return sum;
+    }
+    
     FP variance(const FP m1, const V &pt1, const V &ptSqr1, const FP m2, const V &pt2, const V &ptSqr2) {
       const FP m0 = m1 + m2;
       const FP m0Mult = FP(1.0) / m0;